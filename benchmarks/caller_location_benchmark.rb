@@ -0,0 +1,55 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+# Compares the cost of getting a single caller frame via Backtracie.caller_location versus via caller_locations.
+#
+# Usage: bundle exec rake compile && bundle exec ruby benchmarks/caller_location_benchmark.rb
+
+$LOAD_PATH.unshift(File.expand_path("../lib", __dir__))
+
+require "backtracie"
+require "benchmark"
+
+STACK_DEPTH = 100
+ITERATIONS = 20_000
+
+def at_depth(depth, &block)
+  (depth > 0) ? at_depth(depth - 1, &block) : yield
+end
+
+def nanoseconds_per_call
+  elapsed = Benchmark.realtime { ITERATIONS.times { yield } }
+  (elapsed * 1_000_000_000 / ITERATIONS).round(1)
+end
+
+benchmarks = {
+  "Backtracie.caller_location" => proc { Backtracie.caller_location },
+  "Backtracie.caller_locations(1, 1).first" => proc { Backtracie.caller_locations(1, 1).first },
+  "Kernel.caller_locations(1, 1).first" => proc { Kernel.caller_locations(1, 1).first }
+}
+
+at_depth(STACK_DEPTH) do
+  # Warmup
+  benchmarks.each_value { |benchmark| nanoseconds_per_call(&benchmark) }
+
+  benchmarks.each do |name, benchmark|
+    puts "#{name.ljust(42)} => #{nanoseconds_per_call(&benchmark)} ns/call"
+  end
+end
@@ -0,0 +1,48 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+# Compares two sets of results from benchmarks/suite.rb, e.g. from before and after a change.
+#
+# Usage: bundle exec ruby benchmarks/compare.rb before.json after.json
+
+require "json"
+
+if ARGV.size != 2
+  abort "Usage: #{$PROGRAM_NAME} before.json after.json"
+end
+
+before, after = ARGV.map { |path| JSON.parse(File.read(path)) }
+
+results_by_benchmark = before["results"].map { |result| [[result["name"], result["depth"]], result] }.to_h
+
+puts "before: #{before["ruby"]}, backtracie #{before["backtracie"]}"
+puts "after:  #{after["ruby"]}, backtracie #{after["backtracie"]}"
+puts
+
+after["results"].each do |result|
+  previous = results_by_benchmark[[result["name"], result["depth"]]]
+  next unless previous
+
+  ratio = result["ns_per_call"] / previous["ns_per_call"]
+  puts "#{result["name"].ljust(38)} depth #{result["depth"].to_s.ljust(6)} " \
+    "#{previous["ns_per_call"].to_s.rjust(12)} => #{result["ns_per_call"].to_s.rjust(12)} ns/call " \
+    "(#{format("%.2fx", ratio)}), " \
+    "#{previous["allocations_per_call"]} => #{result["allocations_per_call"]} allocations/call"
+end
@@ -0,0 +1,52 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+# Measures the per-frame cost of Backtracie.caller_locations with and without the debug information.
+#
+# Usage: bundle exec rake compile && bundle exec ruby benchmarks/debug_hash_benchmark.rb
+
+$LOAD_PATH.unshift(File.expand_path("../lib", __dir__))
+
+require "backtracie"
+require "benchmark"
+
+STACK_DEPTH = 100
+ITERATIONS = 2_000
+
+def at_depth(depth, &block)
+  (depth > 0) ? at_depth(depth - 1, &block) : yield
+end
+
+def nanoseconds_per_frame(debug:)
+  frames = 0
+  elapsed = Benchmark.realtime do
+    ITERATIONS.times { frames += Backtracie.caller_locations(debug: debug).size }
+  end
+  (elapsed * 1_000_000_000 / frames).round(1)
+end
+
+at_depth(STACK_DEPTH) do
+  # Warmup
+  nanoseconds_per_frame(debug: false)
+  nanoseconds_per_frame(debug: true)
+
+  puts "debug: false => #{nanoseconds_per_frame(debug: false)} ns/frame"
+  puts "debug: true  => #{nanoseconds_per_frame(debug: true)} ns/frame"
+end
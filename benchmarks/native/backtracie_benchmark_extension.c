@@ -0,0 +1,114 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+
+#include "backtracie.h"
+
+// This extension only uses the public backtracie API (it gets linked against
+// whatever backtracie_native_extension was loaded before it), so it measures
+// exactly what other native gems get when using backtracie.
+//
+// Every benchmark runs its loop in C and returns how many frames it processed;
+// timing and allocation counting is done by the caller on the Ruby side.
+
+#define FRAME_NAME_MAX_LEN 512
+
+static VALUE capture_frame_for_thread(VALUE self, VALUE iterations);
+static VALUE frame_name_cstr(VALUE self, VALUE iterations);
+static VALUE minimal_frame_name_cstr(VALUE self, VALUE iterations);
+
+void Init_backtracie_benchmark_extension(void) {
+  VALUE backtracie_module = rb_define_module("Backtracie");
+  VALUE native_benchmarks =
+      rb_define_module_under(backtracie_module, "NativeBenchmarks");
+
+  rb_define_module_function(native_benchmarks, "capture_frame_for_thread",
+                            capture_frame_for_thread, 1);
+  rb_define_module_function(native_benchmarks, "frame_name_cstr",
+                            frame_name_cstr, 1);
+  rb_define_module_function(native_benchmarks, "minimal_frame_name_cstr",
+                            minimal_frame_name_cstr, 1);
+}
+
+// Captures every frame of the current thread, one at a time, iterations times
+static VALUE capture_frame_for_thread(VALUE self, VALUE iterations) {
+  VALUE thread = rb_thread_current();
+  long iterations_count = NUM2LONG(iterations);
+  long frames = 0;
+
+  for (long i = 0; i < iterations_count; i++) {
+    int frame_count = backtracie_frame_count_for_thread(thread);
+    for (int j = 0; j < frame_count; j++) {
+      raw_location loc;
+      if (backtracie_capture_frame_for_thread(thread, j, &loc)) {
+        frames++;
+      }
+    }
+  }
+
+  return LONG2NUM(frames);
+}
+
+// Names every frame of the current thread iterations times (the frames
+// themselves only get captured once)
+static VALUE frame_name_cstr(VALUE self, VALUE iterations) {
+  VALUE thread = rb_thread_current();
+  long iterations_count = NUM2LONG(iterations);
+  long frames = 0;
+
+  int max_frame_count = backtracie_frame_count_for_thread(thread);
+  raw_location *locs = ALLOC_N(raw_location, max_frame_count);
+  int frame_count =
+      backtracie_capture_frames_for_thread(thread, 0, max_frame_count, locs);
+
+  char name[FRAME_NAME_MAX_LEN];
+  for (long i = 0; i < iterations_count; i++) {
+    for (int j = 0; j < frame_count; j++) {
+      backtracie_frame_name_cstr(&locs[j], name, sizeof(name));
+      frames++;
+    }
+  }
+
+  xfree(locs);
+  return LONG2NUM(frames);
+}
+
+// Same as frame_name_cstr, but for minimal_location_t's
+static VALUE minimal_frame_name_cstr(VALUE self, VALUE iterations) {
+  VALUE thread = rb_thread_current();
+  long iterations_count = NUM2LONG(iterations);
+  long frames = 0;
+
+  int max_frame_count = backtracie_frame_count_for_thread(thread);
+  minimal_location_t *locs = ALLOC_N(minimal_location_t, max_frame_count);
+  int frame_count = backtracie_capture_minimal_frames_for_thread(
+      thread, 0, max_frame_count, locs);
+
+  char name[FRAME_NAME_MAX_LEN];
+  for (long i = 0; i < iterations_count; i++) {
+    for (int j = 0; j < frame_count; j++) {
+      backtracie_minimal_frame_name_cstr(&locs[j], name, sizeof(name));
+      frames++;
+    }
+  }
+
+  xfree(locs);
+  return LONG2NUM(frames);
+}
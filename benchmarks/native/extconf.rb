@@ -0,0 +1,32 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+# Builds the native side of the benchmark suite; see benchmarks/suite.rb.
+# This extension is never shipped, it only relies on backtracie's public header (its symbols get resolved against the
+# already-loaded backtracie_native_extension).
+
+require "mkmf"
+
+$CFLAGS << " " << "-Wno-declaration-after-statement"
+$CFLAGS << " " << "-Werror-implicit-function-declaration"
+$CFLAGS << " " << "-std=gnu99" if RUBY_VERSION < "2.4"
+$INCFLAGS << " " << "-I#{File.expand_path("../../ext/backtracie_native_extension/public", __dir__)}"
+
+create_makefile "backtracie_benchmark_extension"
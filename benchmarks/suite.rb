@@ -0,0 +1,117 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+# Measures the cost of capturing and symbolizing stacks at several stack depths, both via the Ruby APIs and via the
+# public C API (using the extension in benchmarks/native), and prints the results as JSON.
+#
+# Usage: bundle exec rake benchmark (or bundle exec rake benchmark OUTPUT=results.json)
+#
+# Results from different versions can then be compared with benchmarks/compare.rb.
+
+$LOAD_PATH.unshift(File.expand_path("../lib", __dir__))
+
+require "backtracie"
+require "json"
+require_relative "native/backtracie_benchmark_extension"
+
+STACK_DEPTHS = [10, 100, 1_000, 10_000]
+FRAMES_PER_BENCHMARK = 200_000
+
+BENCHMARKS = {
+  "Backtracie.caller_locations" => proc { |iterations|
+    frames = 0
+    iterations.times { frames += Backtracie.caller_locations.size }
+    frames
+  },
+  "Kernel#caller_locations" => proc { |iterations|
+    frames = 0
+    iterations.times { frames += Kernel.caller_locations.size }
+    frames
+  },
+  "Thread#backtrace_locations" => proc { |iterations|
+    frames = 0
+    iterations.times { frames += Thread.current.backtrace_locations.size }
+    frames
+  },
+  "backtracie_capture_frame_for_thread" => proc { |iterations|
+    Backtracie::NativeBenchmarks.capture_frame_for_thread(iterations)
+  },
+  "backtracie_frame_name_cstr" => proc { |iterations|
+    Backtracie::NativeBenchmarks.frame_name_cstr(iterations)
+  },
+  "backtracie_minimal_frame_name_cstr" => proc { |iterations|
+    Backtracie::NativeBenchmarks.minimal_frame_name_cstr(iterations)
+  }
+}
+
+# Unlike the usual `depth > 0 ? at_depth(depth - 1, &block) : yield`, this doesn't pass along a block, which makes
+# every frame smaller and allows getting to 10k frames without overflowing the VM stack
+def at_depth(depth)
+  (depth > 0) ? at_depth(depth - 1) : $at_depth_callback.call
+end
+
+def run_at_depth(depth, &block)
+  $at_depth_callback = block
+  at_depth(depth)
+ensure
+  $at_depth_callback = nil
+end
+
+def measure(iterations, benchmark)
+  allocations_before = GC.stat(:total_allocated_objects)
+  started_at = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+  frames = benchmark.call(iterations)
+  elapsed_ns = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - started_at
+  allocations = GC.stat(:total_allocated_objects) - allocations_before
+
+  {
+    iterations: iterations,
+    frames_per_call: frames / iterations,
+    ns_per_call: (elapsed_ns.to_f / iterations).round(1),
+    ns_per_frame: (elapsed_ns.to_f / frames).round(1),
+    allocations_per_call: (allocations.to_f / iterations).round(2)
+  }
+end
+
+results = STACK_DEPTHS.flat_map do |depth|
+  iterations = [FRAMES_PER_BENCHMARK / depth, 10].max
+
+  run_at_depth(depth) do
+    BENCHMARKS.map do |name, benchmark|
+      warn "Running #{name} at depth #{depth}..."
+
+      measure([iterations / 10, 1].max, benchmark) # Warmup
+      {name: name, depth: depth}.merge(measure(iterations, benchmark))
+    end
+  end
+end
+
+output = JSON.pretty_generate(
+  ruby: RUBY_DESCRIPTION,
+  backtracie: Backtracie::VERSION,
+  results: results
+)
+
+if ARGV[0]
+  File.write(ARGV[0], output + "\n")
+  warn "Results written to #{ARGV[0]}"
+else
+  puts output
+end
@@ -25,6 +25,7 @@
 
 #include <ruby.h>
 #include <ruby/debug.h>
+#include <ruby/encoding.h>
 #include <ruby/intern.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -39,22 +40,109 @@
 // non-static, used in backtracie_frames.c
 VALUE backtracie_main_object_instance = Qnil;
 VALUE backtracie_frame_wrapper_class = Qnil;
+VALUE backtracie_minimal_frame_wrapper_class = Qnil;
+// non-static, used in backtracie_frame_table.c
+VALUE backtracie_frame_table_class = Qnil;
 
 static ID ensure_object_is_thread_id;
 static ID to_s_id;
+static ID lazy_id;
+static ID debug_id;
+static ID filter_id;
+static ID scratch_frame_wrapper_id;
+#if defined(PRE_RB_INTERNED_STR) && !defined(PRE_STR_UMINUS_DEDUP)
+static ID uminus_id;
+#endif
+static VALUE in_native_code_str = Qnil;
 static VALUE backtracie_module = Qnil;
 static VALUE backtracie_location_class = Qnil;
+static VALUE backtracie_backtrace_class = Qnil;
+// Default for the debug option, see Backtracie.debug=
+static bool debug_enabled = false;
+
+typedef struct {
+  // Return a Backtracie::Backtrace instead of an array of Backtracie::Location
+  bool lazy;
+  // Include the (expensive to create) debug information in each location
+  bool debug;
+  // These follow the semantics of the start/length arguments of
+  // Kernel#caller_locations: number of frames to skip (after the ignored stack
+  // top frames), and maximum number of frames to return (-1 means all).
+  long start;
+  long length;
+  // Alternatively, a Range can be used instead of start/length (and then it
+  // will be non-nil)
+  VALUE range;
+  // Backtracie::Filter for the frames to return, or nil
+  VALUE filter;
+} collect_options;
 
-static VALUE primitive_caller_locations(VALUE self);
-static VALUE primitive_backtrace_locations(VALUE self, VALUE thread);
+// A chunk of the frames of a thread, used when yielding locations one at a time
+typedef struct {
+  VALUE thread;
+  // Keeps the frames below marked while we create locations for them
+  VALUE frame_wrapper;
+  raw_location *frames;
+  int len;
+  // Index (in the stack) of the first frame of the chunk
+  long start;
+  int capa;
+  // When true, there are no more frames after this chunk
+  bool complete;
+} location_chunk;
+
+static VALUE primitive_caller_locations(VALUE self, VALUE thread, VALUE start,
+                                        VALUE length, VALUE lazy, VALUE debug,
+                                        VALUE filter);
+static VALUE primitive_backtrace_locations(int argc, VALUE *argv, VALUE self);
+static VALUE primitive_caller_location(int argc, VALUE *argv, VALUE self);
+static VALUE primitive_each_caller_location(int argc, VALUE *argv, VALUE self);
+static VALUE primitive_each_backtrace_location(int argc, VALUE *argv,
+                                               VALUE self);
+static void yield_locations(VALUE thread, long skip, bool snapshot,
+                            bool debug, VALUE filter);
+static void capture_next_chunk(location_chunk *chunk, int first_frame);
+static VALUE primitive_all_thread_backtraces(int argc, VALUE *argv,
+                                             VALUE self);
+static VALUE set_debug(VALUE self, VALUE enabled);
+static VALUE is_debug(VALUE self);
+static bool debug_option(VALUE debug);
+static VALUE filter_option(VALUE filter, bool lazy);
+static void parse_start_and_length(VALUE start, VALUE length,
+                                   collect_options *options);
 static VALUE collect_backtrace_locations(VALUE self, VALUE thread,
-                                         int ignored_stack_top_frames);
+                                         int ignored_stack_top_frames,
+                                         collect_options options);
+static VALUE raw_frames_to_locations(const raw_location *raw_frames,
+                                     int raw_frames_len,
+                                     const raw_location *caller_ruby_loc,
+                                     bool debug, VALUE filter);
+static VALUE filtered_raw_frames_to_locations(
+    const raw_location *raw_frames, int raw_frames_len,
+    const raw_location *caller_ruby_loc, bool debug, VALUE filter);
+static VALUE capture_frame_wrapper(VALUE thread, long skip, long max);
+static bool capture_frames(VALUE frame_wrapper, VALUE thread, long skip,
+                           long max);
+static bool capture_frames_for_range(VALUE frame_wrapper, VALUE thread,
+                                     long skip, VALUE range);
+static VALUE take_scratch_frame_wrapper(void);
+static void release_scratch_frame_wrapper(VALUE frame_wrapper);
+static void frame_wrapper_drop_frames(VALUE frame_wrapper, long count);
+static void frame_wrapper_truncate(VALUE frame_wrapper, long len);
+static VALUE frame_wrapper_size(VALUE self);
+static VALUE frame_wrapper_fingerprint(VALUE self);
+static VALUE frame_wrapper_location(VALUE self, VALUE index, VALUE debug);
+static VALUE frame_wrapper_dump(VALUE self, VALUE level);
+static VALUE frame_wrapper_load(VALUE klass, VALUE data);
+static VALUE frame_table_size(VALUE self);
+static VALUE frame_table_backtrace_ids(VALUE self, VALUE thread);
+static VALUE frame_table_locations(VALUE self, VALUE ids);
 inline static VALUE new_location(VALUE absolute_path, VALUE base_label,
                                  VALUE label, VALUE lineno, VALUE path,
                                  VALUE qualified_method_name,
                                  VALUE path_is_synthetic, VALUE debug);
 static VALUE frame_to_location(const raw_location *raw_loc,
-                               const raw_location *prev_ruby_loc);
+                               const raw_location *prev_ruby_loc, bool debug);
 static VALUE debug_raw_location(const raw_location *the_location);
 static VALUE debug_frame(VALUE frame);
 static VALUE cfunc_function_info(const raw_location *the_location);
@@ -67,27 +155,95 @@ void Init_backtracie_native_extension(void) {
                  rb_intern("eval"), 1, rb_str_new2("self"));
   ensure_object_is_thread_id = rb_intern("ensure_object_is_thread");
   to_s_id = rb_intern("to_s");
+  lazy_id = rb_intern("lazy");
+  debug_id = rb_intern("debug");
+  filter_id = rb_intern("filter");
+  // No "@" prefix, so this instance variable is not visible from Ruby
+  scratch_frame_wrapper_id = rb_intern("backtracie_scratch_frame_wrapper");
+#if defined(PRE_RB_INTERNED_STR) && !defined(PRE_STR_UMINUS_DEDUP)
+  uminus_id = rb_intern("-@");
+#endif
+  in_native_code_str = backtracie_interned_str_value(
+      rb_str_new_cstr("(in native code)"));
+  rb_global_variable(&in_native_code_str);
 
   backtracie_module = rb_const_get(rb_cObject, rb_intern("Backtracie"));
   rb_global_variable(&backtracie_module);
 
   rb_define_module_function(backtracie_module, "backtrace_locations",
-                            primitive_backtrace_locations, 1);
+                            primitive_backtrace_locations, -1);
+  rb_define_module_function(backtracie_module, "caller_location",
+                            primitive_caller_location, -1);
+  rb_define_module_function(backtracie_module, "all_thread_backtraces",
+                            primitive_all_thread_backtraces, -1);
+  rb_define_module_function(backtracie_module, "each_caller_location",
+                            primitive_each_caller_location, -1);
+  rb_define_module_function(backtracie_module, "each_backtrace_location",
+                            primitive_each_backtrace_location, -1);
+  rb_define_module_function(backtracie_module, "debug=", set_debug, 1);
+  rb_define_module_function(backtracie_module, "debug?", is_debug, 0);
 
   backtracie_location_class =
       rb_const_get(backtracie_module, rb_intern("Location"));
   rb_global_variable(&backtracie_location_class);
 
+  backtracie_backtrace_class =
+      rb_const_get(backtracie_module, rb_intern("Backtrace"));
+  rb_global_variable(&backtracie_backtrace_class);
+
   VALUE backtracie_primitive_module =
       rb_define_module_under(backtracie_module, "Primitive");
 
   rb_define_module_function(backtracie_primitive_module, "caller_locations",
-                            primitive_caller_locations, 0);
+                            primitive_caller_locations, 6);
 
   backtracie_frame_wrapper_class =
       rb_define_class_under(backtracie_module, "FrameWrapper", rb_cObject);
   // this class should only be instantiated via backtracie_frame_wrapper_new
   rb_undef_alloc_func(backtracie_frame_wrapper_class);
+  // These are used by Backtracie::Backtrace to lazily create locations
+  rb_define_method(backtracie_frame_wrapper_class, "size", frame_wrapper_size,
+                   0);
+  rb_define_method(backtracie_frame_wrapper_class, "location",
+                   frame_wrapper_location, 2);
+  rb_define_method(backtracie_frame_wrapper_class, "fingerprint",
+                   frame_wrapper_fingerprint, 0);
+  // Frame wrappers get attached to exceptions by Backtracie.track_exceptions!,
+  // and thus may get marshaled together with them (e.g. by DRb). The frames
+  // can't be marshaled, so they just get dropped instead of failing.
+  rb_define_method(backtracie_frame_wrapper_class, "_dump", frame_wrapper_dump,
+                   1);
+  rb_define_singleton_method(backtracie_frame_wrapper_class, "_load",
+                             frame_wrapper_load, 1);
+
+  backtracie_minimal_frame_wrapper_class = rb_define_class_under(
+      backtracie_module, "MinimalFrameWrapper", rb_cObject);
+  // this class should only be instantiated via
+  // backtracie_minimal_frame_wrapper_new
+  rb_undef_alloc_func(backtracie_minimal_frame_wrapper_class);
+
+  backtracie_frame_table_class =
+      rb_define_class_under(backtracie_module, "FrameTable", rb_cObject);
+  rb_define_alloc_func(backtracie_frame_table_class,
+                       backtracie_frame_table_alloc);
+  rb_define_method(backtracie_frame_table_class, "size", frame_table_size, 0);
+  rb_define_method(backtracie_frame_table_class, "backtrace_ids",
+                   frame_table_backtrace_ids, 1);
+  rb_define_method(backtracie_frame_table_class, "locations",
+                   frame_table_locations, 1);
+
+  backtracie_init_gc_epoch();
+  backtracie_init_class_name_cache();
+  backtracie_init_line_number_cache(backtracie_module);
+  backtracie_init_stack_trie(backtracie_module);
+  backtracie_init_sampler(backtracie_module);
+  backtracie_init_folded_aggregator(backtracie_module);
+  backtracie_init_ring_buffer(backtracie_module);
+  backtracie_init_stats(backtracie_module);
+  backtracie_init_exception_tracker(backtracie_module);
+  backtracie_init_allocation_profiler(backtracie_module);
+  backtracie_init_filter(backtracie_module);
+  backtracie_init_call_site_set(backtracie_module);
 
   // Create some classes which are used to simulate interesting scenarios in
   // tests
@@ -95,9 +251,12 @@ void Init_backtracie_native_extension(void) {
 }
 
 // Get array of Backtracie::Locations for a given thread; if thread is nil,
-// returns for the current thread
+// returns for the current thread.
+// If options.lazy is true, returns a Backtracie::Backtrace instead, which only
+// creates the Backtracie::Locations when they get accessed.
 static VALUE collect_backtrace_locations(VALUE self, VALUE thread,
-                                         int ignored_stack_top_frames) {
+                                         int ignored_stack_top_frames,
+                                         collect_options options) {
   if (!RTEST(thread)) {
     thread = rb_thread_current();
   }
@@ -108,58 +267,699 @@ static VALUE collect_backtrace_locations(VALUE self, VALUE thread,
     return Qnil;
   }
 
-  int raw_frame_count = backtracie_frame_count_for_thread(thread);
+  // A lazy backtrace keeps its frame wrapper, but otherwise it's only needed
+  // until we've created the locations
+  VALUE frame_wrapper = options.lazy ? backtracie_frame_wrapper_new(0)
+                                     : take_scratch_frame_wrapper();
+
+  // Capture time gets counted by the stack walk itself (see backtracie_frames.c)
+  bool captured =
+      NIL_P(options.range)
+          ? capture_frames(frame_wrapper, thread,
+                           ignored_stack_top_frames + options.start,
+                           options.length)
+          : capture_frames_for_range(frame_wrapper, thread,
+                                     ignored_stack_top_frames, options.range);
+  if (!captured) {
+    if (!options.lazy) {
+      release_scratch_frame_wrapper(frame_wrapper);
+    }
+    return Qnil;
+  }
+
+  if (options.lazy) {
+    VALUE arguments[] = {frame_wrapper, to_boolean(options.debug)};
+    return rb_class_new_instance(VALUE_COUNT(arguments), arguments,
+                                 backtracie_backtrace_class);
+  }
 
-  // Allocate memory for the raw_locations, and keep track of it on the Ruby
-  // heap so it will be GC'd even if we raise.
-  // Zero the frame array so our mark function doesn't get confused too.
-  VALUE frame_wrapper = backtracie_frame_wrapper_new(raw_frame_count);
   raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
-  int *raw_frames_len = backtracie_frame_wrapper_len(frame_wrapper);
+  int raw_frames_len = *backtracie_frame_wrapper_len(frame_wrapper);
+  int lookahead_len = *backtracie_frame_wrapper_lookahead_len(frame_wrapper);
 
-  for (int i = ignored_stack_top_frames; i < raw_frame_count; i++) {
-    bool valid_frame = backtracie_capture_frame_for_thread(
-        thread, i, &raw_frames[*raw_frames_len]);
-    if (valid_frame) {
-      (*raw_frames_len)++;
-    }
+  uint64_t symbolization_started_at = BACKTRACIE_STATS_TIMER_START();
+  VALUE rb_locations = raw_frames_to_locations(
+      raw_frames, raw_frames_len,
+      lookahead_len > 0 ? &raw_frames[raw_frames_len] : NULL, options.debug,
+      options.filter);
+  BACKTRACIE_STATS_TIMER_STOP(symbolization_ns, symbolization_started_at);
+
+  release_scratch_frame_wrapper(frame_wrapper);
+  RB_GC_GUARD(frame_wrapper);
+  return rb_locations;
+}
+
+// Creates an array of Backtracie::Locations for the given raw frames. If the
+// last frames are C frames, their filename/lineno come from caller_ruby_loc
+// (which may be NULL).
+static VALUE raw_frames_to_locations(const raw_location *raw_frames,
+                                     int raw_frames_len,
+                                     const raw_location *caller_ruby_loc,
+                                     bool debug, VALUE filter) {
+  if (!NIL_P(filter)) {
+    return filtered_raw_frames_to_locations(raw_frames, raw_frames_len,
+                                            caller_ruby_loc, debug, filter);
   }
 
-  VALUE rb_locations = rb_ary_new_capa(*raw_frames_len);
+  VALUE rb_locations = rb_ary_new_capa(raw_frames_len);
   // Iterate _backwards_ through the frames, so we can keep track of the
   // previous ruby frame for a C frame. This is required because C frames don't
   // have filenames or line numbers; we must instead use the filename/lineno of
   // the _caller_ of the function.
-  raw_location *prev_ruby_loc = NULL;
-  for (int i = *raw_frames_len - 1; i >= 0; i--) {
+  const raw_location *prev_ruby_loc = caller_ruby_loc;
+  for (int i = raw_frames_len - 1; i >= 0; i--) {
     if (raw_frames[i].is_ruby_frame) {
       prev_ruby_loc = &raw_frames[i];
     }
-    VALUE rb_loc = frame_to_location(&raw_frames[i], prev_ruby_loc);
+    VALUE rb_loc = frame_to_location(&raw_frames[i], prev_ruby_loc, debug);
     rb_ary_store(rb_locations, i, rb_loc);
   }
-
-  RB_GC_GUARD(frame_wrapper);
   return rb_locations;
 }
 
-static VALUE primitive_caller_locations(VALUE self) {
+// Like raw_frames_to_locations, but only for the frames accepted by the given
+// filter. Rejected frames still get looked at (a kept C frame may use the
+// filename/lineno of a rejected ruby frame), but never turned into locations.
+static VALUE filtered_raw_frames_to_locations(
+    const raw_location *raw_frames, int raw_frames_len,
+    const raw_location *caller_ruby_loc, bool debug, VALUE filter) {
+  VALUE rb_locations = rb_ary_new();
+  const raw_location *prev_ruby_loc = caller_ruby_loc;
+  for (int i = raw_frames_len - 1; i >= 0; i--) {
+    if (raw_frames[i].is_ruby_frame) {
+      prev_ruby_loc = &raw_frames[i];
+    }
+    if (backtracie_filter_accepts(filter, &raw_frames[i], prev_ruby_loc)) {
+      rb_ary_push(rb_locations,
+                  frame_to_location(&raw_frames[i], prev_ruby_loc, debug));
+    }
+  }
+  return rb_ary_reverse(rb_locations);
+}
+
+// Captures the raw frames for the given (alive) thread into a new frame
+// wrapper, skipping the first skip frames and capturing at most max frames (or
+// all, if max is -1).
+// Like Kernel#caller_locations, returns nil if there's less than skip frames
+// on the stack.
+static VALUE capture_frame_wrapper(VALUE thread, long skip, long max) {
+  VALUE frame_wrapper = backtracie_frame_wrapper_new(0);
+  return capture_frames(frame_wrapper, thread, skip, max) ? frame_wrapper
+                                                          : Qnil;
+}
+
+// Like capture_frame_wrapper, but replaces the contents of (and grows, if
+// needed) the given frame wrapper instead. Returns false if there's less than
+// skip frames on the stack.
+static bool capture_frames(VALUE frame_wrapper, VALUE thread, long skip,
+                           long max) {
+  backtracie_frame_wrapper_clear(frame_wrapper);
+  int raw_frame_count = backtracie_frame_count_for_thread(thread);
+
+  // There's never more valid frames than raw frames
+  if (skip > raw_frame_count) {
+    return false;
+  }
+  bool is_limited = max >= 0 && max < raw_frame_count;
+  if (!is_limited) {
+    max = raw_frame_count;
+  }
+
+  // To tell apart the stack having exactly skip frames (an empty result) from
+  // having fewer frames (nil), we also capture the last frame that we'd skip,
+  // and then drop it.
+  int extra_frames = skip > 0 ? 1 : 0;
+
+  // If we stop right after a C frame, we also need its caller ruby frame (see
+  // frame_to_location), which gets kept as a lookahead frame.
+  int lookahead_frames = is_limited && max > 0 ? 1 : 0;
+
+  // The frame wrapper keeps track of the memory for the raw_locations on the
+  // Ruby heap, so it will be GC'd even if we raise.
+  backtracie_frame_wrapper_reserve(frame_wrapper,
+                                   max + extra_frames + lookahead_frames);
+  raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
+  int *raw_frames_len = backtracie_frame_wrapper_len(frame_wrapper);
+  int *lookahead_len = backtracie_frame_wrapper_lookahead_len(frame_wrapper);
+
+  if (lookahead_frames > 0) {
+    bool found_lookahead;
+    *raw_frames_len = backtracie_capture_frames_and_ruby_frame_for_thread(
+        thread, (int)skip - extra_frames, (int)max + extra_frames, raw_frames,
+        &raw_frames[max + extra_frames], &found_lookahead);
+    *lookahead_len = found_lookahead ? 1 : 0;
+  } else {
+    *raw_frames_len = backtracie_capture_frames_for_thread(
+        thread, (int)skip - extra_frames, (int)max + extra_frames, raw_frames);
+  }
+
+  if (*raw_frames_len < extra_frames) {
+    return false;
+  }
+  frame_wrapper_drop_frames(frame_wrapper, extra_frames);
+
+  return true;
+}
+
+// Like capture_frames, but for a range argument. Because ranges can be
+// relative to the bottom of the stack, this always needs to capture every frame.
+static bool capture_frames_for_range(VALUE frame_wrapper, VALUE thread,
+                                     long skip, VALUE range) {
+  if (!capture_frames(frame_wrapper, thread, skip, -1)) {
+    return false;
+  }
+  int *raw_frames_len = backtracie_frame_wrapper_len(frame_wrapper);
+
+  long begin;
+  long length;
+  if (rb_range_beg_len(range, &begin, &length, *raw_frames_len, 0) == Qnil) {
+    return false;
+  }
+
+  frame_wrapper_drop_frames(frame_wrapper, begin);
+  frame_wrapper_truncate(frame_wrapper, length);
+
+  return true;
+}
+
+// Creating locations only needs a frame wrapper for a short while, so rather
+// than creating a new one (plus its array of frames) every time, each thread
+// keeps one around for reuse, in an instance variable.
+//
+// The scratch wrapper gets taken off its thread while in use: a nested capture
+// (e.g. from Ruby code called during symbolization) finds none and just creates
+// a new one, and a wrapper in use when an exception gets raised is left for the
+// GC, with the thread getting a new one on the next capture.
+#define SCRATCH_FRAME_WRAPPER_MAX_CAPA 4096
+
+static VALUE take_scratch_frame_wrapper(void) {
+  VALUE thread = rb_thread_current();
+  VALUE frame_wrapper = rb_attr_get(thread, scratch_frame_wrapper_id);
+  if (NIL_P(frame_wrapper) || OBJ_FROZEN(thread)) {
+    return backtracie_frame_wrapper_new(0);
+  }
+  rb_ivar_set(thread, scratch_frame_wrapper_id, Qnil);
+  return frame_wrapper;
+}
+
+static void release_scratch_frame_wrapper(VALUE frame_wrapper) {
+  // Otherwise the frames (and everything they reference) would be kept alive
+  backtracie_frame_wrapper_clear(frame_wrapper);
+
+  // Wrappers grown for very deep stacks are not kept, to avoid holding on to
+  // a lot of memory for a rare occurrence
+  VALUE thread = rb_thread_current();
+  if (backtracie_frame_wrapper_capa(frame_wrapper) >
+          SCRATCH_FRAME_WRAPPER_MAX_CAPA ||
+      OBJ_FROZEN(thread)) {
+    return;
+  }
+  rb_ivar_set(thread, scratch_frame_wrapper_id, frame_wrapper);
+}
+
+// Removes the first count frames from the wrapper
+static void frame_wrapper_drop_frames(VALUE frame_wrapper, long count) {
+  if (count <= 0) {
+    return;
+  }
+  raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
+  int *raw_frames_len = backtracie_frame_wrapper_len(frame_wrapper);
+  int lookahead_len = *backtracie_frame_wrapper_lookahead_len(frame_wrapper);
+
+  memmove(raw_frames, raw_frames + count,
+          (*raw_frames_len + lookahead_len - count) * sizeof(raw_location));
+  *raw_frames_len -= (int)count;
+}
+
+// Keeps only the first len frames in the wrapper. If the last one kept is a C
+// frame, the first ruby frame after it is kept as a lookahead frame.
+static void frame_wrapper_truncate(VALUE frame_wrapper, long len) {
+  raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
+  int *raw_frames_len = backtracie_frame_wrapper_len(frame_wrapper);
+  int *lookahead_len = backtracie_frame_wrapper_lookahead_len(frame_wrapper);
+  if (len >= *raw_frames_len) {
+    return;
+  }
+
+  *lookahead_len = 0;
+  if (len > 0 && !raw_frames[len - 1].is_ruby_frame) {
+    for (int i = (int)len; i < *raw_frames_len; i++) {
+      if (raw_frames[i].is_ruby_frame) {
+        raw_frames[len] = raw_frames[i];
+        *lookahead_len = 1;
+        break;
+      }
+    }
+  }
+  *raw_frames_len = (int)len;
+}
+
+static VALUE primitive_caller_locations(VALUE self, VALUE thread, VALUE start,
+                                        VALUE length, VALUE lazy, VALUE debug,
+                                        VALUE filter) {
   // Ignore:
   // * the current stack frame (native)
   // * the Backtracie.caller_locations that called us
-  // * the frame from the caller itself (since we're replicating the semantics
-  // of Kernel#caller_locations)
-  int ignored_stack_top_frames = 3;
+  // The frame from the caller itself is skipped by the default start of 1
+  // (since we're replicating the semantics of Kernel#caller_locations)
+  int ignored_stack_top_frames = 2;
+  BACKTRACIE_STATS_INC(captures_caller_locations);
 
-  return collect_backtrace_locations(self, Qnil, ignored_stack_top_frames);
+  collect_options options = {.lazy = RTEST(lazy),
+                             .debug = debug_option(debug),
+                             .filter = filter_option(filter, RTEST(lazy))};
+  parse_start_and_length(start, length, &options);
+
+  return collect_backtrace_locations(self, thread, ignored_stack_top_frames,
+                                     options);
 }
 
-static VALUE primitive_backtrace_locations(VALUE self, VALUE thread) {
+static VALUE primitive_backtrace_locations(int argc, VALUE *argv, VALUE self) {
+  VALUE thread;
+  VALUE start;
+  VALUE length;
+  VALUE keyword_arguments;
+  rb_scan_args(argc, argv, "12:", &thread, &start, &length, &keyword_arguments);
+
+  ID keywords[] = {lazy_id, debug_id, filter_id};
+  VALUE values[] = {Qundef, Qundef, Qundef};
+  rb_get_kwargs(keyword_arguments, keywords, 0, 3, values);
+
   rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
 
   int ignored_stack_top_frames = 0;
+  BACKTRACIE_STATS_INC(captures_backtrace_locations);
+
+  bool lazy = values[0] != Qundef && RTEST(values[0]);
+  collect_options options = {.lazy = lazy,
+                             .debug = debug_option(values[1]),
+                             .filter = filter_option(values[2], lazy)};
+  parse_start_and_length(NIL_P(start) ? INT2FIX(0) : start, length, &options);
+
+  return collect_backtrace_locations(self, thread, ignored_stack_top_frames,
+                                     options);
+}
+
+// Same as caller_locations(depth, 1).first, but without ever capturing more
+// than the frames needed
+static VALUE primitive_caller_location(int argc, VALUE *argv, VALUE self) {
+  VALUE depth_argument;
+  rb_scan_args(argc, argv, "01", &depth_argument);
+
+  long depth = NIL_P(depth_argument) ? 1 : NUM2LONG(depth_argument);
+  if (depth < 0) {
+    rb_raise(rb_eArgError, "negative level (%ld)", depth);
+  }
+  if (depth >= INT_MAX) {
+    return Qnil;
+  }
+
+  // Ignore the current stack frame (native); as in Kernel#caller_locations,
+  // depth 0 is the frame that called us.
+  int frame_index = (int)depth + 1;
+  BACKTRACIE_STATS_INC(captures_caller_location);
+
+  // See collect_backtrace_locations: C frames use the filename/lineno of the
+  // first ruby frame below them on the stack
+  raw_location raw_loc;
+  raw_location ruby_loc;
+  bool found_ruby_loc;
+  if (!backtracie_capture_caller_frame_and_ruby_frame(frame_index, &raw_loc,
+                                                      &ruby_loc,
+                                                      &found_ruby_loc)) {
+    return Qnil;
+  }
+  const raw_location *prev_ruby_loc = found_ruby_loc ? &ruby_loc : NULL;
+
+  uint64_t symbolization_started_at = BACKTRACIE_STATS_TIMER_START();
+  VALUE rb_loc = frame_to_location(&raw_loc, prev_ruby_loc, debug_enabled);
+  BACKTRACIE_STATS_TIMER_STOP(symbolization_ns, symbolization_started_at);
+  return rb_loc;
+}
+
+// Yields the same locations as caller_locations(start), one at a time, and
+// without capturing any more frames than needed if the block breaks early
+static VALUE primitive_each_caller_location(int argc, VALUE *argv, VALUE self) {
+  VALUE start_argument;
+  VALUE keyword_arguments;
+  rb_scan_args(argc, argv, "01:", &start_argument, &keyword_arguments);
+  rb_need_block();
+
+  ID keywords[] = {debug_id, filter_id};
+  VALUE values[] = {Qundef, Qundef};
+  rb_get_kwargs(keyword_arguments, keywords, 0, 2, values);
+
+  long start = NIL_P(start_argument) ? 1 : NUM2LONG(start_argument);
+  if (start < 0) {
+    rb_raise(rb_eArgError, "negative level (%ld)", start);
+  }
+  BACKTRACIE_STATS_INC(captures_caller_locations);
+
+  // Ignore the current stack frame (native); as in Kernel#caller_locations,
+  // start 0 is the frame that called us.
+  yield_locations(rb_thread_current(), start + 1, false,
+                  debug_option(values[0]), filter_option(values[1], false));
+  return Qnil;
+}
 
-  return collect_backtrace_locations(self, thread, ignored_stack_top_frames);
+// Yields the same locations as backtrace_locations(thread, start), one at a
+// time. For other threads, the stack is captured upfront (as it can change
+// while the block runs), so only creating the locations is done lazily.
+static VALUE primitive_each_backtrace_location(int argc, VALUE *argv,
+                                               VALUE self) {
+  VALUE thread;
+  VALUE start_argument;
+  VALUE keyword_arguments;
+  rb_scan_args(argc, argv, "11:", &thread, &start_argument,
+               &keyword_arguments);
+  rb_need_block();
+
+  ID keywords[] = {debug_id, filter_id};
+  VALUE values[] = {Qundef, Qundef};
+  rb_get_kwargs(keyword_arguments, keywords, 0, 2, values);
+
+  rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
+
+  long start = NIL_P(start_argument) ? 0 : NUM2LONG(start_argument);
+  if (start < 0) {
+    rb_raise(rb_eArgError, "negative level (%ld)", start);
+  }
+  BACKTRACIE_STATS_INC(captures_backtrace_locations);
+
+  if (backtracie_is_thread_alive(thread)) {
+    yield_locations(thread, start, thread != rb_thread_current(),
+                    debug_option(values[0]), filter_option(values[1], false));
+  }
+  return Qnil;
+}
+
+#define STREAMING_INITIAL_FRAMES 16
+
+// Yields a Backtracie::Location for every frame of the given (alive) thread,
+// after skipping the first skip frames.
+//
+// Unless snapshot is true, frames get captured in chunks (each twice as big as
+// the previous one, so that walking the whole stack stays linear), which is
+// safe because the stack below us is the same every time the block returns.
+// C frames use the filename/lineno of the first ruby frame after them (see
+// collect_backtrace_locations); when that frame is not part of the current
+// chunk, the next chunk gets captured starting from the C frame instead.
+static void yield_locations(VALUE thread, long skip, bool snapshot,
+                            bool debug, VALUE filter) {
+  location_chunk chunk = {.thread = thread,
+                          .frame_wrapper = Qnil,
+                          .start = skip,
+                          .capa = STREAMING_INITIAL_FRAMES / 2};
+  if (snapshot) {
+    chunk.frame_wrapper = capture_frame_wrapper(thread, skip, -1);
+    if (chunk.frame_wrapper == Qnil) {
+      return;
+    }
+    chunk.frames = backtracie_frame_wrapper_frames(chunk.frame_wrapper);
+    chunk.len = *backtracie_frame_wrapper_len(chunk.frame_wrapper);
+    chunk.complete = true;
+  } else {
+    capture_next_chunk(&chunk, 0);
+  }
+
+  int i = 0;
+  int ruby_frame_index = -1; // The first ruby frame at or after i
+  while (true) {
+    if (i == chunk.len) {
+      if (chunk.complete) {
+        break;
+      }
+      capture_next_chunk(&chunk, i);
+      i = 0;
+      ruby_frame_index = -1;
+      continue;
+    }
+
+    if (ruby_frame_index < i) {
+      ruby_frame_index = i;
+      while (ruby_frame_index < chunk.len &&
+             !chunk.frames[ruby_frame_index].is_ruby_frame) {
+        ruby_frame_index++;
+      }
+      if (ruby_frame_index == chunk.len && !chunk.complete) {
+        capture_next_chunk(&chunk, i);
+        i = 0;
+        ruby_frame_index = -1;
+        continue;
+      }
+    }
+
+    const raw_location *prev_ruby_loc = ruby_frame_index < chunk.len
+                                            ? &chunk.frames[ruby_frame_index]
+                                            : NULL;
+    if (!NIL_P(filter) &&
+        !backtracie_filter_accepts(filter, &chunk.frames[i], prev_ruby_loc)) {
+      i++;
+      continue;
+    }
+    uint64_t symbolization_started_at = BACKTRACIE_STATS_TIMER_START();
+    VALUE rb_loc = frame_to_location(&chunk.frames[i], prev_ruby_loc, debug);
+    BACKTRACIE_STATS_TIMER_STOP(symbolization_ns, symbolization_started_at);
+    i++;
+
+    rb_yield(rb_loc);
+  }
+
+  RB_GC_GUARD(chunk.frame_wrapper);
+}
+
+// Replaces the current chunk with a new (twice as big) one, starting at the
+// given frame of the current chunk
+static void capture_next_chunk(location_chunk *chunk, int first_frame) {
+  chunk->start += first_frame;
+  if (chunk->capa < INT_MAX / 2) {
+    chunk->capa *= 2;
+  }
+  if (chunk->start >= INT_MAX) {
+    chunk->len = 0;
+    chunk->complete = true;
+    return;
+  }
+
+  // The previous chunk is not needed anymore, so its wrapper gets reused
+  if (NIL_P(chunk->frame_wrapper)) {
+    chunk->frame_wrapper = backtracie_frame_wrapper_new(0);
+  }
+  backtracie_frame_wrapper_clear(chunk->frame_wrapper);
+  backtracie_frame_wrapper_reserve(chunk->frame_wrapper, chunk->capa);
+  chunk->frames = backtracie_frame_wrapper_frames(chunk->frame_wrapper);
+  chunk->len = backtracie_capture_frames_for_thread(
+      chunk->thread, (int)chunk->start, chunk->capa, chunk->frames);
+  *backtracie_frame_wrapper_len(chunk->frame_wrapper) = chunk->len;
+  chunk->complete = chunk->len < chunk->capa;
+}
+
+// Returns a hash of thread => array of Backtracie::Locations, for every alive
+// thread. All stacks are captured in a single pass, before any Ruby objects get
+// created, so this is a consistent snapshot of what every thread was doing.
+static VALUE primitive_all_thread_backtraces(int argc, VALUE *argv,
+                                             VALUE self) {
+  VALUE keyword_arguments;
+  rb_scan_args(argc, argv, "0:", &keyword_arguments);
+
+  ID keywords[] = {debug_id};
+  VALUE values[] = {Qundef};
+  rb_get_kwargs(keyword_arguments, keywords, 0, 1, values);
+  bool debug = debug_option(values[0]);
+  BACKTRACIE_STATS_INC(captures_all_thread_backtraces);
+
+  int max_frames;
+  int max_threads = backtracie_all_threads_count(&max_frames);
+
+  // The frame wrapper takes care of marking the frames while we create the
+  // locations below
+  VALUE frame_wrapper = backtracie_frame_wrapper_new(max_frames);
+  raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
+  VALUE threads_buffer;
+  VALUE *threads = ALLOCV_N(VALUE, threads_buffer, max_threads);
+  VALUE frames_len_buffer;
+  int *frames_len = ALLOCV_N(int, frames_len_buffer, max_threads);
+
+  int thread_count = backtracie_capture_all_threads(
+      threads, frames_len, max_threads, raw_frames, max_frames);
+  for (int i = 0; i < thread_count; i++) {
+    *backtracie_frame_wrapper_len(frame_wrapper) += frames_len[i];
+  }
+
+  uint64_t symbolization_started_at = BACKTRACIE_STATS_TIMER_START();
+  VALUE result = rb_hash_new();
+  int frames_offset = 0;
+  for (int i = 0; i < thread_count; i++) {
+    rb_hash_aset(result, threads[i],
+                 raw_frames_to_locations(&raw_frames[frames_offset],
+                                         frames_len[i], NULL, debug, Qnil));
+    frames_offset += frames_len[i];
+  }
+  BACKTRACIE_STATS_TIMER_STOP(symbolization_ns, symbolization_started_at);
+
+  ALLOCV_END(threads_buffer);
+  ALLOCV_END(frames_len_buffer);
+  RB_GC_GUARD(frame_wrapper);
+  return result;
+}
+
+// Replicates the argument handling of Kernel#caller_locations(start, length)
+// and Kernel#caller_locations(range)
+static void parse_start_and_length(VALUE start, VALUE length,
+                                   collect_options *options) {
+  VALUE range_begin;
+  VALUE range_end;
+  int range_exclude_end;
+  if (NIL_P(length) &&
+      rb_range_values(start, &range_begin, &range_end, &range_exclude_end)) {
+    options->range = start;
+    options->start = 0;
+    options->length = -1;
+    return;
+  }
+
+  options->range = Qnil;
+  options->start = NUM2LONG(start);
+  options->length = NIL_P(length) ? -1 : NUM2LONG(length);
+
+  if (options->start < 0) {
+    rb_raise(rb_eArgError, "negative level (%ld)", options->start);
+  }
+  if (!NIL_P(length) && options->length < 0) {
+    rb_raise(rb_eArgError, "negative size (%ld)", options->length);
+  }
+}
+
+static VALUE set_debug(VALUE self, VALUE enabled) {
+  debug_enabled = RTEST(enabled);
+  return enabled;
+}
+
+static VALUE is_debug(VALUE self) { return to_boolean(debug_enabled); }
+
+// When the debug option was not given (or is nil), use the default
+static bool debug_option(VALUE debug) {
+  if (debug == Qundef || NIL_P(debug)) {
+    return debug_enabled;
+  }
+  return RTEST(debug);
+}
+
+static VALUE filter_option(VALUE filter, bool lazy) {
+  filter = backtracie_filter_option(filter);
+  if (!NIL_P(filter) && lazy) {
+    // A Backtracie::Backtrace keeps every frame around (C frames need the
+    // ruby frames after them), so it can't skip frames
+    rb_raise(rb_eArgError, "filter: is not supported with lazy: true");
+  }
+  return filter;
+}
+
+static VALUE frame_wrapper_size(VALUE self) {
+  return INT2NUM(*backtracie_frame_wrapper_len(self));
+}
+
+static VALUE frame_wrapper_fingerprint(VALUE self) {
+  return ULL2NUM(
+      backtracie_frames_fingerprint(backtracie_frame_wrapper_frames(self),
+                                    *backtracie_frame_wrapper_len(self)));
+}
+
+// Creates the Backtracie::Location for the frame at the given index
+static VALUE frame_wrapper_location(VALUE self, VALUE index, VALUE debug) {
+  raw_location *raw_frames = backtracie_frame_wrapper_frames(self);
+  int raw_frames_len = *backtracie_frame_wrapper_len(self);
+  int lookahead_len = *backtracie_frame_wrapper_lookahead_len(self);
+  int i = NUM2INT(index);
+
+  if (i < 0 || i >= raw_frames_len) {
+    rb_raise(rb_eIndexError, "index %d outside of frames (size %d)", i,
+             raw_frames_len);
+  }
+
+  // See collect_backtrace_locations: C frames use the filename/lineno of the
+  // first ruby frame below them on the stack
+  raw_location *prev_ruby_loc = NULL;
+  for (int j = i; j < raw_frames_len + lookahead_len; j++) {
+    if (raw_frames[j].is_ruby_frame) {
+      prev_ruby_loc = &raw_frames[j];
+      break;
+    }
+  }
+
+  uint64_t symbolization_started_at = BACKTRACIE_STATS_TIMER_START();
+  VALUE rb_loc = frame_to_location(&raw_frames[i], prev_ruby_loc, RTEST(debug));
+  BACKTRACIE_STATS_TIMER_STOP(symbolization_ns, symbolization_started_at);
+  RB_GC_GUARD(self);
+  return rb_loc;
+}
+
+static VALUE frame_wrapper_dump(VALUE self, VALUE level) {
+  return rb_str_new(NULL, 0);
+}
+
+static VALUE frame_wrapper_load(VALUE klass, VALUE data) { return Qnil; }
+
+static VALUE frame_table_size(VALUE self) {
+  return UINT2NUM(backtracie_frame_table_size(self));
+}
+
+// Same as Backtracie.backtrace_locations(thread), but returns the ids of the
+// frames in this table, instead of locations
+static VALUE frame_table_backtrace_ids(VALUE self, VALUE thread) {
+  rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
+
+  if (!backtracie_is_thread_alive(thread)) {
+    return Qnil;
+  }
+
+  int max_frame_count = backtracie_frame_count_for_thread(thread);
+  VALUE ids_buffer;
+  uint32_t *ids = ALLOCV_N(uint32_t, ids_buffer, max_frame_count);
+
+  int ids_len = backtracie_frame_table_capture_frames_for_thread(
+      self, thread, 0, max_frame_count, ids);
+
+  VALUE rb_ids = rb_ary_new_capa(ids_len);
+  for (int i = 0; i < ids_len; i++) {
+    rb_ary_push(rb_ids, UINT2NUM(ids[i]));
+  }
+
+  ALLOCV_END(ids_buffer);
+  return rb_ids;
+}
+
+// Turns an array of frame ids (such as returned by backtrace_ids) back into an
+// array of Backtracie::Locations
+static VALUE frame_table_locations(VALUE self, VALUE ids) {
+  Check_Type(ids, T_ARRAY);
+  long ids_len = RARRAY_LEN(ids);
+
+  // Check every id up-front, so that below we don't need to care about raising
+  uint32_t table_size = backtracie_frame_table_size(self);
+  for (long i = 0; i < ids_len; i++) {
+    unsigned long id = NUM2ULONG(RARRAY_AREF(ids, i));
+    if (id >= table_size) {
+      rb_raise(rb_eIndexError, "unknown frame id %lu (frame table size %u)", id,
+               table_size);
+    }
+  }
+
+  VALUE rb_locations = rb_ary_new_capa(ids_len);
+  // See collect_backtrace_locations for why we iterate backwards
+  const raw_location *prev_ruby_loc = NULL;
+  for (long i = ids_len - 1; i >= 0; i--) {
+    const raw_location *raw_loc = backtracie_frame_table_get(
+        self, (uint32_t)NUM2ULONG(RARRAY_AREF(ids, i)));
+    if (raw_loc->is_ruby_frame) {
+      prev_ruby_loc = raw_loc;
+    }
+    rb_ary_store(rb_locations, i,
+                 frame_to_location(raw_loc, prev_ruby_loc, debug_enabled));
+  }
+
+  RB_GC_GUARD(ids);
+  return rb_locations;
 }
 
 inline static VALUE new_location(VALUE absolute_path, VALUE base_label,
@@ -174,7 +974,7 @@ inline static VALUE new_location(VALUE absolute_path, VALUE base_label,
 }
 
 static VALUE frame_to_location(const raw_location *raw_loc,
-                               const raw_location *prev_ruby_loc) {
+                               const raw_location *prev_ruby_loc, bool debug) {
   // If raw_loc != prev_ruby_loc, that means this location is a cfunc, and not a
   // ruby frame; so, it doesn't _actually_ have a path. For compatability with
   // Thread#backtrace et. al., we return the frame of the previous
@@ -192,8 +992,8 @@ static VALUE frame_to_location(const raw_location *raw_loc,
     path_is_synthetic = (raw_loc != prev_ruby_loc) ? Qtrue : Qfalse;
 
   } else {
-    filename_abs = rb_str_new2("(in native code)");
-    filename_rel = rb_str_dup(filename_abs);
+    filename_abs = in_native_code_str;
+    filename_rel = in_native_code_str;
     line_number = INT2NUM(0);
     path_is_synthetic = Qtrue;
   }
@@ -201,7 +1001,8 @@ static VALUE frame_to_location(const raw_location *raw_loc,
   return new_location(filename_abs, backtracie_frame_label_rbstr(raw_loc, true),
                       backtracie_frame_label_rbstr(raw_loc, false), line_number,
                       filename_rel, backtracie_frame_name_rbstr(raw_loc),
-                      path_is_synthetic, debug_raw_location(raw_loc));
+                      path_is_synthetic,
+                      debug ? debug_raw_location(raw_loc) : Qnil);
 }
 
 static VALUE debug_raw_location(const raw_location *the_location) {
@@ -280,3 +1081,33 @@ static VALUE cfunc_function_info(const raw_location *the_location) {
 }
 
 static inline VALUE to_boolean(bool value) { return value ? Qtrue : Qfalse; }
+
+VALUE backtracie_interned_str(const char *ptr, long len) {
+  BACKTRACIE_STATS_INC(strings_interned);
+#ifdef PRE_RB_INTERNED_STR
+  return backtracie_interned_str_value(rb_str_new(ptr, len));
+#else
+  // Only allocates if there isn't already such a string in the fstring table
+  return rb_interned_str(ptr, len);
+#endif
+}
+
+VALUE backtracie_interned_str_value(VALUE str) {
+  if (OBJ_FROZEN(str)) {
+    return str;
+  }
+#if defined(PRE_STR_UMINUS_DEDUP)
+  // String#-@ only returns a deduplicated copy on Ruby 2.5+, but a symbol
+  // always keeps its name as a deduplicated string (and dynamic symbols get
+  // GC'd, so this doesn't leak). Broken strings can't become symbols, though.
+  if (rb_enc_str_coderange(str) == ENC_CODERANGE_BROKEN) {
+    return rb_str_new_frozen(str);
+  }
+  return rb_sym2str(rb_str_intern(str));
+#elif defined(PRE_RB_INTERNED_STR)
+  // String#-@ returns the deduplicated copy of a string
+  return rb_funcall(str, uminus_id, 0);
+#else
+  return rb_str_to_interned_str(str);
+#endif
+}
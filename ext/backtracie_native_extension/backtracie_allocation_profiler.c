@@ -0,0 +1,605 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// The allocation profiler samples object allocations: every interval
+// allocations (on average; the exact interval is randomized, so that it
+// doesn't line up with allocation patterns in the profiled code) the stack of
+// the allocating thread gets recorded in a stack trie, and the class of the
+// new object gets counted.
+//
+// This happens from a RUBY_INTERNAL_EVENT_NEWOBJ hook, where creating Ruby
+// objects is not allowed, so samples only go into the frame table and the
+// stack trie, neither of which create Ruby objects. They may still need to grow
+// though, and that goes through xmalloc, which can trigger the GC from inside
+// the hook. That's fine as long as every structure is consistent whenever we
+// allocate: the frame table and stack trie reserve space before capturing or
+// inserting anything (so no captured frame is left unmarked), the object being
+// sampled is on the C stack (so it gets pinned), and the tracked objects table
+// only gets copied once every allocation is done (see track_object). Events
+// for allocations that don't get sampled only need to decrement a counter.
+//
+// When retained objects are tracked, every sampled object is also kept in a
+// table of live objects until a RUBY_INTERNAL_EVENT_FREEOBJ event for it shows
+// up, so we can tell which stacks allocated objects that are still around. The
+// table does not mark these objects (that would keep them alive), but it does
+// update them when the GC compacts the heap. Freed objects only get noticed
+// while the profiler is running, so stopping it discards this table; the
+// retained counts are then those at the time it was stopped.
+//
+// Objects internal to the VM (hidden objects and imemos) are never sampled.
+// Only a single allocation profiler can be running at any given time.
+
+typedef struct {
+  VALUE object; // 0 for an empty slot
+  uint32_t node;
+} tracked_object_t;
+
+typedef struct {
+  // Configuration
+  uint32_t interval;
+  int max_depth;
+  bool track_retained;
+
+  bool running;
+  // Set while we're producing results, so our own allocations don't get
+  // sampled (and don't change the stack trie while we're reading it)
+  bool paused;
+  uint32_t countdown;
+  uint64_t random_state;
+  uint64_t samples;
+
+  VALUE stack_trie;
+  // Preallocated buffer for capturing a stack
+  uint32_t *frame_ids;
+  // klass => samples
+  st_table *class_counts;
+
+  // Number of sampled objects still alive for each stack trie node
+  uint64_t *retained_counts;
+  uint32_t retained_counts_capa;
+  // Open addressing (linear probing) table of the sampled objects still alive;
+  // tracked_spare is used when the GC compacts the heap, so we don't need to
+  // allocate memory then
+  tracked_object_t *tracked;
+  tracked_object_t *tracked_spare;
+  uint32_t tracked_capa; // Always a power of two
+  uint32_t tracked_len;
+} allocation_profiler_t;
+
+#define INITIAL_TRACKED_CAPA 1024
+
+static VALUE backtracie_allocation_profiler_class = Qnil;
+static ID interval_id;
+static ID max_depth_id;
+static ID track_retained_id;
+
+// The allocation profiler that is currently running, if any. As with the
+// sampler, active_profiler_value is a GC root, so a running profiler is never
+// garbage collected.
+static allocation_profiler_t *active_profiler = NULL;
+static VALUE active_profiler_value = Qnil;
+static VALUE newobj_tracepoint = Qnil;
+static VALUE freeobj_tracepoint = Qnil;
+
+static VALUE allocation_profiler_alloc(VALUE klass);
+static allocation_profiler_t *get_allocation_profiler(VALUE self);
+static VALUE allocation_profiler_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE allocation_profiler_start(VALUE self);
+static VALUE allocation_profiler_stop(VALUE self);
+static VALUE allocation_profiler_is_running(VALUE self);
+static VALUE allocation_profiler_samples(VALUE self);
+static VALUE allocation_profiler_retained_count(VALUE self);
+static VALUE allocation_profiler_class_counts(VALUE self);
+static VALUE allocation_profiler_folded(VALUE self, VALUE retained);
+static VALUE class_counts(VALUE profiler_value);
+static VALUE folded(VALUE profiler_value);
+static VALUE folded_retained(VALUE profiler_value);
+static VALUE while_paused(allocation_profiler_t *profiler,
+                          VALUE (*function)(VALUE), VALUE profiler_value);
+static VALUE unpause(VALUE profiler_value);
+static int add_class_count(st_data_t klass, st_data_t count, st_data_t result);
+static void on_newobj(VALUE tracepoint, void *unused);
+static void on_freeobj(VALUE tracepoint, void *unused);
+static void sample(allocation_profiler_t *profiler, VALUE object, VALUE klass);
+static uint32_t next_countdown(allocation_profiler_t *profiler);
+static void track_object(allocation_profiler_t *profiler, VALUE object,
+                         uint32_t node);
+static void untrack_object(allocation_profiler_t *profiler, VALUE object);
+static void insert_tracked(tracked_object_t *table, uint32_t capa,
+                           VALUE object, uint32_t node);
+static void clear_tracked(allocation_profiler_t *profiler);
+
+static void allocation_profiler_mark(void *ptr);
+static void allocation_profiler_compact(void *ptr);
+static void allocation_profiler_free(void *ptr);
+static size_t allocation_profiler_memsize(const void *ptr);
+static const rb_data_type_t allocation_profiler_type = {
+    .wrap_struct_name = "backtracie_allocation_profiler",
+    .function = {.dmark = allocation_profiler_mark,
+                 .dfree = allocation_profiler_free,
+                 .dsize = allocation_profiler_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = allocation_profiler_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_allocation_profiler(VALUE backtracie_module) {
+  interval_id = rb_intern("interval");
+  max_depth_id = rb_intern("max_depth");
+  track_retained_id = rb_intern("track_retained");
+  rb_global_variable(&active_profiler_value);
+  rb_global_variable(&newobj_tracepoint);
+  rb_global_variable(&freeobj_tracepoint);
+
+  backtracie_allocation_profiler_class =
+      rb_const_get(backtracie_module, rb_intern("AllocationProfiler"));
+  rb_global_variable(&backtracie_allocation_profiler_class);
+
+  rb_define_alloc_func(backtracie_allocation_profiler_class,
+                       allocation_profiler_alloc);
+  rb_define_method(backtracie_allocation_profiler_class, "initialize",
+                   allocation_profiler_initialize, -1);
+  rb_define_method(backtracie_allocation_profiler_class, "start",
+                   allocation_profiler_start, 0);
+  rb_define_method(backtracie_allocation_profiler_class, "stop",
+                   allocation_profiler_stop, 0);
+  rb_define_method(backtracie_allocation_profiler_class, "running?",
+                   allocation_profiler_is_running, 0);
+  rb_define_method(backtracie_allocation_profiler_class, "samples",
+                   allocation_profiler_samples, 0);
+  rb_define_method(backtracie_allocation_profiler_class, "retained_count",
+                   allocation_profiler_retained_count, 0);
+  rb_define_method(backtracie_allocation_profiler_class, "class_counts",
+                   allocation_profiler_class_counts, 0);
+  rb_define_private_method(backtracie_allocation_profiler_class, "folded",
+                           allocation_profiler_folded, 1);
+}
+
+static VALUE allocation_profiler_alloc(VALUE klass) {
+  allocation_profiler_t *profiler;
+  VALUE wrapper = TypedData_Make_Struct(klass, allocation_profiler_t,
+                                        &allocation_profiler_type, profiler);
+  // TypedData_Make_Struct zeroes the struct, so the buffers are NULL until
+  // initialize gets called
+  profiler->stack_trie = Qnil;
+  return wrapper;
+}
+
+static allocation_profiler_t *get_allocation_profiler(VALUE self) {
+  allocation_profiler_t *profiler;
+  TypedData_Get_Struct(self, allocation_profiler_t, &allocation_profiler_type,
+                       profiler);
+  if (profiler->stack_trie == Qnil) {
+    rb_raise(rb_eRuntimeError,
+             "uninitialized Backtracie::AllocationProfiler");
+  }
+  return profiler;
+}
+
+// Backtracie::AllocationProfiler.new(interval: 1000, max_depth: 512,
+//                                    track_retained: false)
+//
+// * interval: on average, one in every interval allocations gets sampled
+// * max_depth: stacks deeper than this get their top max_depth frames sampled
+// * track_retained: keep track of which sampled objects are still alive
+static VALUE allocation_profiler_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE keyword_arguments;
+  rb_scan_args(argc, argv, "0:", &keyword_arguments);
+
+  ID keywords[] = {interval_id, max_depth_id, track_retained_id};
+  VALUE values[] = {Qundef, Qundef, Qundef};
+  rb_get_kwargs(keyword_arguments, keywords, 0, 3, values);
+
+  long interval = values[0] == Qundef ? 1000 : NUM2LONG(values[0]);
+  long max_depth = values[1] == Qundef ? 512 : NUM2LONG(values[1]);
+  bool track_retained = values[2] != Qundef && RTEST(values[2]);
+
+  if (interval <= 0 || interval > INT32_MAX) {
+    rb_raise(rb_eArgError, "invalid interval (%ld)", interval);
+  }
+  if (max_depth <= 0 || max_depth > INT_MAX) {
+    rb_raise(rb_eArgError, "invalid max_depth (%ld)", max_depth);
+  }
+
+  allocation_profiler_t *profiler;
+  TypedData_Get_Struct(self, allocation_profiler_t, &allocation_profiler_type,
+                       profiler);
+  if (profiler->stack_trie != Qnil) {
+    rb_raise(rb_eRuntimeError,
+             "Backtracie::AllocationProfiler already initialized");
+  }
+
+  profiler->interval = (uint32_t)interval;
+  profiler->max_depth = (int)max_depth;
+  profiler->track_retained = track_retained;
+  // Any non-zero seed works; this one just differs between profilers
+  profiler->random_state = (uint64_t)(uintptr_t)profiler | 1;
+  profiler->countdown = next_countdown(profiler);
+  profiler->frame_ids = ALLOC_N(uint32_t, max_depth);
+  profiler->class_counts = st_init_numtable();
+  profiler->stack_trie =
+      backtracie_stack_trie_new(backtracie_frame_table_new());
+
+  return self;
+}
+
+static VALUE allocation_profiler_start(VALUE self) {
+  allocation_profiler_t *profiler = get_allocation_profiler(self);
+  if (profiler->running) {
+    return Qfalse;
+  }
+  if (active_profiler != NULL) {
+    rb_raise(rb_eRuntimeError,
+             "Another Backtracie::AllocationProfiler is already running");
+  }
+
+  if (newobj_tracepoint == Qnil) {
+    newobj_tracepoint =
+        rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, on_newobj, NULL);
+    freeobj_tracepoint =
+        rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_FREEOBJ, on_freeobj, NULL);
+  }
+
+  if (profiler->track_retained && profiler->tracked == NULL) {
+    profiler->tracked_capa = INITIAL_TRACKED_CAPA;
+    profiler->tracked = ZALLOC_N(tracked_object_t, profiler->tracked_capa);
+    profiler->tracked_spare =
+        ZALLOC_N(tracked_object_t, profiler->tracked_capa);
+  }
+  // Objects sampled during a previous run are not tracked anymore
+  if (profiler->retained_counts != NULL) {
+    MEMZERO(profiler->retained_counts, uint64_t,
+            profiler->retained_counts_capa);
+  }
+
+  profiler->running = true;
+  active_profiler = profiler;
+  active_profiler_value = self;
+
+  rb_tracepoint_enable(newobj_tracepoint);
+  if (profiler->track_retained) {
+    rb_tracepoint_enable(freeobj_tracepoint);
+  }
+  return Qtrue;
+}
+
+static VALUE allocation_profiler_stop(VALUE self) {
+  allocation_profiler_t *profiler = get_allocation_profiler(self);
+  if (!profiler->running) {
+    return Qfalse;
+  }
+
+  rb_tracepoint_disable(newobj_tracepoint);
+  rb_tracepoint_disable(freeobj_tracepoint);
+  profiler->running = false;
+  active_profiler = NULL;
+  active_profiler_value = Qnil;
+
+  // We won't find out when these get freed anymore (see above)
+  clear_tracked(profiler);
+  return Qtrue;
+}
+
+static VALUE allocation_profiler_is_running(VALUE self) {
+  return get_allocation_profiler(self)->running ? Qtrue : Qfalse;
+}
+
+// Total number of allocations sampled so far
+static VALUE allocation_profiler_samples(VALUE self) {
+  return ULL2NUM(get_allocation_profiler(self)->samples);
+}
+
+// Number of sampled objects that are still alive (or were, when the profiler
+// was stopped); always 0 unless track_retained was set
+static VALUE allocation_profiler_retained_count(VALUE self) {
+  allocation_profiler_t *profiler = get_allocation_profiler(self);
+  uint64_t retained = 0;
+  for (uint32_t i = 0; i < profiler->retained_counts_capa; i++) {
+    retained += profiler->retained_counts[i];
+  }
+  return ULL2NUM(retained);
+}
+
+// Returns a hash of class => number of sampled allocations
+static VALUE allocation_profiler_class_counts(VALUE self) {
+  return while_paused(get_allocation_profiler(self), class_counts, self);
+}
+
+static VALUE allocation_profiler_folded(VALUE self, VALUE retained) {
+  return while_paused(get_allocation_profiler(self),
+                      RTEST(retained) ? folded_retained : folded, self);
+}
+
+static VALUE class_counts(VALUE profiler_value) {
+  allocation_profiler_t *profiler = get_allocation_profiler(profiler_value);
+  VALUE result = rb_hash_new();
+  st_foreach(profiler->class_counts, add_class_count, (st_data_t)result);
+  return result;
+}
+
+static VALUE folded(VALUE profiler_value) {
+  allocation_profiler_t *profiler = get_allocation_profiler(profiler_value);
+  return backtracie_stack_trie_to_folded(profiler->stack_trie, NULL, 0);
+}
+
+static VALUE folded_retained(VALUE profiler_value) {
+  allocation_profiler_t *profiler = get_allocation_profiler(profiler_value);
+  if (profiler->retained_counts == NULL) {
+    return rb_str_new(NULL, 0); // Nothing was ever tracked
+  }
+  return backtracie_stack_trie_to_folded(profiler->stack_trie,
+                                         profiler->retained_counts,
+                                         profiler->retained_counts_capa);
+}
+
+static VALUE while_paused(allocation_profiler_t *profiler,
+                          VALUE (*function)(VALUE), VALUE profiler_value) {
+  if (profiler->paused) {
+    return function(profiler_value);
+  }
+  profiler->paused = true;
+  return rb_ensure(function, profiler_value, unpause, profiler_value);
+}
+
+static VALUE unpause(VALUE profiler_value) {
+  get_allocation_profiler(profiler_value)->paused = false;
+  return Qnil;
+}
+
+static int add_class_count(st_data_t klass, st_data_t count, st_data_t result) {
+  rb_hash_aset((VALUE)result, (VALUE)klass, ULL2NUM((uint64_t)count));
+  return ST_CONTINUE;
+}
+
+static void on_newobj(VALUE tracepoint, void *unused) {
+  allocation_profiler_t *profiler = active_profiler;
+  if (profiler == NULL || profiler->paused) {
+    return;
+  }
+
+  VALUE object = rb_tracearg_object(rb_tracearg_from_tracepoint(tracepoint));
+  VALUE klass = RBASIC_CLASS(object);
+  if (klass == 0) {
+    return;
+  }
+  int type = rb_type(object);
+  if (type == T_IMEMO || type == T_NODE || type == T_ICLASS) {
+    return;
+  }
+
+  if (--profiler->countdown > 0) {
+    return;
+  }
+  profiler->countdown = next_countdown(profiler);
+  sample(profiler, object, klass);
+}
+
+static void on_freeobj(VALUE tracepoint, void *unused) {
+  allocation_profiler_t *profiler = active_profiler;
+  // Note: This runs during GC, so it must not allocate any memory
+  if (profiler == NULL || profiler->tracked_len == 0) {
+    return;
+  }
+  untrack_object(profiler,
+                 rb_tracearg_object(rb_tracearg_from_tracepoint(tracepoint)));
+}
+
+static void sample(allocation_profiler_t *profiler, VALUE object, VALUE klass) {
+  int frames_len = backtracie_frame_table_capture_frames_for_thread(
+      backtracie_stack_trie_frame_table(profiler->stack_trie),
+      rb_thread_current(), 0, profiler->max_depth, profiler->frame_ids);
+  uint32_t node = backtracie_stack_trie_insert(
+      profiler->stack_trie, profiler->frame_ids, frames_len);
+  profiler->samples++;
+
+  st_data_t count = 0;
+  st_lookup(profiler->class_counts, (st_data_t)rb_class_real(klass), &count);
+  st_insert(profiler->class_counts, (st_data_t)rb_class_real(klass),
+            count + 1);
+
+  if (profiler->track_retained) {
+    track_object(profiler, object, node);
+  }
+}
+
+// Returns a random number between 1 and 2 * interval - 1 (so that, on average,
+// it's interval), using xorshift64
+static uint32_t next_countdown(allocation_profiler_t *profiler) {
+  uint64_t x = profiler->random_state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  profiler->random_state = x;
+  return 1 + (uint32_t)(x % (2 * (uint64_t)profiler->interval - 1));
+}
+
+// Note: Allocating memory can trigger the GC, which can free (or move) tracked
+// objects, so when growing the arrays below we only start copying into them
+// once every allocation is done.
+static void track_object(allocation_profiler_t *profiler, VALUE object,
+                         uint32_t node) {
+  if (node >= profiler->retained_counts_capa) {
+    uint32_t new_capa = backtracie_stack_trie_size(profiler->stack_trie) * 2;
+    uint64_t *new_counts = ZALLOC_N(uint64_t, new_capa);
+    if (profiler->retained_counts != NULL) {
+      MEMCPY(new_counts, profiler->retained_counts, uint64_t,
+             profiler->retained_counts_capa);
+    }
+    xfree(profiler->retained_counts);
+    profiler->retained_counts = new_counts;
+    profiler->retained_counts_capa = new_capa;
+  }
+
+  // Keep the load factor at or below 50%
+  if ((profiler->tracked_len + 1) * 2 > profiler->tracked_capa) {
+    uint32_t new_capa = profiler->tracked_capa * 2;
+    tracked_object_t *new_tracked = ZALLOC_N(tracked_object_t, new_capa);
+    tracked_object_t *new_spare = ZALLOC_N(tracked_object_t, new_capa);
+    for (uint32_t i = 0; i < profiler->tracked_capa; i++) {
+      if (profiler->tracked[i].object != 0) {
+        insert_tracked(new_tracked, new_capa, profiler->tracked[i].object,
+                       profiler->tracked[i].node);
+      }
+    }
+    xfree(profiler->tracked);
+    xfree(profiler->tracked_spare);
+    profiler->tracked = new_tracked;
+    profiler->tracked_spare = new_spare;
+    profiler->tracked_capa = new_capa;
+  }
+
+  insert_tracked(profiler->tracked, profiler->tracked_capa, object, node);
+  profiler->tracked_len++;
+  profiler->retained_counts[node]++;
+}
+
+static void untrack_object(allocation_profiler_t *profiler, VALUE object) {
+  uint32_t mask = profiler->tracked_capa - 1;
+  uint32_t i = (uint32_t)backtracie_hash_mix(0, object) & mask;
+  while (profiler->tracked[i].object != object) {
+    if (profiler->tracked[i].object == 0) {
+      return; // Not a sampled object
+    }
+    i = (i + 1) & mask;
+  }
+
+  profiler->retained_counts[profiler->tracked[i].node]--;
+  profiler->tracked_len--;
+
+  // Backward shift deletion: move up any entries after this one that would
+  // otherwise become unreachable, so we never need tombstones
+  uint32_t hole = i;
+  for (uint32_t j = (i + 1) & mask; profiler->tracked[j].object != 0;
+       j = (j + 1) & mask) {
+    uint32_t home =
+        (uint32_t)backtracie_hash_mix(0, profiler->tracked[j].object) & mask;
+    // Can the entry at j be moved to the hole? Only if its home slot is not
+    // in the (cyclic) range (hole, j]
+    bool home_in_range = hole <= j ? (hole < home && home <= j)
+                                   : (hole < home || home <= j);
+    if (!home_in_range) {
+      profiler->tracked[hole] = profiler->tracked[j];
+      hole = j;
+    }
+  }
+  profiler->tracked[hole].object = 0;
+}
+
+static void insert_tracked(tracked_object_t *table, uint32_t capa,
+                           VALUE object, uint32_t node) {
+  uint32_t mask = capa - 1;
+  uint32_t i = (uint32_t)backtracie_hash_mix(0, object) & mask;
+  while (table[i].object != 0) {
+    i = (i + 1) & mask;
+  }
+  table[i].object = object;
+  table[i].node = node;
+}
+
+static void clear_tracked(allocation_profiler_t *profiler) {
+  if (profiler->tracked != NULL) {
+    MEMZERO(profiler->tracked, tracked_object_t, profiler->tracked_capa);
+  }
+  profiler->tracked_len = 0;
+}
+
+static int mark_class(st_data_t klass, st_data_t count, st_data_t unused) {
+  // Classes are used as keys, so they must not move
+  rb_gc_mark((VALUE)klass);
+  return ST_CONTINUE;
+}
+
+static void allocation_profiler_mark(void *ptr) {
+  allocation_profiler_t *profiler = (allocation_profiler_t *)ptr;
+#ifdef PRE_GC_MARK_MOVABLE
+  rb_gc_mark(profiler->stack_trie);
+#else
+  rb_gc_mark_movable(profiler->stack_trie);
+#endif
+  if (profiler->class_counts != NULL) {
+    st_foreach(profiler->class_counts, mark_class, 0);
+  }
+  // Tracked objects are not marked, as that would keep them alive
+}
+
+static void allocation_profiler_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  allocation_profiler_t *profiler = (allocation_profiler_t *)ptr;
+  profiler->stack_trie = rb_gc_location(profiler->stack_trie);
+
+  if (profiler->tracked_len == 0) {
+    return;
+  }
+  // Objects that moved now live at a different address, and thus need a
+  // different slot; rebuild the table into the spare one (we must not
+  // allocate memory while the GC is running)
+  MEMZERO(profiler->tracked_spare, tracked_object_t, profiler->tracked_capa);
+  for (uint32_t i = 0; i < profiler->tracked_capa; i++) {
+    if (profiler->tracked[i].object != 0) {
+      insert_tracked(profiler->tracked_spare, profiler->tracked_capa,
+                     rb_gc_location(profiler->tracked[i].object),
+                     profiler->tracked[i].node);
+    }
+  }
+  tracked_object_t *previous = profiler->tracked;
+  profiler->tracked = profiler->tracked_spare;
+  profiler->tracked_spare = previous;
+#endif
+}
+
+static void allocation_profiler_free(void *ptr) {
+  allocation_profiler_t *profiler = (allocation_profiler_t *)ptr;
+  // A running profiler is a GC root, so this only happens when Ruby is
+  // shutting down (and still reports objects being freed)
+  if (active_profiler == profiler) {
+    active_profiler = NULL;
+  }
+  xfree(profiler->frame_ids);
+  if (profiler->class_counts != NULL) {
+    st_free_table(profiler->class_counts);
+  }
+  xfree(profiler->retained_counts);
+  xfree(profiler->tracked);
+  xfree(profiler->tracked_spare);
+  xfree(profiler);
+}
+
+static size_t allocation_profiler_memsize(const void *ptr) {
+  const allocation_profiler_t *profiler = (const allocation_profiler_t *)ptr;
+  return sizeof(allocation_profiler_t) +
+         sizeof(uint32_t) * profiler->max_depth +
+         (profiler->class_counts != NULL
+              ? st_memsize(profiler->class_counts)
+              : 0) +
+         sizeof(uint64_t) * profiler->retained_counts_capa +
+         2 * sizeof(tracked_object_t) * profiler->tracked_capa;
+}
@@ -0,0 +1,270 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// Backtracie.once_per_call_site runs its block only the first time it gets
+// called from a given call site, e.g. to log a deprecation warning once for
+// every place that calls a deprecated method.
+//
+// Call sites are identified by the (iseq, pc) of the ruby frame making the
+// call, so two calls on the same line are different call sites. These get kept
+// in a set (an open addressing hash table, with linear probing), so once a call
+// site has been seen, calling once_per_call_site from it again only needs to
+// walk the stack down to that frame and probe the set, without creating any
+// Ruby objects.
+//
+// Entries keep their iseq alive (so its pc can't get reused by some other
+// iseq), and thus the set is bounded: once it holds
+// Backtracie.once_per_call_site_limit call sites, any new call site is treated
+// as already seen (so its block does not run).
+
+#define DEFAULT_CALL_SITE_LIMIT 4096
+#define INITIAL_CALL_SITE_CAPA 64 // Must be a power of two
+
+typedef struct {
+  VALUE iseq; // 0 for an empty entry
+  const void *pc;
+} call_site_t;
+
+typedef struct {
+  call_site_t *entries;
+  uint32_t capa; // Always a power of two, and at least twice len
+  uint32_t len;
+  uint32_t limit;
+} call_site_set_t;
+
+// This is used as a GC root, so that we get to mark and update the entries
+static VALUE call_site_set = Qnil;
+static call_site_set_t *call_sites = NULL;
+
+static VALUE once_per_call_site(int argc, VALUE *argv, VALUE self);
+static VALUE once_per_call_site_limit(VALUE self);
+static VALUE set_once_per_call_site_limit(VALUE self, VALUE limit);
+static VALUE reset_once_per_call_site(VALUE self);
+static bool caller_call_site(long depth, call_site_t *call_site);
+static bool call_site_set_add(const call_site_t *call_site);
+static void call_site_set_grow(void);
+static uint32_t slot_for(const call_site_t *entries, uint32_t capa,
+                         const call_site_t *call_site);
+
+static void call_site_set_mark(void *ptr);
+static void call_site_set_compact(void *ptr);
+static void call_site_set_free(void *ptr);
+static size_t call_site_set_memsize(const void *ptr);
+static const rb_data_type_t call_site_set_type = {
+    .wrap_struct_name = "backtracie_call_site_set",
+    .function = {.dmark = call_site_set_mark,
+                 .dfree = call_site_set_free,
+                 .dsize = call_site_set_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = call_site_set_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_call_site_set(VALUE backtracie_module) {
+  call_sites = ZALLOC(call_site_set_t);
+  call_sites->entries = ZALLOC_N(call_site_t, INITIAL_CALL_SITE_CAPA);
+  call_sites->capa = INITIAL_CALL_SITE_CAPA;
+  call_sites->limit = DEFAULT_CALL_SITE_LIMIT;
+  call_site_set = TypedData_Wrap_Struct(0, &call_site_set_type, call_sites);
+  rb_global_variable(&call_site_set);
+
+  rb_define_module_function(backtracie_module, "once_per_call_site",
+                            once_per_call_site, -1);
+  rb_define_module_function(backtracie_module, "once_per_call_site_limit",
+                            once_per_call_site_limit, 0);
+  rb_define_module_function(backtracie_module, "once_per_call_site_limit=",
+                            set_once_per_call_site_limit, 1);
+  rb_define_module_function(backtracie_module, "reset_once_per_call_site",
+                            reset_once_per_call_site, 0);
+}
+
+// Backtracie.once_per_call_site(depth = 1) { ... }
+//
+// As in Backtracie.caller_location, depth 0 is the frame that called us, so by
+// default the call site is where the method calling us got called from.
+// Returns the result of the block, or nil if it didn't run.
+static VALUE once_per_call_site(int argc, VALUE *argv, VALUE self) {
+  VALUE depth_argument;
+  rb_scan_args(argc, argv, "01", &depth_argument);
+  rb_need_block();
+
+  long depth = NIL_P(depth_argument) ? 1 : NUM2LONG(depth_argument);
+  if (depth < 0) {
+    rb_raise(rb_eArgError, "negative level (%ld)", depth);
+  }
+
+  call_site_t call_site;
+  if (!caller_call_site(depth, &call_site)) {
+    // There's no such frame, so there's no call site to run the block once for
+    return Qnil;
+  }
+  if (!call_site_set_add(&call_site)) {
+    return Qnil;
+  }
+  return rb_yield(Qnil);
+}
+
+static VALUE once_per_call_site_limit(VALUE self) {
+  return UINT2NUM(call_sites->limit);
+}
+
+// Lowering the limit does not remove any call sites already seen; it only stops
+// new ones from being added until there's less than limit of them.
+static VALUE set_once_per_call_site_limit(VALUE self, VALUE limit) {
+  long new_limit = NUM2LONG(limit);
+  if (new_limit < 0 || new_limit > INT32_MAX / 2) {
+    rb_raise(rb_eArgError, "invalid limit (%ld)", new_limit);
+  }
+  call_sites->limit = (uint32_t)new_limit;
+  return limit;
+}
+
+// Forgets every call site seen so far, so blocks will run once again
+static VALUE reset_once_per_call_site(VALUE self) {
+  MEMZERO(call_sites->entries, call_site_t, call_sites->capa);
+  call_sites->len = 0;
+  return Qnil;
+}
+
+// Finds the call site for the frame at the given depth. For C frames (which
+// don't have a pc of their own), it's the call site of the first ruby frame
+// after them, e.g. for a block passed to Array#each, the call to each.
+static bool caller_call_site(long depth, call_site_t *call_site) {
+  // Skip the current stack frame (native)
+  if (depth >= INT_MAX - 1) {
+    return false;
+  }
+  int frame_index = (int)depth + 1;
+
+  raw_location loc;
+  raw_location ruby_loc;
+  bool found_ruby_loc;
+  if (!backtracie_capture_caller_frame_and_ruby_frame(frame_index, &loc,
+                                                      &ruby_loc,
+                                                      &found_ruby_loc)) {
+    return false;
+  }
+  if (!found_ruby_loc) {
+    // Only C frames below; all of these count as the same call site
+    call_site->iseq = Qnil;
+    call_site->pc = NULL;
+    return true;
+  }
+  call_site->iseq = ruby_loc.iseq;
+  call_site->pc = ruby_loc.pc;
+  return true;
+}
+
+// Adds the call site to the set, returning true if it wasn't there yet
+static bool call_site_set_add(const call_site_t *call_site) {
+  uint32_t slot = slot_for(call_sites->entries, call_sites->capa, call_site);
+  if (call_sites->entries[slot].iseq != 0) {
+    return false; // Already seen; this is the fast path
+  }
+  if (call_sites->len >= call_sites->limit) {
+    return false;
+  }
+
+  if ((call_sites->len + 1) * 2 > call_sites->capa) {
+    call_site_set_grow();
+    slot = slot_for(call_sites->entries, call_sites->capa, call_site);
+  }
+  call_sites->entries[slot] = *call_site;
+  call_sites->len++;
+  return true;
+}
+
+static void call_site_set_grow(void) {
+  uint32_t new_capa = call_sites->capa * 2;
+  call_site_t *new_entries = ZALLOC_N(call_site_t, new_capa);
+  for (uint32_t i = 0; i < call_sites->capa; i++) {
+    if (call_sites->entries[i].iseq != 0) {
+      new_entries[slot_for(new_entries, new_capa, &call_sites->entries[i])] =
+          call_sites->entries[i];
+    }
+  }
+  xfree(call_sites->entries);
+  call_sites->entries = new_entries;
+  call_sites->capa = new_capa;
+}
+
+// Returns the slot for the given call site: either the one it's in, or the
+// empty one where it should go
+static uint32_t slot_for(const call_site_t *entries, uint32_t capa,
+                         const call_site_t *call_site) {
+  // Only the pc is hashed, as the iseq may get moved by the GC (but the pc,
+  // which points into its instructions, doesn't)
+  uint32_t mask = capa - 1;
+  uint32_t slot =
+      (uint32_t)backtracie_hash_mix(0, (uint64_t)(uintptr_t)call_site->pc) &
+      mask;
+  while (entries[slot].iseq != 0 && (entries[slot].iseq != call_site->iseq ||
+                                     entries[slot].pc != call_site->pc)) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static void call_site_set_mark(void *ptr) {
+  call_site_set_t *set = (call_site_set_t *)ptr;
+  for (uint32_t i = 0; i < set->capa; i++) {
+    if (set->entries[i].iseq == 0) {
+      continue;
+    }
+#ifdef PRE_GC_MARK_MOVABLE
+    rb_gc_mark(set->entries[i].iseq);
+#else
+    rb_gc_mark_movable(set->entries[i].iseq);
+#endif
+  }
+}
+
+static void call_site_set_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  call_site_set_t *set = (call_site_set_t *)ptr;
+  for (uint32_t i = 0; i < set->capa; i++) {
+    if (set->entries[i].iseq != 0) {
+      set->entries[i].iseq = rb_gc_location(set->entries[i].iseq);
+    }
+  }
+#endif
+}
+
+static void call_site_set_free(void *ptr) {
+  call_site_set_t *set = (call_site_set_t *)ptr;
+  xfree(set->entries);
+  xfree(set);
+}
+
+static size_t call_site_set_memsize(const void *ptr) {
+  const call_site_set_t *set = (const call_site_set_t *)ptr;
+  return sizeof(call_site_set_t) + sizeof(call_site_t) * set->capa;
+}
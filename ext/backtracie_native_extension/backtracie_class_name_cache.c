@@ -0,0 +1,160 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+
+// The class name cache maps a class/module (plus whether it is being rendered
+// as a refinement) to the qualifier we render for it, e.g. "Foo::Bar",
+// "Foo$singleton", "Baz$anonymous" or "X$refinement@Y". The same handful of
+// classes show up in every backtrace, so this saves us from repeatedly walking
+// superclass chains and looking up names.
+//
+// A rendered qualifier depends on the names of one or more classes (e.g. an
+// anonymous class is rendered using the name of its first named superclass),
+// and classes can get named (or renamed, from a temporary to a permanent name)
+// at any time. Thus, every entry records the classes whose names were used and
+// what those names were, unless they were already permanent names (which never
+// change); an entry is only used if all of them still match.
+//
+// The cache is a fixed-size, direct-mapped table, so it never allocates after
+// being created, and an entry just replaces whatever was in its slot. Entries
+// don't keep their classes alive (a singleton class would keep its object
+// alive too); instead, they're only used during the GC epoch they were
+// inserted in (see backtracie_gc_epoch.c), and only get inserted if every
+// object they reference is old. Classes usually are, by the time they show up
+// in a backtrace.
+
+#define CLASS_NAME_CACHE_SIZE 256 // Must be a power of two
+#define CLASS_NAME_MAX_LEN 128    // Including the NULL terminator
+
+typedef struct {
+  VALUE klass; // 0 for an empty entry
+  bool refinement;
+  uint64_t gc_epoch;
+  // Only the dependencies which didn't yet have a permanent name
+  int dependencies_len;
+  VALUE dependencies[BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES];
+  VALUE dependency_names[BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES];
+  char name[CLASS_NAME_MAX_LEN];
+} class_name_cache_entry_t;
+
+static class_name_cache_entry_t *cache_entries = NULL;
+
+static class_name_cache_entry_t *entry_for(VALUE klass, bool refinement);
+static bool same_name(VALUE name, VALUE other_name);
+static bool is_permanent_name(VALUE name);
+
+void backtracie_init_class_name_cache(void) {
+  cache_entries = ZALLOC_N(class_name_cache_entry_t, CLASS_NAME_CACHE_SIZE);
+}
+
+VALUE backtracie_class_name_cache_mod_name(
+    VALUE klass, backtracie_class_name_dependencies_t *dependencies) {
+  VALUE name = rb_mod_name(klass);
+  if (dependencies->len < BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES) {
+    dependencies->classes[dependencies->len] = klass;
+    dependencies->names[dependencies->len] = name;
+  }
+  dependencies->len++;
+  return name;
+}
+
+const char *backtracie_class_name_cache_lookup(VALUE klass, bool refinement) {
+  class_name_cache_entry_t *entry = entry_for(klass, refinement);
+  if (entry->klass != klass || entry->refinement != refinement ||
+      entry->gc_epoch != backtracie_gc_epoch) {
+    BACKTRACIE_STATS_INC(class_name_cache_misses);
+    return NULL;
+  }
+
+  for (int i = 0; i < entry->dependencies_len; i++) {
+    if (!same_name(rb_mod_name(entry->dependencies[i]),
+                   entry->dependency_names[i])) {
+      // Something got (re)named; this entry will get replaced by the caller
+      BACKTRACIE_STATS_INC(class_name_cache_misses);
+      return NULL;
+    }
+  }
+  BACKTRACIE_STATS_INC(class_name_cache_hits);
+  return entry->name;
+}
+
+void backtracie_class_name_cache_insert(
+    VALUE klass, bool refinement,
+    const backtracie_class_name_dependencies_t *dependencies, const char *name,
+    size_t name_len) {
+  if (dependencies->len > BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES ||
+      name_len >= CLASS_NAME_MAX_LEN) {
+    return;
+  }
+
+  if (!backtracie_gc_epoch_can_reference(klass)) {
+    return;
+  }
+  for (int i = 0; i < dependencies->len; i++) {
+    if (!is_permanent_name(dependencies->names[i]) &&
+        !(backtracie_gc_epoch_can_reference(dependencies->classes[i]) &&
+          backtracie_gc_epoch_can_reference(dependencies->names[i]))) {
+      return;
+    }
+  }
+
+  class_name_cache_entry_t *entry = entry_for(klass, refinement);
+  entry->klass = klass;
+  entry->refinement = refinement;
+  entry->gc_epoch = backtracie_gc_epoch;
+  entry->dependencies_len = 0;
+  for (int i = 0; i < dependencies->len; i++) {
+    if (is_permanent_name(dependencies->names[i])) {
+      continue;
+    }
+    entry->dependencies[entry->dependencies_len] = dependencies->classes[i];
+    entry->dependency_names[entry->dependencies_len] = dependencies->names[i];
+    entry->dependencies_len++;
+  }
+  memcpy(entry->name, name, name_len);
+  entry->name[name_len] = '\0';
+}
+
+static class_name_cache_entry_t *entry_for(VALUE klass, bool refinement) {
+  uint64_t hash = backtracie_hash_mix(klass, refinement);
+  return &cache_entries[hash & (CLASS_NAME_CACHE_SIZE - 1)];
+}
+
+// Names are usually the exact same string object, but some Ruby versions
+// return a new copy every time
+static bool same_name(VALUE name, VALUE other_name) {
+  if (name == other_name) {
+    return true;
+  }
+  return RB_TYPE_P(name, T_STRING) && RB_TYPE_P(other_name, T_STRING) &&
+         rb_str_equal(name, other_name) == Qtrue;
+}
+
+// Classes without a permanent name are either anonymous (nil) or have a
+// temporary name such as "#<Class:0x...>::Foo"; once permanent, a name never
+// changes
+static bool is_permanent_name(VALUE name) {
+  return RB_TYPE_P(name, T_STRING) && RSTRING_LEN(name) > 0 &&
+         RSTRING_PTR(name)[0] != '#';
+}
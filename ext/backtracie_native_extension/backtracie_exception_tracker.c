@@ -0,0 +1,117 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <stdbool.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// Backtracie.track_exceptions! enables a TracePoint on :raise that captures the
+// raw frames for every exception raised into a frame wrapper, which gets
+// attached to the exception. These only get turned into Backtracie::Locations
+// if Exception#backtracie_locations gets called, so exceptions that get rescued
+// and dropped only pay for walking the stack (as Ruby already does for its own
+// backtraces).
+//
+// By the time the :raise event fires, Kernel#raise already popped its own
+// frame, so the captured frames match what Exception#backtrace_locations
+// returns.
+
+static VALUE raise_tracepoint = Qnil;
+static VALUE exception_locations_module = Qnil;
+// Not a valid instance variable name, so it's not visible from Ruby code
+static ID frame_wrapper_id;
+
+static VALUE track_exceptions(VALUE self);
+static VALUE stop_tracking_exceptions(VALUE self);
+static VALUE is_tracking_exceptions(VALUE self);
+static VALUE primitive_exception_frame_wrapper(VALUE self, VALUE exception);
+static void on_raise(VALUE tracepoint, void *unused);
+
+void backtracie_init_exception_tracker(VALUE backtracie_module) {
+  frame_wrapper_id = rb_intern("backtracie_frame_wrapper");
+  rb_global_variable(&raise_tracepoint);
+  exception_locations_module =
+      rb_const_get(backtracie_module, rb_intern("ExceptionLocations"));
+  rb_global_variable(&exception_locations_module);
+
+  rb_define_module_function(backtracie_module, "track_exceptions!",
+                            track_exceptions, 0);
+  rb_define_module_function(backtracie_module, "stop_tracking_exceptions!",
+                            stop_tracking_exceptions, 0);
+  rb_define_module_function(backtracie_module, "tracking_exceptions?",
+                            is_tracking_exceptions, 0);
+
+  VALUE backtracie_primitive_module =
+      rb_const_get(backtracie_module, rb_intern("Primitive"));
+  rb_define_module_function(backtracie_primitive_module,
+                            "exception_frame_wrapper",
+                            primitive_exception_frame_wrapper, 1);
+}
+
+static VALUE track_exceptions(VALUE self) {
+  if (raise_tracepoint == Qnil) {
+    rb_include_module(rb_eException, exception_locations_module);
+    raise_tracepoint = rb_tracepoint_new(0, RUBY_EVENT_RAISE, on_raise, NULL);
+  }
+  rb_tracepoint_enable(raise_tracepoint);
+  return Qtrue;
+}
+
+static VALUE stop_tracking_exceptions(VALUE self) {
+  if (raise_tracepoint != Qnil) {
+    rb_tracepoint_disable(raise_tracepoint);
+  }
+  return Qnil;
+}
+
+static VALUE is_tracking_exceptions(VALUE self) {
+  return raise_tracepoint != Qnil && RTEST(rb_tracepoint_enabled_p(
+                                         raise_tracepoint))
+             ? Qtrue
+             : Qfalse;
+}
+
+// Returns the frame wrapper captured when the exception was raised, or nil
+static VALUE primitive_exception_frame_wrapper(VALUE self, VALUE exception) {
+  return rb_attr_get(exception, frame_wrapper_id);
+}
+
+static void on_raise(VALUE tracepoint, void *unused) {
+  VALUE exception =
+      rb_tracearg_raised_exception(rb_tracearg_from_tracepoint(tracepoint));
+
+  // When an exception gets re-raised, Ruby keeps its original backtrace, and so
+  // do we
+  if (OBJ_FROZEN(exception) ||
+      rb_attr_get(exception, frame_wrapper_id) != Qnil) {
+    return;
+  }
+
+  VALUE thread = rb_thread_current();
+  int max_frame_count = backtracie_frame_count_for_thread(thread);
+  VALUE frame_wrapper = backtracie_frame_wrapper_new(max_frame_count);
+  *backtracie_frame_wrapper_len(frame_wrapper) =
+      backtracie_capture_frames_for_thread(
+          thread, 0, max_frame_count,
+          backtracie_frame_wrapper_frames(frame_wrapper));
+
+  rb_ivar_set(exception, frame_wrapper_id, frame_wrapper);
+}
@@ -0,0 +1,290 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// A Backtracie::Filter decides which frames make it into the result of the
+// capture APIs. Frames get checked right after being captured, so rejected
+// frames never get turned into Ruby objects.
+//
+// Paths are matched against the absolute path of a frame (or its path, for
+// frames without one, e.g. from eval), which for C frames is the path of the
+// ruby frame that called them (the same path their Backtracie::Location gets).
+// Path prefixes get copied into a single buffer when the filter is created, so
+// matching a frame is just a few memcmp()s on the string already referenced by
+// the iseq.
+
+typedef struct {
+  // Every prefix, back-to-back (without NULL terminators)
+  char *prefixes;
+  long prefixes_size;
+  // Each prefix list is a range of offsets into prefixes; prefix i goes from
+  // offsets[i] to offsets[i + 1]
+  long *include_offsets;
+  int include_len;
+  long *exclude_offsets;
+  int exclude_len;
+  bool skip_cfuncs;
+  bool skip_blocks;
+} filter_t;
+
+static VALUE backtracie_filter_class = Qnil;
+static ID include_paths_id;
+static ID exclude_paths_id;
+static ID skip_cfuncs_id;
+static ID skip_blocks_id;
+
+static VALUE filter_alloc(VALUE klass);
+static filter_t *get_filter(VALUE self);
+static VALUE filter_initialize(int argc, VALUE *argv, VALUE self);
+static long *copy_prefixes(filter_t *filter, VALUE paths, int *len);
+static VALUE filter_include_paths(VALUE self);
+static VALUE filter_exclude_paths(VALUE self);
+static VALUE filter_skip_cfuncs(VALUE self);
+static VALUE filter_skip_blocks(VALUE self);
+static VALUE prefixes_to_array(const filter_t *filter, const long *offsets,
+                               int len);
+static bool matches_any(const filter_t *filter, const long *offsets, int len,
+                        VALUE path);
+
+static void filter_free(void *ptr);
+static size_t filter_memsize(const void *ptr);
+static const rb_data_type_t filter_type = {
+    .wrap_struct_name = "backtracie_filter",
+    .function = {.dmark = NULL,
+                 .dfree = filter_free,
+                 .dsize = filter_memsize,
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_filter(VALUE backtracie_module) {
+  include_paths_id = rb_intern("include_paths");
+  exclude_paths_id = rb_intern("exclude_paths");
+  skip_cfuncs_id = rb_intern("skip_cfuncs");
+  skip_blocks_id = rb_intern("skip_blocks");
+
+  backtracie_filter_class =
+      rb_const_get(backtracie_module, rb_intern("Filter"));
+  rb_global_variable(&backtracie_filter_class);
+
+  rb_define_alloc_func(backtracie_filter_class, filter_alloc);
+  rb_define_method(backtracie_filter_class, "initialize", filter_initialize,
+                   -1);
+  rb_define_method(backtracie_filter_class, "include_paths",
+                   filter_include_paths, 0);
+  rb_define_method(backtracie_filter_class, "exclude_paths",
+                   filter_exclude_paths, 0);
+  rb_define_method(backtracie_filter_class, "skip_cfuncs?", filter_skip_cfuncs,
+                   0);
+  rb_define_method(backtracie_filter_class, "skip_blocks?", filter_skip_blocks,
+                   0);
+}
+
+VALUE backtracie_filter_option(VALUE filter) {
+  if (filter == Qundef || NIL_P(filter)) {
+    return Qnil;
+  }
+  get_filter(filter); // Raises if it's not a filter
+  return filter;
+}
+
+bool backtracie_filter_accepts(VALUE filter, const raw_location *loc,
+                               const raw_location *prev_ruby_loc) {
+  const filter_t *filter_data = get_filter(filter);
+
+  if (filter_data->skip_cfuncs && !loc->is_ruby_frame) {
+    return false;
+  }
+  if (filter_data->skip_blocks && backtracie_frame_is_block(loc)) {
+    return false;
+  }
+  if (filter_data->include_len == 0 && filter_data->exclude_len == 0) {
+    return true;
+  }
+
+  VALUE path = Qnil;
+  if (prev_ruby_loc != NULL) {
+    path = backtracie_frame_path_value(prev_ruby_loc, true);
+    if (NIL_P(path)) {
+      path = backtracie_frame_path_value(prev_ruby_loc, false);
+    }
+  }
+
+  if (filter_data->include_len > 0 &&
+      !matches_any(filter_data, filter_data->include_offsets,
+                   filter_data->include_len, path)) {
+    return false;
+  }
+  return !matches_any(filter_data, filter_data->exclude_offsets,
+                      filter_data->exclude_len, path);
+}
+
+static VALUE filter_alloc(VALUE klass) {
+  filter_t *filter;
+  // TypedData_Make_Struct zeroes the struct, so this is a filter that accepts
+  // every frame until initialize gets called
+  return TypedData_Make_Struct(klass, filter_t, &filter_type, filter);
+}
+
+static filter_t *get_filter(VALUE self) {
+  filter_t *filter;
+  TypedData_Get_Struct(self, filter_t, &filter_type, filter);
+  return filter;
+}
+
+// Backtracie::Filter.new(include_paths: [], exclude_paths: [],
+//                        skip_cfuncs: false, skip_blocks: false)
+static VALUE filter_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE keyword_arguments;
+  rb_scan_args(argc, argv, "0:", &keyword_arguments);
+
+  ID keywords[] = {include_paths_id, exclude_paths_id, skip_cfuncs_id,
+                   skip_blocks_id};
+  VALUE values[] = {Qundef, Qundef, Qundef, Qundef};
+  rb_get_kwargs(keyword_arguments, keywords, 0, 4, values);
+
+  VALUE include_paths =
+      values[0] == Qundef || NIL_P(values[0]) ? rb_ary_new() : values[0];
+  VALUE exclude_paths =
+      values[1] == Qundef || NIL_P(values[1]) ? rb_ary_new() : values[1];
+  Check_Type(include_paths, T_ARRAY);
+  Check_Type(exclude_paths, T_ARRAY);
+  for (long i = 0; i < RARRAY_LEN(include_paths); i++) {
+    Check_Type(RARRAY_AREF(include_paths, i), T_STRING);
+  }
+  for (long i = 0; i < RARRAY_LEN(exclude_paths); i++) {
+    Check_Type(RARRAY_AREF(exclude_paths, i), T_STRING);
+  }
+
+  filter_t *filter = get_filter(self);
+  if (filter->prefixes != NULL) {
+    rb_raise(rb_eRuntimeError, "Backtracie::Filter already initialized");
+  }
+
+  long prefixes_size = 0;
+  for (long i = 0; i < RARRAY_LEN(include_paths); i++) {
+    prefixes_size += RSTRING_LEN(RARRAY_AREF(include_paths, i));
+  }
+  for (long i = 0; i < RARRAY_LEN(exclude_paths); i++) {
+    prefixes_size += RSTRING_LEN(RARRAY_AREF(exclude_paths, i));
+  }
+
+  // Allocated even when empty, so we can tell an initialized filter apart
+  filter->prefixes = ALLOC_N(char, prefixes_size + 1);
+  filter->include_offsets = copy_prefixes(filter, include_paths,
+                                          &filter->include_len);
+  filter->exclude_offsets = copy_prefixes(filter, exclude_paths,
+                                          &filter->exclude_len);
+  filter->skip_cfuncs = values[2] != Qundef && RTEST(values[2]);
+  filter->skip_blocks = values[3] != Qundef && RTEST(values[3]);
+
+  return self;
+}
+
+// Appends the given paths to filter->prefixes, returning their offsets
+static long *copy_prefixes(filter_t *filter, VALUE paths, int *len) {
+  long paths_len = RARRAY_LEN(paths);
+  if (paths_len > INT_MAX - 1) {
+    rb_raise(rb_eArgError, "too many paths (%ld)", paths_len);
+  }
+
+  long *offsets = ALLOC_N(long, paths_len + 1);
+  for (long i = 0; i < paths_len; i++) {
+    VALUE path = RARRAY_AREF(paths, i);
+    offsets[i] = filter->prefixes_size;
+    memcpy(filter->prefixes + filter->prefixes_size, RSTRING_PTR(path),
+           RSTRING_LEN(path));
+    filter->prefixes_size += RSTRING_LEN(path);
+  }
+  offsets[paths_len] = filter->prefixes_size;
+  *len = (int)paths_len;
+  return offsets;
+}
+
+static VALUE filter_include_paths(VALUE self) {
+  filter_t *filter = get_filter(self);
+  return prefixes_to_array(filter, filter->include_offsets,
+                           filter->include_len);
+}
+
+static VALUE filter_exclude_paths(VALUE self) {
+  filter_t *filter = get_filter(self);
+  return prefixes_to_array(filter, filter->exclude_offsets,
+                           filter->exclude_len);
+}
+
+static VALUE filter_skip_cfuncs(VALUE self) {
+  return get_filter(self)->skip_cfuncs ? Qtrue : Qfalse;
+}
+
+static VALUE filter_skip_blocks(VALUE self) {
+  return get_filter(self)->skip_blocks ? Qtrue : Qfalse;
+}
+
+static VALUE prefixes_to_array(const filter_t *filter, const long *offsets,
+                               int len) {
+  VALUE result = rb_ary_new_capa(len);
+  for (int i = 0; i < len; i++) {
+    rb_ary_push(result, rb_str_new(filter->prefixes + offsets[i],
+                                   offsets[i + 1] - offsets[i]));
+  }
+  return result;
+}
+
+static bool matches_any(const filter_t *filter, const long *offsets, int len,
+                        VALUE path) {
+  if (len == 0 || !RB_TYPE_P(path, T_STRING)) {
+    return false;
+  }
+  const char *path_ptr = RSTRING_PTR(path);
+  long path_len = RSTRING_LEN(path);
+
+  for (int i = 0; i < len; i++) {
+    long prefix_len = offsets[i + 1] - offsets[i];
+    if (prefix_len <= path_len &&
+        memcmp(path_ptr, filter->prefixes + offsets[i], prefix_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void filter_free(void *ptr) {
+  filter_t *filter = (filter_t *)ptr;
+  xfree(filter->prefixes);
+  xfree(filter->include_offsets);
+  xfree(filter->exclude_offsets);
+  xfree(filter);
+}
+
+static size_t filter_memsize(const void *ptr) {
+  const filter_t *filter = (const filter_t *)ptr;
+  return sizeof(filter_t) + filter->prefixes_size +
+         sizeof(long) * (filter->include_len + filter->exclude_len + 2);
+}
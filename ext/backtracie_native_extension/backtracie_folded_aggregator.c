@@ -0,0 +1,265 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// The folded aggregator counts stacks, so they can later be turned into the
+// "folded" (or collapsed) format used by flamegraph tools: one line per
+// distinct stack, with frame names separated by ';' (starting from the bottom
+// of the stack), followed by a space and the number of times it was seen.
+//
+// Stacks are kept in a stack trie, so adding a stack only involves capturing
+// frame ids and bumping the count for its node; memory usage depends on the
+// number of distinct frames and stacks, not on the number of stacks added.
+// Frame names only get rendered when the output is requested, and then only
+// once for each distinct frame.
+
+typedef struct {
+  VALUE stack_trie;
+} folded_aggregator_t;
+
+static VALUE backtracie_module = Qnil;
+
+static VALUE folded_aggregator_alloc(VALUE klass);
+static folded_aggregator_t *get_folded_aggregator(VALUE self);
+static VALUE folded_aggregator_initialize(VALUE self);
+static VALUE folded_aggregator_stack_trie(VALUE self);
+static VALUE folded_aggregator_add_current_thread(VALUE self);
+static VALUE folded_aggregator_add_thread(VALUE self, VALUE thread);
+static VALUE folded_aggregator_to_folded(VALUE self);
+static void add_stack(VALUE stack_trie, VALUE thread, int start);
+static void append_frame_name(VALUE names, const raw_location *loc);
+
+static void folded_aggregator_mark(void *ptr);
+static void folded_aggregator_compact(void *ptr);
+static void folded_aggregator_free(void *ptr);
+static size_t folded_aggregator_memsize(const void *ptr);
+static const rb_data_type_t folded_aggregator_type = {
+    .wrap_struct_name = "backtracie_folded_aggregator",
+    .function = {.dmark = folded_aggregator_mark,
+                 .dfree = folded_aggregator_free,
+                 .dsize = folded_aggregator_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = folded_aggregator_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_folded_aggregator(VALUE module) {
+  backtracie_module = module;
+  rb_global_variable(&backtracie_module);
+  VALUE backtracie_folded_aggregator_class =
+      rb_define_class_under(module, "FoldedAggregator", rb_cObject);
+  rb_define_alloc_func(backtracie_folded_aggregator_class,
+                       folded_aggregator_alloc);
+
+  rb_define_method(backtracie_folded_aggregator_class, "initialize",
+                   folded_aggregator_initialize, 0);
+  rb_define_method(backtracie_folded_aggregator_class, "stack_trie",
+                   folded_aggregator_stack_trie, 0);
+  rb_define_method(backtracie_folded_aggregator_class, "add_current_thread",
+                   folded_aggregator_add_current_thread, 0);
+  rb_define_method(backtracie_folded_aggregator_class, "add_thread",
+                   folded_aggregator_add_thread, 1);
+  rb_define_method(backtracie_folded_aggregator_class, "to_folded",
+                   folded_aggregator_to_folded, 0);
+}
+
+static VALUE folded_aggregator_alloc(VALUE klass) {
+  folded_aggregator_t *aggregator;
+  VALUE wrapper = TypedData_Make_Struct(
+      klass, folded_aggregator_t, &folded_aggregator_type, aggregator);
+  aggregator->stack_trie = Qnil;
+  return wrapper;
+}
+
+static folded_aggregator_t *get_folded_aggregator(VALUE self) {
+  folded_aggregator_t *aggregator;
+  TypedData_Get_Struct(self, folded_aggregator_t, &folded_aggregator_type,
+                       aggregator);
+  if (aggregator->stack_trie == Qnil) {
+    rb_raise(rb_eRuntimeError, "uninitialized Backtracie::FoldedAggregator");
+  }
+  return aggregator;
+}
+
+static VALUE folded_aggregator_initialize(VALUE self) {
+  folded_aggregator_t *aggregator;
+  TypedData_Get_Struct(self, folded_aggregator_t, &folded_aggregator_type,
+                       aggregator);
+  aggregator->stack_trie =
+      backtracie_stack_trie_new(backtracie_frame_table_new());
+  return self;
+}
+
+// The stack trie is where the counts are actually kept, so it can also be used
+// e.g. to get a pprof profile of the same stacks
+static VALUE folded_aggregator_stack_trie(VALUE self) {
+  return get_folded_aggregator(self)->stack_trie;
+}
+
+static VALUE folded_aggregator_add_current_thread(VALUE self) {
+  // Skips the frame for this method
+  add_stack(get_folded_aggregator(self)->stack_trie, rb_thread_current(), 1);
+  return self;
+}
+
+// Dead threads are ignored
+static VALUE folded_aggregator_add_thread(VALUE self, VALUE thread) {
+  VALUE stack_trie = get_folded_aggregator(self)->stack_trie;
+  rb_funcall(backtracie_module, rb_intern("ensure_object_is_thread"), 1,
+             thread);
+  add_stack(stack_trie, thread, thread == rb_thread_current() ? 1 : 0);
+  return self;
+}
+
+// Returns a string with a "frame1;frame2;frame3 count\n" line for every
+// distinct stack added so far
+static VALUE folded_aggregator_to_folded(VALUE self) {
+  return backtracie_stack_trie_to_folded(
+      get_folded_aggregator(self)->stack_trie, NULL, 0);
+}
+
+VALUE backtracie_stack_trie_to_folded(VALUE stack_trie, const uint64_t *counts,
+                                      uint32_t counts_len) {
+  VALUE frame_table = backtracie_stack_trie_frame_table(stack_trie);
+  uint32_t frames_len = backtracie_frame_table_size(frame_table);
+  uint32_t nodes_len = backtracie_stack_trie_size(stack_trie);
+
+  int max_depth = 0;
+  for (uint32_t node = 1; node < nodes_len; node++) {
+    int depth = backtracie_stack_trie_depth(stack_trie, node);
+    if (depth > max_depth) {
+      max_depth = depth;
+    }
+  }
+
+  // The names of all frames are kept back-to-back in names; name_offsets has
+  // frames_len + 1 entries, so that the name for frame i goes from
+  // name_offsets[i] to name_offsets[i + 1]. As frame ids are dense, rendering
+  // them all upfront means each name gets rendered only once.
+  VALUE names = rb_str_buf_new(frames_len * 32);
+  VALUE name_offsets_buffer;
+  long *name_offsets = ALLOCV_N(long, name_offsets_buffer, frames_len + 1);
+  for (uint32_t i = 0; i < frames_len; i++) {
+    name_offsets[i] = RSTRING_LEN(names);
+    append_frame_name(names, backtracie_frame_table_get(frame_table, i));
+  }
+  name_offsets[frames_len] = RSTRING_LEN(names);
+
+  VALUE frame_ids_buffer;
+  uint32_t *frame_ids = ALLOCV_N(uint32_t, frame_ids_buffer, max_depth);
+  VALUE result = rb_str_buf_new(0);
+  for (uint32_t node = 1; node < nodes_len; node++) {
+    uint64_t count =
+        counts == NULL ? backtracie_stack_trie_count(stack_trie, node)
+                       : (node < counts_len ? counts[node] : 0);
+    if (count == 0) {
+      continue;
+    }
+
+    int frame_ids_len =
+        backtracie_stack_trie_frame_ids(stack_trie, node, frame_ids, max_depth);
+    // Frame ids are ordered like a backtrace, but folded stacks start from the
+    // bottom
+    for (int i = frame_ids_len - 1; i >= 0; i--) {
+      uint32_t frame_id = frame_ids[i];
+      rb_str_cat(result, RSTRING_PTR(names) + name_offsets[frame_id],
+                 name_offsets[frame_id + 1] - name_offsets[frame_id]);
+      if (i > 0) {
+        rb_str_cat(result, ";", 1);
+      }
+    }
+
+    char count_buf[32];
+    int count_len = snprintf(count_buf, sizeof(count_buf), " %llu\n",
+                             (unsigned long long)count);
+    rb_str_cat(result, count_buf, count_len);
+  }
+
+  ALLOCV_END(name_offsets_buffer);
+  ALLOCV_END(frame_ids_buffer);
+  RB_GC_GUARD(names);
+  RB_GC_GUARD(stack_trie);
+  return result;
+}
+
+static void add_stack(VALUE stack_trie, VALUE thread, int start) {
+  if (!backtracie_is_thread_alive(thread)) {
+    return;
+  }
+
+  int max_frame_count = backtracie_frame_count_for_thread(thread);
+  VALUE frame_ids_buffer;
+  uint32_t *frame_ids = ALLOCV_N(uint32_t, frame_ids_buffer, max_frame_count);
+
+  int frame_ids_len = backtracie_frame_table_capture_frames_for_thread(
+      backtracie_stack_trie_frame_table(stack_trie), thread, start,
+      max_frame_count, frame_ids);
+  backtracie_stack_trie_insert(stack_trie, frame_ids, frame_ids_len);
+
+  ALLOCV_END(frame_ids_buffer);
+}
+
+// Renders the name of the frame straight into the spare capacity of names
+static void append_frame_name(VALUE names, const raw_location *loc) {
+  long names_len = RSTRING_LEN(names);
+  size_t available = 128;
+  rb_str_modify_expand(names, (long)available);
+  size_t name_len = backtracie_frame_name_cstr(
+      loc, RSTRING_PTR(names) + names_len, available);
+  if (name_len >= available) {
+    available = name_len + 1;
+    rb_str_modify_expand(names, (long)available);
+    backtracie_frame_name_cstr(loc, RSTRING_PTR(names) + names_len, available);
+  }
+  rb_str_set_len(names, names_len + (long)name_len);
+}
+
+static void folded_aggregator_mark(void *ptr) {
+  folded_aggregator_t *aggregator = (folded_aggregator_t *)ptr;
+#ifdef PRE_GC_MARK_MOVABLE
+  rb_gc_mark(aggregator->stack_trie);
+#else
+  rb_gc_mark_movable(aggregator->stack_trie);
+#endif
+}
+
+static void folded_aggregator_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  folded_aggregator_t *aggregator = (folded_aggregator_t *)ptr;
+  aggregator->stack_trie = rb_gc_location(aggregator->stack_trie);
+#endif
+}
+
+static void folded_aggregator_free(void *ptr) { xfree(ptr); }
+
+static size_t folded_aggregator_memsize(const void *ptr) {
+  return sizeof(folded_aggregator_t);
+}
@@ -0,0 +1,284 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// The frame table interns frames -- (iseq, cme, self_or_self_class, line)
+// tuples -- into dense uint32_t ids, starting from 0.
+//
+// Entries are stored in insertion order (so an id is just an index into
+// entries), and are found via an open addressing hash table (slots), which
+// stores id + 1 for each entry, or 0 for an empty slot.
+
+typedef struct {
+  raw_location location;
+  int line_number;
+} frame_table_entry_t;
+
+typedef struct {
+  frame_table_entry_t *entries;
+  uint32_t entries_len;
+  uint32_t entries_capa;
+  uint32_t *slots;
+  // Always a power of two, and always more than twice entries_capa
+  uint32_t slots_capa;
+  // Where frames get captured before being interned, kept around so that
+  // capturing doesn't need to allocate
+  raw_location *scratch;
+  uint32_t scratch_capa;
+} frame_table_t;
+
+#define FRAME_TABLE_INITIAL_CAPA 64
+
+extern VALUE backtracie_frame_table_class;
+
+static frame_table_t *get_frame_table(VALUE table);
+static void frame_table_reserve(frame_table_t *table, uint32_t count);
+static uint32_t frame_table_intern(frame_table_t *table,
+                                   const raw_location *loc);
+static void frame_table_rehash(frame_table_t *table);
+static uint32_t frame_table_find_slot(const frame_table_t *table,
+                                      const raw_location *loc, int line_number);
+static uint64_t entry_hash(const raw_location *loc, int line_number);
+static bool entry_matches(const frame_table_entry_t *entry,
+                          const raw_location *loc, int line_number);
+
+static void frame_table_mark(void *ptr);
+static void frame_table_compact(void *ptr);
+static void frame_table_free(void *ptr);
+static size_t frame_table_memsize(const void *ptr);
+static const rb_data_type_t frame_table_type = {
+    .wrap_struct_name = "backtracie_frame_table",
+    .function = {.dmark = frame_table_mark,
+                 .dfree = frame_table_free,
+                 .dsize = frame_table_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = frame_table_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+VALUE backtracie_frame_table_new(void) {
+  return backtracie_frame_table_alloc(backtracie_frame_table_class);
+}
+
+VALUE backtracie_frame_table_alloc(VALUE klass) {
+  frame_table_t *table;
+  VALUE wrapper =
+      TypedData_Make_Struct(klass, frame_table_t, &frame_table_type, table);
+  table->entries_capa = FRAME_TABLE_INITIAL_CAPA;
+  table->entries = ALLOC_N(frame_table_entry_t, table->entries_capa);
+  table->slots_capa = FRAME_TABLE_INITIAL_CAPA * 4;
+  table->slots = ZALLOC_N(uint32_t, table->slots_capa);
+  return wrapper;
+}
+
+uint32_t backtracie_frame_table_intern(VALUE table, const raw_location *loc) {
+  frame_table_t *frame_table = get_frame_table(table);
+  frame_table_reserve(frame_table, 1);
+  return frame_table_intern(frame_table, loc);
+}
+
+const raw_location *backtracie_frame_table_get(VALUE table, uint32_t id) {
+  frame_table_t *frame_table = get_frame_table(table);
+  if (id >= frame_table->entries_len) {
+    return NULL;
+  }
+  return &frame_table->entries[id].location;
+}
+
+uint32_t backtracie_frame_table_size(VALUE table) {
+  return get_frame_table(table)->entries_len;
+}
+
+int backtracie_frame_table_capture_frames_for_thread(VALUE table, VALUE thread,
+                                                     int start, int max,
+                                                     uint32_t *out) {
+  if (max <= 0) {
+    return 0;
+  }
+  frame_table_t *frame_table = get_frame_table(table);
+
+  // Make sure nothing below can allocate memory (and thus trigger the GC, which
+  // could move the objects we're referencing from the raw_locations, as those
+  // are not yet known to the GC via the frame table)
+  frame_table_reserve(frame_table, (uint32_t)max);
+  raw_location *raw_frames = frame_table->scratch;
+
+  int captured =
+      backtracie_capture_frames_for_thread(thread, start, max, raw_frames);
+  for (int i = 0; i < captured; i++) {
+    out[i] = frame_table_intern(frame_table, &raw_frames[i]);
+  }
+  return captured;
+}
+
+static frame_table_t *get_frame_table(VALUE table) {
+  frame_table_t *frame_table;
+  TypedData_Get_Struct(table, frame_table_t, &frame_table_type, frame_table);
+  return frame_table;
+}
+
+// Makes sure count more entries can be interned (and count frames captured into
+// the scratch buffer) without needing to allocate
+static void frame_table_reserve(frame_table_t *table, uint32_t count) {
+  if (count > UINT32_MAX / 4 - table->entries_len) {
+    rb_raise(rb_eRangeError, "backtracie frame table is full");
+  }
+  if (count > table->scratch_capa) {
+    uint32_t new_scratch_capa =
+        count < table->scratch_capa * 2 ? table->scratch_capa * 2 : count;
+    // The scratch buffer only holds frames while capturing, so there's
+    // nothing to keep
+    xfree(table->scratch);
+    table->scratch = NULL;
+    table->scratch_capa = 0;
+    table->scratch = ALLOC_N(raw_location, new_scratch_capa);
+    table->scratch_capa = new_scratch_capa;
+  }
+
+  uint32_t needed = table->entries_len + count;
+  if (needed <= table->entries_capa) {
+    return;
+  }
+
+  uint32_t new_capa = table->entries_capa;
+  while (new_capa < needed) {
+    new_capa = new_capa > UINT32_MAX / 8 ? needed : new_capa * 2;
+  }
+  uint32_t new_slots_capa = table->slots_capa;
+  while (new_slots_capa <= new_capa * 2) {
+    new_slots_capa *= 2;
+  }
+
+  REALLOC_N(table->entries, frame_table_entry_t, new_capa);
+  table->entries_capa = new_capa;
+  if (new_slots_capa != table->slots_capa) {
+    uint32_t *new_slots = ZALLOC_N(uint32_t, new_slots_capa);
+    xfree(table->slots);
+    table->slots = new_slots;
+    table->slots_capa = new_slots_capa;
+    frame_table_rehash(table);
+  }
+}
+
+// Must only be called when there's capacity for (at least) one more entry
+static uint32_t frame_table_intern(frame_table_t *table,
+                                   const raw_location *loc) {
+  int line_number =
+      loc->is_ruby_frame ? backtracie_frame_line_number(loc) : 0;
+
+  uint32_t slot = frame_table_find_slot(table, loc, line_number);
+  if (table->slots[slot] != 0) {
+    return table->slots[slot] - 1;
+  }
+
+  uint32_t id = table->entries_len++;
+  table->entries[id].location = *loc;
+  table->entries[id].line_number = line_number;
+  table->slots[slot] = id + 1;
+  return id;
+}
+
+// Rebuilds the slots from the entries; does not allocate memory
+static void frame_table_rehash(frame_table_t *table) {
+  memset(table->slots, 0, table->slots_capa * sizeof(uint32_t));
+  for (uint32_t id = 0; id < table->entries_len; id++) {
+    frame_table_entry_t *entry = &table->entries[id];
+    uint32_t slot =
+        frame_table_find_slot(table, &entry->location, entry->line_number);
+    table->slots[slot] = id + 1;
+  }
+}
+
+// Returns either the slot with the matching entry, or the empty slot where it
+// should be inserted
+static uint32_t frame_table_find_slot(const frame_table_t *table,
+                                      const raw_location *loc,
+                                      int line_number) {
+  uint32_t mask = table->slots_capa - 1;
+  uint32_t slot = (uint32_t)entry_hash(loc, line_number) & mask;
+  while (table->slots[slot] != 0 &&
+         !entry_matches(&table->entries[table->slots[slot] - 1], loc,
+                        line_number)) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static uint64_t entry_hash(const raw_location *loc, int line_number) {
+  uint64_t hash = backtracie_hash_mix(0, loc->iseq);
+  hash = backtracie_hash_mix(hash, loc->callable_method_entry);
+  hash = backtracie_hash_mix(hash, loc->self_or_self_class);
+  return backtracie_hash_mix(hash, (uint64_t)line_number << 2 |
+                                       loc->is_ruby_frame << 1 |
+                                       loc->self_is_real_self);
+}
+
+static bool entry_matches(const frame_table_entry_t *entry,
+                          const raw_location *loc, int line_number) {
+  return entry->location.iseq == loc->iseq &&
+         entry->location.callable_method_entry == loc->callable_method_entry &&
+         entry->location.self_or_self_class == loc->self_or_self_class &&
+         entry->location.is_ruby_frame == loc->is_ruby_frame &&
+         entry->location.self_is_real_self == loc->self_is_real_self &&
+         entry->line_number == line_number;
+}
+
+static void frame_table_mark(void *ptr) {
+  frame_table_t *table = (frame_table_t *)ptr;
+  for (uint32_t id = 0; id < table->entries_len; id++) {
+    backtracie_frame_mark_movable(&table->entries[id].location);
+  }
+}
+
+static void frame_table_compact(void *ptr) {
+  frame_table_t *table = (frame_table_t *)ptr;
+  for (uint32_t id = 0; id < table->entries_len; id++) {
+    backtracie_frame_compact(&table->entries[id].location);
+  }
+  // The hashes depend on the object addresses, which may have just changed
+  frame_table_rehash(table);
+}
+
+static void frame_table_free(void *ptr) {
+  frame_table_t *table = (frame_table_t *)ptr;
+  xfree(table->entries);
+  xfree(table->slots);
+  xfree(table->scratch);
+  xfree(table);
+}
+
+static size_t frame_table_memsize(const void *ptr) {
+  const frame_table_t *table = (const frame_table_t *)ptr;
+  return sizeof(frame_table_t) +
+         sizeof(frame_table_entry_t) * table->entries_capa +
+         sizeof(uint32_t) * table->slots_capa +
+         sizeof(raw_location) * table->scratch_capa;
+}
@@ -123,6 +123,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #ifdef PRE_MJIT_RUBY
 // The order of includes here is very important in older versions of Ruby
@@ -152,6 +157,18 @@
 #define rb_execution_context_t rb_thread_t
 #endif
 
+// Iterates over every living thread (of the current ractor), as a rb_thread_t *
+#ifdef PRE_RACTOR
+#define FOR_EACH_LIVING_THREAD(th)                                             \
+  list_for_each(&GET_VM()->living_threads, th, vmlt_node)
+#elif defined(PRE_CCAN_LIST)
+#define FOR_EACH_LIVING_THREAD(th)                                             \
+  list_for_each(&GET_RACTOR()->threads.set, th, lt_node)
+#else
+#define FOR_EACH_LIVING_THREAD(th)                                             \
+  ccan_list_for_each(&GET_RACTOR()->threads.set, th, lt_node)
+#endif
+
 #ifdef PRE_VM_ENV_RENAMES
 #define VM_ENV_LOCAL_P VM_EP_LEP_P
 #define VM_ENV_PREV_EP VM_EP_PREV_EP
@@ -162,12 +179,20 @@
 // This is managed in backtracie.c
 extern VALUE backtracie_main_object_instance;
 extern VALUE backtracie_frame_wrapper_class;
+extern VALUE backtracie_minimal_frame_wrapper_class;
 static void raw_location_to_minimal_location(const raw_location *raw_loc,
-                                             minimal_location_t *min_loc);
-static void mod_to_s_anon(VALUE klass, strbuilder_t *strout);
-static void mod_to_s_refinement(VALUE klass, strbuilder_t *strout);
-static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout);
-static void mod_to_s(VALUE klass, strbuilder_t *strout);
+                                             minimal_location_t *min_loc,
+                                             bool with_line_number);
+static void mod_to_s_anon(VALUE klass, strbuilder_t *strout,
+                          backtracie_class_name_dependencies_t *deps);
+static void mod_to_s_refinement(VALUE klass, strbuilder_t *strout,
+                                backtracie_class_name_dependencies_t *deps);
+static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout,
+                               backtracie_class_name_dependencies_t *deps);
+static void mod_to_s(VALUE klass, strbuilder_t *strout,
+                     backtracie_class_name_dependencies_t *deps);
+static void cached_mod_to_s(VALUE klass, bool refinement,
+                            strbuilder_t *strout);
 static void minimal_location_method_qualifier(const minimal_location_t *loc,
                                               strbuilder_t *strout);
 static void minimal_location_method_name(const minimal_location_t *loc,
@@ -176,11 +201,20 @@ static bool frame_filename(const raw_location *loc, bool absolute,
                            strbuilder_t *strout);
 static bool iseq_path(const rb_iseq_t *iseq, bool absolute,
                       strbuilder_t *strout);
+static VALUE iseq_path_value(const rb_iseq_t *iseq, bool absolute);
 static int frame_label(const raw_location *loc, bool base,
                        strbuilder_t *strout);
+static VALUE frame_label_value(const raw_location *loc, bool base);
+static uint64_t hash_str_value(uint64_t hash, VALUE str);
 static int calc_lineno(const rb_iseq_t *iseq, const void *pc);
+static int cached_calc_lineno(const rb_iseq_t *iseq, const void *pc);
 static const rb_callable_method_entry_t *
 backtracie_vm_frame_method_entry(const rb_control_frame_t *cfp);
+static const rb_callable_method_entry_t *
+copied_vm_frame_method_entry(const rb_control_frame_t *cfp);
+static rb_execution_context_t *thread_execution_context(VALUE thread);
+static rb_execution_context_t *
+thread_pointer_execution_context(rb_thread_t *thread_pointer);
 
 static void backtracie_frame_wrapper_mark(void *ptr);
 static void backtracie_frame_wrapper_compact(void *ptr);
@@ -206,8 +240,35 @@ typedef struct {
   raw_location *frames;
   size_t capa;
   int len;
+  int lookahead_len;
 } frame_wrapper_t;
 
+static void minimal_frame_wrapper_mark(void *ptr);
+static void minimal_frame_wrapper_compact(void *ptr);
+static void minimal_frame_wrapper_free(void *ptr);
+static size_t minimal_frame_wrapper_memsize(const void *ptr);
+static const rb_data_type_t minimal_frame_wrapper_type = {
+    .wrap_struct_name = "backtracie_minimal_frame_wrapper",
+    .function = {.dmark = minimal_frame_wrapper_mark,
+                 .dfree = minimal_frame_wrapper_free,
+                 .dsize = minimal_frame_wrapper_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = minimal_frame_wrapper_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+typedef struct {
+  minimal_location_t *frames;
+  size_t capa;
+  int len;
+} minimal_frame_wrapper_t;
+
 static bool object_has_special_bt_handling(VALUE obj) {
   return obj == backtracie_main_object_instance || obj == rb_mRubyVMFrozenCore;
 }
@@ -290,13 +351,38 @@ backtracie_frame_count_for_execution_context(rb_execution_context_t *ec) {
 int backtracie_frame_count_for_thread(VALUE thread) {
   if (!backtracie_is_thread_alive(thread))
     return 0;
-  rb_thread_t *thread_pointer = (rb_thread_t *)DATA_PTR(thread);
 
-#ifndef PRE_EXECUTION_CONTEXT
-  return backtracie_frame_count_for_execution_context(thread_pointer->ec);
-#else
-  return backtracie_frame_count_for_execution_context(thread_pointer);
-#endif
+  return backtracie_frame_count_for_execution_context(
+      thread_execution_context(thread));
+}
+
+// Work out validity, or otherwise, of this frame.
+// This expression is derived from what backtrace_each in vm_backtrace.c does.
+static bool control_frame_is_valid(const rb_control_frame_t *cfp,
+                                   const rb_callable_method_entry_t *cme) {
+  return (!(cfp->iseq && !cfp->pc) &&
+          (VM_FRAME_RUBYFRAME_P(cfp) ||
+           (cme && cme->def->type == VM_METHOD_TYPE_CFUNC)));
+}
+
+static void set_self_or_self_class(VALUE self, raw_location *loc) {
+  if (object_has_special_bt_handling(self) || class_or_module_or_iclass(self)) {
+    loc->self_or_self_class = self;
+    loc->self_is_real_self = 1;
+  } else {
+    loc->self_or_self_class = rb_class_of(self);
+    loc->self_is_real_self = 0;
+  }
+}
+
+static void control_frame_to_raw_location(const rb_control_frame_t *cfp,
+                                          const rb_callable_method_entry_t *cme,
+                                          raw_location *loc) {
+  loc->is_ruby_frame = VM_FRAME_RUBYFRAME_P(cfp);
+  loc->iseq = (VALUE)cfp->iseq;
+  loc->callable_method_entry = (VALUE)cme;
+  set_self_or_self_class(cfp->self, loc);
+  loc->pc = cfp->pc;
 }
 
 static bool backtracie_capture_frame_for_execution_context(
@@ -316,50 +402,392 @@ static bool backtracie_capture_frame_for_execution_context(
   }
 
   const rb_callable_method_entry_t *cme = backtracie_vm_frame_method_entry(cfp);
+  BACKTRACIE_STATS_INC(frames_walked);
 
-  // Work out validity, or otherwise, of this frame.
-  // This expression is derived from what backtrace_each in vm_backtrace.c does.
-  bool is_valid = (!(cfp->iseq && !cfp->pc) &&
-                   (VM_FRAME_RUBYFRAME_P(cfp) ||
-                    (cme && cme->def->type == VM_METHOD_TYPE_CFUNC)));
-  if (!is_valid) {
+  if (!control_frame_is_valid(cfp, cme)) {
     // Don't include this frame in backtraces
+    BACKTRACIE_STATS_INC(skipped_frames);
     return false;
   }
 
-  loc->is_ruby_frame = VM_FRAME_RUBYFRAME_P(cfp);
-  loc->iseq = (VALUE)cfp->iseq;
-  loc->callable_method_entry = (VALUE)cme;
-  if (object_has_special_bt_handling(cfp->self) ||
-      class_or_module_or_iclass(cfp->self)) {
-    loc->self_or_self_class = cfp->self;
-    loc->self_is_real_self = 1;
-  } else {
-    loc->self_or_self_class = rb_class_of(cfp->self);
-    loc->self_is_real_self = 0;
-  }
-  loc->pc = cfp->pc;
+  BACKTRACIE_STATS_INC(valid_frames);
+  control_frame_to_raw_location(cfp, cme, loc);
   return true;
 }
 
+// Walks the stack of the execution context once, from the frame closest to
+// where execution is now towards the bottom of the stack. The first start valid
+// frames are skipped; the next (up to) max valid frames are written to either
+// raw_out or min_out (whichever is not NULL).
+//
+// If ruby_out is not NULL (which needs raw_out), and the last frame written to
+// raw_out is a C frame, the same walk then carries on to the first ruby frame
+// after it (which is where the C frame was called from), and writes it to
+// ruby_out; found_ruby_out gets set to whether there was one.
+static int backtracie_capture_frames_for_execution_context(
+    rb_execution_context_t *ec, int start, int max, raw_location *raw_out,
+    minimal_location_t *min_out, raw_location *ruby_out,
+    bool *found_ruby_out) {
+  if (found_ruby_out) {
+    *found_ruby_out = false;
+  }
+  if (ec->cfp == NULL || max <= 0) {
+    // See backtracie_frame_count_for_execution_context for the NULL case
+    return 0;
+  }
+
+  // -1 because of the two "dummy" frames at the bottom of the stack (see
+  // backtracie_capture_frame_for_execution_context above).
+  const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec) - 1;
+  uint64_t started_at = BACKTRACIE_STATS_TIMER_START();
+  int frames_walked = 0;
+  int valid_frames_seen = 0;
+  int captured = 0;
+  const rb_control_frame_t *cfp = ec->cfp;
+
+  for (; RUBY_VM_VALID_CONTROL_FRAME_P(cfp, end_cfp) && captured < max;
+       cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+    frames_walked++;
+    const rb_callable_method_entry_t *cme =
+        backtracie_vm_frame_method_entry(cfp);
+    if (!control_frame_is_valid(cfp, cme)) {
+      continue;
+    }
+    if (valid_frames_seen++ < start) {
+      continue;
+    }
+
+    if (raw_out) {
+      control_frame_to_raw_location(cfp, cme, &raw_out[captured]);
+    } else {
+      raw_location raw_loc;
+      control_frame_to_raw_location(cfp, cme, &raw_loc);
+      raw_location_to_minimal_location(&raw_loc, &min_out[captured], true);
+    }
+    captured++;
+  }
+
+  if (ruby_out && captured == max && !raw_out[captured - 1].is_ruby_frame) {
+    for (; RUBY_VM_VALID_CONTROL_FRAME_P(cfp, end_cfp);
+         cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+      frames_walked++;
+      const rb_callable_method_entry_t *cme =
+          backtracie_vm_frame_method_entry(cfp);
+      if (!control_frame_is_valid(cfp, cme)) {
+        continue;
+      }
+      valid_frames_seen++;
+      if (VM_FRAME_RUBYFRAME_P(cfp)) {
+        control_frame_to_raw_location(cfp, cme, ruby_out);
+        *found_ruby_out = true;
+        break;
+      }
+    }
+  }
+
+  // Counted once per walk, rather than per frame, to keep the loop tight
+  BACKTRACIE_STATS_ADD(frames_walked, frames_walked);
+  BACKTRACIE_STATS_ADD(valid_frames, valid_frames_seen);
+  BACKTRACIE_STATS_ADD(skipped_frames, frames_walked - valid_frames_seen);
+  BACKTRACIE_STATS_TIMER_STOP(capture_ns, started_at);
+  return captured;
+}
+
+// Note: Everything called from here needs to be async-signal-safe; we only
+// read the VM's memory, and never call into Ruby (or take any locks)
+int backtracie_signal_safe_capture_frames(VALUE *thread,
+                                          backtracie_signal_safe_frame_t *out,
+                                          int max) {
+#ifdef PRE_EXECUTION_CONTEXT
+  rb_thread_t *thread_pointer = GET_THREAD();
+  rb_execution_context_t *ec = thread_pointer;
+#else
+  rb_execution_context_t *ec = GET_EC();
+  rb_thread_t *thread_pointer = ec == NULL ? NULL : ec->thread_ptr;
+#endif
+  if (ec == NULL || thread_pointer == NULL || ec->cfp == NULL) {
+    return -1;
+  }
+
+#ifdef PRE_RACTOR
+  // Prior to Ruby 3.0, the current execution context is the one for whatever
+  // thread holds the GVL, which may be running right now on another core (and
+  // thus changing its stack under our feet). Only go ahead if that's us.
+#ifdef HAVE_PTHREAD_H
+  if (!pthread_equal(pthread_self(), thread_pointer->thread_id)) {
+    return -1;
+  }
+#else
+  return -1;
+#endif
+#else
+  // Since Ruby 3.0, the current execution context is the one for the thread
+  // we're running on, but that thread may not be holding the GVL, and then the
+  // GC may be running on another thread (and may even start after we've
+  // checked for it, see backtracie_ring_buffer.c). Only go ahead if we're the
+  // GVL owner, as then nothing else can run until the signal handler returns.
+#ifdef PRE_THREAD_SCHED
+  if (thread_pointer->ractor->threads.gvl.owner != thread_pointer) {
+    return -1;
+  }
+#else
+  if (thread_pointer->ractor->threads.sched.running != thread_pointer) {
+    return -1;
+  }
+#endif
+#endif
+
+  *thread = thread_pointer->self;
+
+  const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec) - 1;
+  int captured = 0;
+  for (const rb_control_frame_t *cfp = ec->cfp;
+       RUBY_VM_VALID_CONTROL_FRAME_P(cfp, end_cfp) && captured < max;
+       cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+    // The copied version never calls rb_bug, even on debug builds of Ruby
+    const rb_callable_method_entry_t *cme = copied_vm_frame_method_entry(cfp);
+    if (!control_frame_is_valid(cfp, cme)) {
+      continue;
+    }
+
+    backtracie_signal_safe_frame_t *frame = &out[captured++];
+    frame->iseq = (VALUE)cfp->iseq;
+    frame->callable_method_entry = (VALUE)cme;
+    frame->self = cfp->self;
+    frame->pc_and_flags =
+        (uintptr_t)cfp->pc | (VM_FRAME_RUBYFRAME_P(cfp) ? 1 : 0);
+  }
+  return captured;
+}
+
+void backtracie_signal_safe_frame_to_raw_location(
+    const backtracie_signal_safe_frame_t *frame, raw_location *loc) {
+  loc->is_ruby_frame = frame->pc_and_flags & 1;
+  loc->iseq = frame->iseq;
+  loc->callable_method_entry = frame->callable_method_entry;
+  set_self_or_self_class(frame->self, loc);
+  loc->pc = (const void *)(frame->pc_and_flags & ~(uintptr_t)1);
+}
+
+static rb_execution_context_t *thread_execution_context(VALUE thread) {
+  return thread_pointer_execution_context((rb_thread_t *)DATA_PTR(thread));
+}
+
+static rb_execution_context_t *
+thread_pointer_execution_context(rb_thread_t *thread_pointer) {
+#ifndef PRE_EXECUTION_CONTEXT
+  return thread_pointer->ec;
+#else
+  return thread_pointer;
+#endif
+}
+
 bool backtracie_capture_frame_for_thread(VALUE thread, int frame_index,
                                          raw_location *loc) {
+  BACKTRACIE_STATS_INC(captures_frame_for_thread);
   if (!backtracie_is_thread_alive(thread)) {
     return false;
   }
-  rb_thread_t *thread_pointer = (rb_thread_t *)DATA_PTR(thread);
 
-#ifndef PRE_EXECUTION_CONTEXT
-  return backtracie_capture_frame_for_execution_context(thread_pointer->ec,
-                                                        frame_index, loc);
-#else
-  return backtracie_capture_frame_for_execution_context(thread_pointer,
-                                                        frame_index, loc);
-#endif
+  return backtracie_capture_frame_for_execution_context(
+      thread_execution_context(thread), frame_index, loc);
+}
+
+int backtracie_capture_frames_for_thread(VALUE thread, int start, int max,
+                                         raw_location *out) {
+  BACKTRACIE_STATS_INC(captures_frames_for_thread);
+  if (!backtracie_is_thread_alive(thread)) {
+    return 0;
+  }
+
+  return backtracie_capture_frames_for_execution_context(
+      thread_execution_context(thread), start, max, out, NULL, NULL, NULL);
+}
+
+int backtracie_capture_frames_and_ruby_frame_for_thread(VALUE thread,
+                                                        int start, int max,
+                                                        raw_location *out,
+                                                        raw_location *ruby_loc,
+                                                        bool *found_ruby_loc) {
+  BACKTRACIE_STATS_INC(captures_frames_for_thread);
+  *found_ruby_loc = false;
+  if (!backtracie_is_thread_alive(thread)) {
+    return 0;
+  }
+
+  return backtracie_capture_frames_for_execution_context(
+      thread_execution_context(thread), start, max, out, NULL, ruby_loc,
+      found_ruby_loc);
+}
+
+int backtracie_capture_frames_for_thread_fingerprint(VALUE thread, int start,
+                                                     int max,
+                                                     raw_location *out,
+                                                     uint64_t *fingerprint) {
+  int captured = backtracie_capture_frames_for_thread(thread, start, max, out);
+  if (fingerprint) {
+    *fingerprint = backtracie_frames_fingerprint(out, captured);
+  }
+  return captured;
+}
+
+uint64_t backtracie_frames_fingerprint(const raw_location *frames, int len) {
+  uint64_t hash = backtracie_hash_mix(0, (uint64_t)len);
+  for (int i = 0; i < len; i++) {
+    const raw_location *loc = &frames[i];
+    // Only the contents of the strings get hashed, never any addresses, so
+    // that the same stack gets the same fingerprint in every process (and
+    // after the GC compacts the heap)
+    if (loc->is_ruby_frame && RTEST(loc->iseq)) {
+      const rb_iseq_t *iseq = (const rb_iseq_t *)loc->iseq;
+      hash = hash_str_value(hash, iseq_path_value(iseq, false));
+      hash = hash_str_value(hash, iseq->body->location.label);
+      hash = backtracie_hash_mix(hash,
+                                 (uint64_t)backtracie_frame_line_number(loc));
+    }
+    if (RTEST(loc->callable_method_entry)) {
+      const rb_callable_method_entry_t *cme =
+          (const rb_callable_method_entry_t *)loc->callable_method_entry;
+      hash = hash_str_value(hash, rb_id2str(cme->def->original_id));
+      // Cached so that this doesn't allocate; anonymous modules (and
+      // singleton classes) don't have one
+      VALUE owner_name = rb_class_path_cached(cme->owner);
+      bool is_permanent_name = RB_TYPE_P(owner_name, T_STRING) &&
+                               RSTRING_LEN(owner_name) > 0 &&
+                               RSTRING_PTR(owner_name)[0] != '#';
+      hash = hash_str_value(hash, is_permanent_name ? owner_name : Qnil);
+    } else {
+      hash = backtracie_hash_mix(hash, 0);
+    }
+  }
+  return hash;
+}
+
+// Mixes the length and contents of str (or just a 0, if it's not a string)
+// into hash
+static uint64_t hash_str_value(uint64_t hash, VALUE str) {
+  if (!RB_TYPE_P(str, T_STRING)) {
+    return backtracie_hash_mix(hash, 0);
+  }
+  const char *ptr = RSTRING_PTR(str);
+  long len = RSTRING_LEN(str);
+  hash = backtracie_hash_mix(hash, (uint64_t)len + 1);
+  for (long i = 0; i < len; i += 8) {
+    uint64_t chunk = 0;
+    memcpy(&chunk, ptr + i, len - i < 8 ? (size_t)(len - i) : 8);
+    hash = backtracie_hash_mix(hash, chunk);
+  }
+  return hash;
+}
+
+int backtracie_capture_minimal_frames_for_thread(VALUE thread, int start,
+                                                 int max,
+                                                 minimal_location_t *out) {
+  BACKTRACIE_STATS_INC(captures_frames_for_thread);
+  if (!backtracie_is_thread_alive(thread)) {
+    return 0;
+  }
+
+  return backtracie_capture_frames_for_execution_context(
+      thread_execution_context(thread), start, max, NULL, out, NULL, NULL);
+}
+
+int backtracie_living_threads(VALUE *out, int max) {
+  int count = 0;
+  rb_thread_t *thread_pointer = NULL;
+  FOR_EACH_LIVING_THREAD(thread_pointer) {
+    if (!backtracie_is_thread_alive(thread_pointer->self)) {
+      continue;
+    }
+    if (count < max) {
+      out[count] = thread_pointer->self;
+    }
+    count++;
+  }
+  return count;
+}
+
+int backtracie_all_threads_count(int *frame_count) {
+  int thread_count = 0;
+  int total_frame_count = 0;
+  rb_thread_t *thread_pointer = NULL;
+  FOR_EACH_LIVING_THREAD(thread_pointer) {
+    if (!backtracie_is_thread_alive(thread_pointer->self)) {
+      continue;
+    }
+    thread_count++;
+    total_frame_count += backtracie_frame_count_for_execution_context(
+        thread_pointer_execution_context(thread_pointer));
+  }
+
+  if (frame_count) {
+    *frame_count = total_frame_count;
+  }
+  return thread_count;
+}
+
+int backtracie_capture_all_threads(VALUE *threads_out, int *frames_len_out,
+                                   int max_threads, raw_location *frames_out,
+                                   int max_frames) {
+  BACKTRACIE_STATS_INC(captures_all_threads);
+  int thread_count = 0;
+  int frame_count = 0;
+  rb_thread_t *thread_pointer = NULL;
+  FOR_EACH_LIVING_THREAD(thread_pointer) {
+    if (thread_count == max_threads) {
+      break;
+    }
+    if (!backtracie_is_thread_alive(thread_pointer->self)) {
+      continue;
+    }
+
+    int frames_len = backtracie_capture_frames_for_execution_context(
+        thread_pointer_execution_context(thread_pointer), 0,
+        max_frames - frame_count, &frames_out[frame_count], NULL, NULL, NULL);
+
+    threads_out[thread_count] = thread_pointer->self;
+    frames_len_out[thread_count] = frames_len;
+    thread_count++;
+    frame_count += frames_len;
+  }
+  return thread_count;
+}
+
+bool backtracie_capture_caller_frame(int depth, raw_location *loc) {
+  BACKTRACIE_STATS_INC(captures_caller_frame);
+  if (depth < 0) {
+    return false;
+  }
+
+  return backtracie_capture_frames_for_execution_context(
+             thread_execution_context(rb_thread_current()), depth, 1, loc,
+             NULL, NULL, NULL) == 1;
+}
+
+bool backtracie_capture_caller_frame_and_ruby_frame(int depth,
+                                                    raw_location *loc,
+                                                    raw_location *ruby_loc,
+                                                    bool *found_ruby_loc) {
+  BACKTRACIE_STATS_INC(captures_caller_frame);
+  *found_ruby_loc = false;
+  if (depth < 0) {
+    return false;
+  }
+
+  if (backtracie_capture_frames_for_execution_context(
+          thread_execution_context(rb_thread_current()), depth, 1, loc, NULL,
+          ruby_loc, found_ruby_loc) == 0) {
+    return false;
+  }
+  if (loc->is_ruby_frame) {
+    *ruby_loc = *loc;
+    *found_ruby_loc = true;
+  }
+  return true;
 }
 
 int backtracie_frame_line_number(const raw_location *loc) {
-  return calc_lineno((rb_iseq_t *)loc->iseq, loc->pc);
+  return cached_calc_lineno((rb_iseq_t *)loc->iseq, loc->pc);
 }
 
 size_t backtracie_frame_name_cstr(const raw_location *loc, char *buf,
@@ -368,7 +796,7 @@ size_t backtracie_frame_name_cstr(const raw_location *loc, char *buf,
   strbuilder_init(&builder, buf, buflen);
 
   minimal_location_t min_loc;
-  raw_location_to_minimal_location(loc, &min_loc);
+  raw_location_to_minimal_location(loc, &min_loc, false);
   minimal_location_method_qualifier(&min_loc, &builder);
   minimal_location_method_name(&min_loc, &builder);
 
@@ -376,15 +804,24 @@ size_t backtracie_frame_name_cstr(const raw_location *loc, char *buf,
 }
 
 VALUE backtracie_frame_name_rbstr(const raw_location *loc) {
+  // Most names fit in here, so we can usually get away with not allocating
+  // anything (other than the resulting string, if it's not yet interned)
+  char buf[256];
+  size_t len = backtracie_frame_name_cstr(loc, buf, sizeof(buf));
+  if (len < sizeof(buf)) {
+    return backtracie_interned_str(buf, (long)len);
+  }
+
   strbuilder_t builder;
-  strbuilder_init_growable(&builder, 256);
+  strbuilder_init_growable(&builder, len + 1);
 
   minimal_location_t min_loc;
-  raw_location_to_minimal_location(loc, &min_loc);
+  raw_location_to_minimal_location(loc, &min_loc, false);
   minimal_location_method_qualifier(&min_loc, &builder);
   minimal_location_method_name(&min_loc, &builder);
 
-  VALUE ret = strbuilder_to_value(&builder);
+  VALUE ret = backtracie_interned_str(builder.original_buf,
+                                      (long)builder.attempted_size);
   strbuilder_free_growable(&builder);
   return ret;
 }
@@ -400,17 +837,17 @@ size_t backtracie_frame_filename_cstr(const raw_location *loc, bool absolute,
 }
 
 VALUE backtracie_frame_filename_rbstr(const raw_location *loc, bool absolute) {
-  strbuilder_t builder;
-  strbuilder_init_growable(&builder, 256);
+  VALUE path = iseq_path_value((const rb_iseq_t *)loc->iseq, absolute);
+  return RTEST(path) ? backtracie_interned_str_value(path) : Qnil;
+}
 
-  bool fname_found = frame_filename(loc, absolute, &builder);
+VALUE backtracie_frame_path_value(const raw_location *loc, bool absolute) {
+  return iseq_path_value((const rb_iseq_t *)loc->iseq, absolute);
+}
 
-  VALUE ret = Qnil;
-  if (fname_found) {
-    ret = strbuilder_to_value(&builder);
-  }
-  strbuilder_free_growable(&builder);
-  return ret;
+bool backtracie_frame_is_block(const raw_location *loc) {
+  return loc->is_ruby_frame && RTEST(loc->iseq) &&
+         ((const rb_iseq_t *)loc->iseq)->body->type == ISEQ_TYPE_BLOCK;
 }
 
 static bool frame_filename(const raw_location *loc, bool absolute,
@@ -429,17 +866,8 @@ size_t backtracie_frame_label_cstr(const raw_location *loc, bool base,
 }
 
 VALUE backtracie_frame_label_rbstr(const raw_location *loc, bool base) {
-  strbuilder_t builder;
-  strbuilder_init_growable(&builder, 256);
-
-  int label_found = frame_label(loc, base, &builder);
-
-  VALUE ret = Qnil;
-  if (label_found) {
-    ret = strbuilder_to_value(&builder);
-  }
-  strbuilder_free_growable(&builder);
-  return ret;
+  VALUE label = frame_label_value(loc, base);
+  return RTEST(label) ? backtracie_interned_str_value(label) : Qnil;
 }
 
 VALUE backtracie_frame_for_rb_profile(const raw_location *loc) {
@@ -471,28 +899,39 @@ VALUE backtracie_frame_for_rb_profile(const raw_location *loc) {
 
 static int frame_label(const raw_location *loc, bool base,
                        strbuilder_t *strout) {
+  VALUE label = frame_label_value(loc, base);
+  if (!RTEST(label)) {
+    return 0;
+  }
+  strbuilder_append_value(strout, label);
+  return 1;
+}
+
+// Returns the label string straight from the iseq (or method entry), or Qnil
+static VALUE frame_label_value(const raw_location *loc, bool base) {
   if (loc->is_ruby_frame) {
     // Replicate what rb_profile_frames would do
     if (!RTEST(loc->iseq)) {
-      return 0;
+      return Qnil;
     }
     rb_iseq_t *iseq = (rb_iseq_t *)loc->iseq;
-    VALUE label =
-        base ? iseq->body->location.base_label : iseq->body->location.label;
-    strbuilder_append_value(strout, label);
+    return base ? iseq->body->location.base_label
+                : iseq->body->location.label;
   } else {
     if (!RTEST(loc->callable_method_entry)) {
-      return 0;
+      return Qnil;
     }
     rb_callable_method_entry_t *cme =
         (rb_callable_method_entry_t *)loc->callable_method_entry;
-    strbuilder_append_value(strout, rb_id2str(cme->def->original_id));
+    return rb_id2str(cme->def->original_id);
   }
-  return 1;
 }
 
+// The line number is only needed by some callers (and isn't the cheapest thing
+// to get), so it's only filled in if with_line_number is true
 static void raw_location_to_minimal_location(const raw_location *raw_loc,
-                                             minimal_location_t *min_loc) {
+                                             minimal_location_t *min_loc,
+                                             bool with_line_number) {
 
   min_loc->is_ruby_frame = raw_loc->is_ruby_frame;
   if (RTEST(raw_loc->callable_method_entry)) {
@@ -509,10 +948,20 @@ static void raw_location_to_minimal_location(const raw_location *raw_loc,
     min_loc->method_name.base_label = Qnil;
   }
 
+  // Prefer the absolute path, but e.g. evals may only have a relative path
+  min_loc->filename = iseq_path_value((const rb_iseq_t *)raw_loc->iseq, true);
+  if (!RTEST(min_loc->filename)) {
+    min_loc->filename =
+        iseq_path_value((const rb_iseq_t *)raw_loc->iseq, false);
+  }
+
   if (RTEST(raw_loc->iseq)) {
     min_loc->has_iseq_type = 1;
     min_loc->iseq_type = ((rb_iseq_t *)raw_loc->iseq)->body->type;
-    min_loc->line_number = calc_lineno((rb_iseq_t *)raw_loc->iseq, raw_loc->pc);
+    min_loc->line_number =
+        with_line_number
+            ? cached_calc_lineno((rb_iseq_t *)raw_loc->iseq, raw_loc->pc)
+            : 0;
   } else {
     min_loc->has_iseq_type = 0;
     min_loc->line_number = 0;
@@ -535,7 +984,8 @@ static void raw_location_to_minimal_location(const raw_location *raw_loc,
   }
 }
 
-static void mod_to_s_anon(VALUE klass, strbuilder_t *strout) {
+static void mod_to_s_anon(VALUE klass, strbuilder_t *strout,
+                          backtracie_class_name_dependencies_t *deps) {
   // Anonymous module/class - print the name of the first non-anonymous super.
   // something like "#{klazz.ancestors.map(&:name).compact.first}$anonymous"
   //
@@ -562,12 +1012,13 @@ static void mod_to_s_anon(VALUE klass, strbuilder_t *strout) {
   do {
     superclass = rb_class_superclass(superclass);
     BACKTRACIE_ASSERT(RTEST(superclass));
-    superclass_name = rb_mod_name(superclass);
+    superclass_name = backtracie_class_name_cache_mod_name(superclass, deps);
   } while (!RTEST(superclass_name));
   strbuilder_append_value(strout, superclass_name);
 }
 
-static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout) {
+static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout,
+                               backtracie_class_name_dependencies_t *deps) {
   VALUE singleton_of = rb_class_real(klass);
   // If this is the singleton_class of a Class, or Module, we want to print
   // the _value_ of the object, and _NOT_ its class.
@@ -584,10 +1035,11 @@ static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout) {
     // singleton_class _of_.
     singleton_of = rb_ivar_get(klass, id__attached__);
   }
-  mod_to_s(singleton_of, strout);
+  mod_to_s(singleton_of, strout, deps);
 }
 
-static void mod_to_s_refinement(VALUE refinement_module, strbuilder_t *strout) {
+static void mod_to_s_refinement(VALUE refinement_module, strbuilder_t *strout,
+                                backtracie_class_name_dependencies_t *deps) {
   ID id_refined_class;
   CONST_ID(id_refined_class, "__refined_class__");
   VALUE refined_class = rb_attr_get(refinement_module, id_refined_class);
@@ -595,28 +1047,29 @@ static void mod_to_s_refinement(VALUE refinement_module, strbuilder_t *strout) {
   CONST_ID(id_defined_at, "__defined_at__");
   VALUE defined_at = rb_attr_get(refinement_module, id_defined_at);
 
-  mod_to_s(refined_class, strout);
+  mod_to_s(refined_class, strout, deps);
   strbuilder_append(strout, "$refinement@");
-  mod_to_s(defined_at, strout);
+  mod_to_s(defined_at, strout, deps);
 }
 
-static void mod_to_s(VALUE klass, strbuilder_t *strout) {
+static void mod_to_s(VALUE klass, strbuilder_t *strout,
+                     backtracie_class_name_dependencies_t *deps) {
   if (FL_TEST(klass, FL_SINGLETON)) {
-    mod_to_s_singleton(klass, strout);
+    mod_to_s_singleton(klass, strout, deps);
     strbuilder_append(strout, "$singleton");
     return;
   }
 
-  VALUE klass_name = rb_mod_name(klass);
-  if (!RTEST(rb_mod_name(klass))) {
+  VALUE klass_name = backtracie_class_name_cache_mod_name(klass, deps);
+  if (!RTEST(klass_name)) {
     // If I understood it correctly, a T_ICLASS represents the inclusion of a module into
     // a class. In this situation, we usually want to use the module name instead.
     if (RB_TYPE_P(klass, T_ICLASS)) {
       VALUE included_module = RBASIC(klass)->klass;
-      mod_to_s(included_module, strout);
+      mod_to_s(included_module, strout, deps);
       return;
     } else {
-      mod_to_s_anon(klass, strout);
+      mod_to_s_anon(klass, strout, deps);
       strbuilder_append(strout, "$anonymous");
       return;
     }
@@ -627,6 +1080,38 @@ static void mod_to_s(VALUE klass, strbuilder_t *strout) {
   strbuilder_append_value(strout, klass_name);
 }
 
+// Same as mod_to_s (or mod_to_s_refinement), but goes through the class name
+// cache, as the same few classes are usually named over and over again
+static void cached_mod_to_s(VALUE klass, bool refinement,
+                            strbuilder_t *strout) {
+  const char *cached_name =
+      backtracie_class_name_cache_lookup(klass, refinement);
+  if (cached_name != NULL) {
+    strbuilder_append(strout, cached_name);
+    return;
+  }
+
+  // Growable builders may move their buffer, so keep an offset, not a pointer
+  size_t start_offset = strout->curr_ptr - strout->original_buf;
+  size_t start_attempted_size = strout->attempted_size;
+  backtracie_class_name_dependencies_t deps = {.len = 0};
+  if (refinement) {
+    mod_to_s_refinement(klass, strout, &deps);
+  } else {
+    mod_to_s(klass, strout, &deps);
+  }
+
+  size_t name_len = strout->attempted_size - start_attempted_size;
+  bool was_truncated =
+      (size_t)(strout->curr_ptr - strout->original_buf) - start_offset !=
+      name_len;
+  if (!was_truncated) {
+    backtracie_class_name_cache_insert(klass, refinement, &deps,
+                                       strout->original_buf + start_offset,
+                                       name_len);
+  }
+}
+
 static void minimal_location_method_qualifier(const minimal_location_t *loc,
                                               strbuilder_t *strout) {
   // First, check if it's a special object.
@@ -650,7 +1135,7 @@ static void minimal_location_method_qualifier(const minimal_location_t *loc,
     if (RTEST(class_of_defined_class) &&
         FL_TEST(class_of_defined_class, RMODULE_IS_REFINEMENT)) {
       // The method being called is defined on a refinement.
-      mod_to_s_refinement(class_of_defined_class, strout);
+      cached_mod_to_s(class_of_defined_class, true, strout);
       strbuilder_append(strout, "#");
       return;
     }
@@ -662,7 +1147,7 @@ static void minimal_location_method_qualifier(const minimal_location_t *loc,
     if (class_or_module_or_iclass(loc->method_qualifier.self)) {
       // We have something like SomeModule.foo being called directly like that,
       // without an instance.
-      mod_to_s(loc->method_qualifier.self, strout);
+      cached_mod_to_s(loc->method_qualifier.self, false, strout);
       strbuilder_append(strout, ".");
       return;
     }
@@ -686,7 +1171,7 @@ static void minimal_location_method_qualifier(const minimal_location_t *loc,
     return;
   }
 
-  mod_to_s(method_target, strout);
+  cached_mod_to_s(method_target, false, strout);
   strbuilder_append(strout, "#");
 }
 
@@ -735,9 +1220,20 @@ static void minimal_location_method_name(const minimal_location_t *loc,
 // returns true if a path was found, and false otherwise
 static bool iseq_path(const rb_iseq_t *iseq, bool absolute,
                       strbuilder_t *strout) {
-  if (!iseq) {
+  VALUE path_str = iseq_path_value(iseq, absolute);
+  if (RTEST(path_str)) {
+    strbuilder_append_value(strout, path_str);
+    return 1;
+  } else {
     return 0;
   }
+}
+
+// Returns the path string straight from the iseq, or Qnil if there's none
+static VALUE iseq_path_value(const rb_iseq_t *iseq, bool absolute) {
+  if (!iseq) {
+    return Qnil;
+  }
 
   VALUE path_str;
 #ifdef PRE_LOCATION_PATHOBJ
@@ -754,12 +1250,7 @@ static bool iseq_path(const rb_iseq_t *iseq, bool absolute,
   }
 #endif
 
-  if (RTEST(path_str)) {
-    strbuilder_append_value(strout, path_str);
-    return 1;
-  } else {
-    return 0;
-  }
+  return path_str;
 }
 
 /**********************************************************************
@@ -795,6 +1286,17 @@ static int calc_lineno(const rb_iseq_t *iseq, const void *pc) {
   }
 }
 
+// Same as calc_lineno, but goes through the line number cache
+static int cached_calc_lineno(const rb_iseq_t *iseq, const void *pc) {
+  int line_number;
+  if (backtracie_line_number_cache_lookup((VALUE)iseq, pc, &line_number)) {
+    return line_number;
+  }
+  line_number = calc_lineno(iseq, pc);
+  backtracie_line_number_cache_insert((VALUE)iseq, pc, line_number);
+  return line_number;
+}
+
 // ----------------------------------------------------------------------
 
 /**********************************************************************
@@ -869,6 +1371,7 @@ VALUE backtracie_frame_wrapper_new(size_t count) {
                             &backtracie_frame_wrapper_type, frame_data);
   frame_data->capa = count;
   frame_data->len = 0;
+  frame_data->lookahead_len = 0;
   frame_data->frames = xcalloc(count, sizeof(raw_location));
   return wrapper;
 }
@@ -885,22 +1388,65 @@ int *backtracie_frame_wrapper_len(VALUE wrapper) {
                        frame_data);
   return &frame_data->len;
 }
+int *backtracie_frame_wrapper_lookahead_len(VALUE wrapper) {
+  frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, frame_wrapper_t, &backtracie_frame_wrapper_type,
+                       frame_data);
+  return &frame_data->lookahead_len;
+}
+size_t backtracie_frame_wrapper_capa(VALUE wrapper) {
+  frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, frame_wrapper_t, &backtracie_frame_wrapper_type,
+                       frame_data);
+  return frame_data->capa;
+}
+
+void backtracie_frame_wrapper_reserve(VALUE wrapper, size_t capa) {
+  frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, frame_wrapper_t, &backtracie_frame_wrapper_type,
+                       frame_data);
+  if (capa <= frame_data->capa) {
+    return;
+  }
+  size_t new_capa = frame_data->capa * 2;
+  if (new_capa < capa) {
+    new_capa = capa;
+  }
+
+  // Allocating may trigger the GC, which still gets to mark the current frames
+  // as we only swap the arrays afterwards
+  raw_location *frames = xcalloc(new_capa, sizeof(raw_location));
+  memcpy(frames, frame_data->frames,
+         sizeof(raw_location) * (frame_data->len + frame_data->lookahead_len));
+  xfree(frame_data->frames);
+  frame_data->frames = frames;
+  frame_data->capa = new_capa;
+}
+
+void backtracie_frame_wrapper_clear(VALUE wrapper) {
+  frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, frame_wrapper_t, &backtracie_frame_wrapper_type,
+                       frame_data);
+  frame_data->len = 0;
+  frame_data->lookahead_len = 0;
+}
 
 static void backtracie_frame_wrapper_mark(void *ptr) {
   frame_wrapper_t *frame_data = (frame_wrapper_t *)ptr;
-  for (int i = 0; i < frame_data->len; i++) {
+  for (int i = 0; i < frame_data->len + frame_data->lookahead_len; i++) {
     backtracie_frame_mark_movable(&frame_data->frames[i]);
   }
 }
 static void backtracie_frame_wrapper_compact(void *ptr) {
   frame_wrapper_t *frame_data = (frame_wrapper_t *)ptr;
-  for (int i = 0; i < frame_data->len; i++) {
+  for (int i = 0; i < frame_data->len + frame_data->lookahead_len; i++) {
     backtracie_frame_compact(&frame_data->frames[i]);
   }
 }
 static void backtracie_frame_wrapper_free(void *ptr) {
   frame_wrapper_t *frame_data = (frame_wrapper_t *)ptr;
   xfree(frame_data->frames);
+  xfree(frame_data);
 }
 static size_t backtracie_frame_wrapper_memsize(const void *ptr) {
   const frame_wrapper_t *frame_data = (const frame_wrapper_t *)ptr;
@@ -914,7 +1460,7 @@ bool backtracie_capture_minimal_frame_for_thread(VALUE thread, int frame_index,
   if (!ret) {
     return ret;
   }
-  raw_location_to_minimal_location(&raw_loc, loc);
+  raw_location_to_minimal_location(&raw_loc, loc, true);
 
   return ret;
 }
@@ -939,3 +1485,87 @@ size_t backtracie_minimal_frame_filename_cstr(const minimal_location_t *loc,
   }
   return builder.attempted_size;
 }
+
+void backtracie_minimal_frame_mark(const minimal_location_t *loc) {
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    rb_gc_mark(loc->method_name.base_label);
+  }
+  rb_gc_mark(loc->filename);
+  // All method_qualifier variants are VALUEs, so it doesn't matter which one
+  // we pick
+  rb_gc_mark(loc->method_qualifier.self);
+}
+
+void backtracie_minimal_frame_mark_movable(const minimal_location_t *loc) {
+#ifdef PRE_GC_MARK_MOVABLE
+  backtracie_minimal_frame_mark(loc);
+#else
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    rb_gc_mark_movable(loc->method_name.base_label);
+  }
+  rb_gc_mark_movable(loc->filename);
+  rb_gc_mark_movable(loc->method_qualifier.self);
+#endif
+}
+
+void backtracie_minimal_frame_compact(minimal_location_t *loc) {
+#ifndef PRE_GC_MARK_MOVABLE
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    loc->method_name.base_label = rb_gc_location(loc->method_name.base_label);
+  }
+  loc->filename = rb_gc_location(loc->filename);
+  loc->method_qualifier.self = rb_gc_location(loc->method_qualifier.self);
+#endif
+}
+
+VALUE backtracie_minimal_frame_wrapper_new(size_t capa) {
+  minimal_frame_wrapper_t *frame_data;
+  VALUE wrapper = TypedData_Make_Struct(
+      backtracie_minimal_frame_wrapper_class, minimal_frame_wrapper_t,
+      &minimal_frame_wrapper_type, frame_data);
+  frame_data->capa = capa;
+  frame_data->len = 0;
+  frame_data->frames = xcalloc(capa, sizeof(minimal_location_t));
+  return wrapper;
+}
+
+minimal_location_t *backtracie_minimal_frame_wrapper_frames(VALUE wrapper) {
+  minimal_frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, minimal_frame_wrapper_t,
+                       &minimal_frame_wrapper_type, frame_data);
+  return frame_data->frames;
+}
+
+int *backtracie_minimal_frame_wrapper_len(VALUE wrapper) {
+  minimal_frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, minimal_frame_wrapper_t,
+                       &minimal_frame_wrapper_type, frame_data);
+  return &frame_data->len;
+}
+
+static void minimal_frame_wrapper_mark(void *ptr) {
+  minimal_frame_wrapper_t *frame_data = (minimal_frame_wrapper_t *)ptr;
+  for (int i = 0; i < frame_data->len; i++) {
+    backtracie_minimal_frame_mark_movable(&frame_data->frames[i]);
+  }
+}
+
+static void minimal_frame_wrapper_compact(void *ptr) {
+  minimal_frame_wrapper_t *frame_data = (minimal_frame_wrapper_t *)ptr;
+  for (int i = 0; i < frame_data->len; i++) {
+    backtracie_minimal_frame_compact(&frame_data->frames[i]);
+  }
+}
+
+static void minimal_frame_wrapper_free(void *ptr) {
+  minimal_frame_wrapper_t *frame_data = (minimal_frame_wrapper_t *)ptr;
+  xfree(frame_data->frames);
+  xfree(frame_data);
+}
+
+static size_t minimal_frame_wrapper_memsize(const void *ptr) {
+  const minimal_frame_wrapper_t *frame_data =
+      (const minimal_frame_wrapper_t *)ptr;
+  return sizeof(minimal_frame_wrapper_t) +
+         sizeof(minimal_location_t) * frame_data->capa;
+}
@@ -0,0 +1,92 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <stdint.h>
+
+#include "backtracie_private.h"
+
+// The GC epoch allows caches to reference objects without marking them (and
+// thus without changing how long they live for): entries are only used if the
+// epoch didn't change since they were inserted.
+//
+// Objects only get freed by the sweep that follows marking, and only get moved
+// when the GC compacts the heap. Old objects (those that survived a few GCs)
+// don't get swept by minor GCs though, and minor GCs happen all the time in
+// allocation-heavy code, so caches only reference old objects (see
+// backtracie_gc_epoch_can_reference), and the epoch only gets incremented when
+// marking finishes for a major GC, and whenever references get updated after
+// compacting. Any old object that was alive when an entry got inserted thus
+// stays alive (and in the same place) until the epoch changes.
+
+uint64_t backtracie_gc_epoch = 0;
+
+static VALUE gc_tracepoint = Qnil;
+static VALUE major_by_symbol = Qnil;
+// Never actually used; this only exists so we get called after compaction
+static VALUE compaction_listener = Qnil;
+static int compaction_listener_data = 0;
+
+static void on_gc_end_mark(VALUE tracepoint, void *unused);
+static void on_compact(void *ptr);
+static const rb_data_type_t compaction_listener_type = {
+    .wrap_struct_name = "backtracie_compaction_listener",
+    .function = {.dmark = NULL,
+                 .dfree = NULL,
+                 .dsize = NULL,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = on_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_gc_epoch(void) {
+  compaction_listener = TypedData_Wrap_Struct(0, &compaction_listener_type,
+                                              &compaction_listener_data);
+  rb_global_variable(&compaction_listener);
+
+  major_by_symbol = ID2SYM(rb_intern("major_by"));
+  // The first call sets up some symbols, which we must not do from within the
+  // GC, so get that out of the way now
+  rb_gc_latest_gc_info(major_by_symbol);
+
+  gc_tracepoint = rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_GC_END_MARK,
+                                    on_gc_end_mark, NULL);
+  rb_global_variable(&gc_tracepoint);
+  rb_tracepoint_enable(gc_tracepoint);
+}
+
+// Until Ruby 3.3, the two FL_PROMOTED bits hold the age of an object, which is
+// only old once both are set (RB_OBJ_PROMOTED checks for any of them on Ruby
+// 3.0 to 3.2, so it can't be used)
+bool backtracie_gc_epoch_can_reference(VALUE object) {
+  return RB_SPECIAL_CONST_P(object) ||
+         RB_FL_ALL_RAW(object, RUBY_FL_PROMOTED);
+}
+
+static void on_gc_end_mark(VALUE tracepoint, void *unused) {
+  // major_by is nil for minor GCs
+  if (rb_gc_latest_gc_info(major_by_symbol) != Qnil) {
+    backtracie_gc_epoch++;
+  }
+}
+
+static void on_compact(void *ptr) { backtracie_gc_epoch++; }
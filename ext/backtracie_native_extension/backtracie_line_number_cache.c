@@ -0,0 +1,108 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backtracie_private.h"
+
+// The line number cache maps (iseq, pc) pairs to their line number, so that we
+// don't need to binary search the iseq's instruction info every time we look at
+// a frame. Sampling in particular keeps on hitting the same few pairs.
+//
+// Like the class name cache, this is a fixed-size, direct-mapped table that
+// never allocates after being created. Entries don't keep their iseq alive;
+// instead, they're only used during the GC epoch they were inserted in (see
+// backtracie_gc_epoch.c), so the pc can't have been reused by another iseq.
+// Only old iseqs get cached, which is what hot code usually runs anyway.
+//
+// Hits and misses get counted as part of Backtracie.stats, so when those are
+// disabled, Backtracie.line_number_cache_stats says so (and reports zeros).
+
+#define LINE_NUMBER_CACHE_SIZE 4096 // Must be a power of two
+
+typedef struct {
+  VALUE iseq; // 0 for an empty entry
+  const void *pc;
+  uint64_t gc_epoch;
+  int line_number;
+} line_number_cache_entry_t;
+
+static line_number_cache_entry_t *cache_entries = NULL;
+
+static line_number_cache_entry_t *entry_for(const void *pc);
+static VALUE line_number_cache_stats(VALUE self);
+
+void backtracie_init_line_number_cache(VALUE backtracie_module) {
+  cache_entries = ZALLOC_N(line_number_cache_entry_t, LINE_NUMBER_CACHE_SIZE);
+
+  rb_define_module_function(backtracie_module, "line_number_cache_stats",
+                            line_number_cache_stats, 0);
+}
+
+bool backtracie_line_number_cache_lookup(VALUE iseq, const void *pc,
+                                         int *line_number) {
+  line_number_cache_entry_t *entry = entry_for(pc);
+  if (entry->iseq != iseq || entry->pc != pc ||
+      entry->gc_epoch != backtracie_gc_epoch) {
+    BACKTRACIE_STATS_INC(line_number_cache_misses);
+    return false;
+  }
+  BACKTRACIE_STATS_INC(line_number_cache_hits);
+  *line_number = entry->line_number;
+  return true;
+}
+
+void backtracie_line_number_cache_insert(VALUE iseq, const void *pc,
+                                         int line_number) {
+  if (!backtracie_gc_epoch_can_reference(iseq)) {
+    return;
+  }
+  line_number_cache_entry_t *entry = entry_for(pc);
+  entry->iseq = iseq;
+  entry->pc = pc;
+  entry->gc_epoch = backtracie_gc_epoch;
+  entry->line_number = line_number;
+}
+
+static line_number_cache_entry_t *entry_for(const void *pc) {
+  uint64_t hash = backtracie_hash_mix(0, (uint64_t)(uintptr_t)pc);
+  return &cache_entries[hash & (LINE_NUMBER_CACHE_SIZE - 1)];
+}
+
+// Backtracie.line_number_cache_stats =>
+//   {enabled:, hits:, misses:, hit_rate:, capacity:}
+static VALUE line_number_cache_stats(VALUE self) {
+  backtracie_stats_t stats;
+  backtracie_stats_get(&stats);
+  uint64_t cache_hits = stats.line_number_cache_hits;
+  uint64_t cache_misses = stats.line_number_cache_misses;
+  uint64_t lookups = cache_hits + cache_misses;
+
+  VALUE result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("enabled")),
+               backtracie_stats_enabled() ? Qtrue : Qfalse);
+  rb_hash_aset(result, ID2SYM(rb_intern("hits")), ULL2NUM(cache_hits));
+  rb_hash_aset(result, ID2SYM(rb_intern("misses")), ULL2NUM(cache_misses));
+  rb_hash_aset(result, ID2SYM(rb_intern("hit_rate")),
+               DBL2NUM(lookups == 0 ? 0.0 : (double)cache_hits / lookups));
+  rb_hash_aset(result, ID2SYM(rb_intern("capacity")),
+               INT2NUM(LINE_NUMBER_CACHE_SIZE));
+  return result;
+}
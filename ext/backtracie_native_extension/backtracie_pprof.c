@@ -0,0 +1,741 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// Builds pprof profiles (profile.proto, see
+// https://github.com/google/pprof/blob/main/proto/profile.proto) from stacks
+// of frames, without creating any Ruby objects other than the resulting
+// string.
+//
+// Strings, functions (name + filename), locations (function + line) and
+// samples (list of locations) are all deduplicated as they get added, using
+// the same kind of open addressing hash tables as the frame table: each table
+// stores id + 1 for each entry, or 0 for an empty slot. Entries keep their
+// hash, so tables can be grown without recomputing them.
+//
+// The protobuf encoding is hand-written, as we only ever need to write a
+// handful of message types.
+
+typedef struct {
+  uint32_t *slots;
+  // Always a power of two, and always more than twice the number of entries
+  uint32_t capa;
+} pprof_index_t;
+
+typedef struct {
+  size_t offset; // into string_data
+  uint32_t len;
+  uint64_t hash;
+} pprof_string_t;
+
+typedef struct {
+  uint32_t name;     // string index
+  uint32_t filename; // string index
+  uint64_t hash;
+} pprof_function_t;
+
+typedef struct {
+  uint32_t function_id; // function index + 1
+  int64_t line;
+  uint64_t hash;
+} pprof_location_t;
+
+typedef struct {
+  size_t offset; // into sample_location_ids
+  uint32_t len;
+  int64_t value;
+  uint64_t hash;
+} pprof_sample_t;
+
+typedef struct {
+  char *string_data;
+  size_t string_data_len;
+  size_t string_data_capa;
+  pprof_string_t *strings;
+  uint32_t strings_len;
+  uint32_t strings_capa;
+  pprof_index_t strings_index;
+
+  pprof_function_t *functions;
+  uint32_t functions_len;
+  uint32_t functions_capa;
+  pprof_index_t functions_index;
+
+  pprof_location_t *locations;
+  uint32_t locations_len;
+  uint32_t locations_capa;
+  pprof_index_t locations_index;
+
+  pprof_sample_t *samples;
+  uint32_t samples_len;
+  uint32_t samples_capa;
+  pprof_index_t samples_index;
+  uint64_t *sample_location_ids;
+  size_t sample_location_ids_len;
+  size_t sample_location_ids_capa;
+
+  // Used by the add_*_sample functions to hold the location ids of a sample
+  uint64_t *scratch_location_ids;
+  int scratch_location_ids_capa;
+
+  uint32_t sample_type;
+  uint32_t sample_unit;
+  bool has_period;
+  uint32_t period_type;
+  uint32_t period_unit;
+  int64_t period;
+} pprof_t;
+
+typedef struct {
+  uint8_t *ptr;
+  size_t len;
+  size_t capa;
+} pb_buffer_t;
+
+#define PPROF_INITIAL_CAPA 64
+
+// Protobuf wire types
+#define PB_VARINT 0
+#define PB_LEN 2
+
+// Field numbers, from profile.proto
+#define PROFILE_SAMPLE_TYPE 1
+#define PROFILE_SAMPLE 2
+#define PROFILE_LOCATION 4
+#define PROFILE_FUNCTION 5
+#define PROFILE_STRING_TABLE 6
+#define PROFILE_PERIOD_TYPE 11
+#define PROFILE_PERIOD 12
+#define VALUE_TYPE_TYPE 1
+#define VALUE_TYPE_UNIT 2
+#define SAMPLE_LOCATION_ID 1
+#define SAMPLE_VALUE 2
+#define LOCATION_ID 1
+#define LOCATION_LINE 4
+#define LINE_FUNCTION_ID 1
+#define LINE_LINE 2
+#define FUNCTION_ID 1
+#define FUNCTION_NAME 2
+#define FUNCTION_SYSTEM_NAME 3
+#define FUNCTION_FILENAME 4
+
+static pprof_t *get_pprof(VALUE pprof);
+static void grow(void **ptr, size_t *capa, size_t needed, size_t element_size);
+static void index_init(pprof_index_t *index);
+static void index_reserve(pprof_index_t *index, uint32_t entries_len,
+                          const pprof_t *pprof,
+                          uint64_t (*hash_at)(const pprof_t *, uint32_t));
+static uint32_t *index_slot(const pprof_index_t *index, uint64_t hash,
+                            const pprof_t *pprof,
+                            bool (*matches)(const pprof_t *, uint32_t,
+                                            const void *),
+                            const void *key);
+static uint32_t intern_string(pprof_t *pprof, const char *str, size_t len);
+static uint32_t intern_cstr(pprof_t *pprof, const char *str);
+static uint32_t intern_value(pprof_t *pprof, VALUE str);
+static uint64_t intern_location(pprof_t *pprof, uint32_t name,
+                                uint32_t filename, int64_t line);
+static uint64_t string_hash_at(const pprof_t *pprof, uint32_t id);
+static bool string_matches(const pprof_t *pprof, uint32_t id, const void *key);
+static uint64_t function_hash_at(const pprof_t *pprof, uint32_t id);
+static bool function_matches(const pprof_t *pprof, uint32_t id,
+                             const void *key);
+static uint64_t location_hash_at(const pprof_t *pprof, uint32_t id);
+static bool location_matches(const pprof_t *pprof, uint32_t id,
+                             const void *key);
+static uint64_t sample_hash_at(const pprof_t *pprof, uint32_t id);
+static bool sample_matches(const pprof_t *pprof, uint32_t id, const void *key);
+static uint64_t *scratch_location_ids(pprof_t *pprof, int len);
+static uint64_t bytes_hash(const char *str, size_t len);
+
+static void pb_reserve(pb_buffer_t *buf, size_t count);
+static void pb_varint(pb_buffer_t *buf, uint64_t value);
+static size_t pb_varint_size(uint64_t value);
+static void pb_tag(pb_buffer_t *buf, uint32_t field, uint32_t wire_type);
+static void pb_uint64_field(pb_buffer_t *buf, uint32_t field, uint64_t value);
+static void pb_bytes_field(pb_buffer_t *buf, uint32_t field, const void *ptr,
+                           size_t len);
+static void pb_message_field(pb_buffer_t *buf, uint32_t field,
+                             const pb_buffer_t *message);
+static void pb_value_type_field(pb_buffer_t *buf, pb_buffer_t *scratch,
+                                uint32_t field, uint32_t type, uint32_t unit);
+
+static void pprof_free(void *ptr);
+static size_t pprof_memsize(const void *ptr);
+static const rb_data_type_t pprof_type = {
+    .wrap_struct_name = "backtracie_pprof",
+    .function = {.dmark = NULL,
+                 .dfree = pprof_free,
+                 .dsize = pprof_memsize,
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+VALUE backtracie_pprof_new(const char *sample_type, const char *sample_unit) {
+  pprof_t *pprof;
+  // Not visible from Ruby, so there's no class
+  VALUE wrapper = TypedData_Make_Struct(0, pprof_t, &pprof_type, pprof);
+  index_init(&pprof->strings_index);
+  index_init(&pprof->functions_index);
+  index_init(&pprof->locations_index);
+  index_init(&pprof->samples_index);
+
+  // The first entry in the string table must always be the empty string
+  intern_string(pprof, "", 0);
+  pprof->sample_type = intern_cstr(pprof, sample_type);
+  pprof->sample_unit = intern_cstr(pprof, sample_unit);
+  return wrapper;
+}
+
+void backtracie_pprof_set_period(VALUE pprof, const char *period_type,
+                                 const char *period_unit, int64_t period) {
+  pprof_t *pprof_data = get_pprof(pprof);
+  pprof_data->has_period = true;
+  pprof_data->period_type = intern_cstr(pprof_data, period_type);
+  pprof_data->period_unit = intern_cstr(pprof_data, period_unit);
+  pprof_data->period = period;
+}
+
+uint64_t backtracie_pprof_raw_location_id(VALUE pprof,
+                                          const raw_location *loc) {
+  pprof_t *pprof_data = get_pprof(pprof);
+
+  char name_buf[512];
+  size_t name_len =
+      backtracie_frame_name_cstr(loc, name_buf, sizeof(name_buf));
+  uint32_t name;
+  if (name_len < sizeof(name_buf)) {
+    name = intern_string(pprof_data, name_buf, name_len);
+  } else {
+    name = intern_value(pprof_data, backtracie_frame_name_rbstr(loc));
+  }
+
+  VALUE filename = backtracie_frame_filename_rbstr(loc, true);
+  if (!RTEST(filename)) {
+    filename = backtracie_frame_filename_rbstr(loc, false);
+  }
+
+  return intern_location(
+      pprof_data, name,
+      RTEST(filename) ? intern_value(pprof_data, filename) : 0,
+      loc->is_ruby_frame ? backtracie_frame_line_number(loc) : 0);
+}
+
+uint64_t backtracie_pprof_minimal_location_id(VALUE pprof,
+                                              const minimal_location_t *loc) {
+  pprof_t *pprof_data = get_pprof(pprof);
+
+  char name_buf[512];
+  size_t name_len =
+      backtracie_minimal_frame_name_cstr(loc, name_buf, sizeof(name_buf));
+  uint32_t name;
+  if (name_len < sizeof(name_buf)) {
+    name = intern_string(pprof_data, name_buf, name_len);
+  } else {
+    char *long_name_buf = ALLOC_N(char, name_len + 1);
+    backtracie_minimal_frame_name_cstr(loc, long_name_buf, name_len + 1);
+    name = intern_string(pprof_data, long_name_buf, name_len);
+    xfree(long_name_buf);
+  }
+
+  return intern_location(
+      pprof_data, name,
+      RTEST(loc->filename) ? intern_value(pprof_data, loc->filename) : 0,
+      loc->line_number);
+}
+
+void backtracie_pprof_add_sample(VALUE pprof, const uint64_t *location_ids,
+                                 int len, int64_t value) {
+  pprof_t *pprof_data = get_pprof(pprof);
+  if (len < 0) {
+    len = 0;
+  }
+  for (int i = 0; i < len; i++) {
+    if (location_ids[i] == 0 || location_ids[i] > pprof_data->locations_len) {
+      rb_raise(rb_eIndexError, "unknown pprof location id %llu",
+               (unsigned long long)location_ids[i]);
+    }
+  }
+
+  uint64_t hash = 0;
+  for (int i = 0; i < len; i++) {
+    hash = backtracie_hash_mix(hash, location_ids[i]);
+  }
+  hash = backtracie_hash_mix(hash, (uint64_t)len);
+
+  pprof_sample_t key = {.len = (uint32_t)len, .hash = hash};
+  // Hack-ish: for lookups, the key points straight at the caller's ids
+  const void *lookup[] = {&key, location_ids};
+  uint32_t *slot = index_slot(&pprof_data->samples_index, hash, pprof_data,
+                              sample_matches, lookup);
+  if (*slot != 0) {
+    pprof_data->samples[*slot - 1].value += value;
+    return;
+  }
+
+  size_t samples_capa = pprof_data->samples_capa;
+  grow((void **)&pprof_data->samples, &samples_capa,
+       pprof_data->samples_len + 1, sizeof(pprof_sample_t));
+  pprof_data->samples_capa = (uint32_t)samples_capa;
+  grow((void **)&pprof_data->sample_location_ids,
+       &pprof_data->sample_location_ids_capa,
+       pprof_data->sample_location_ids_len + len, sizeof(uint64_t));
+  index_reserve(&pprof_data->samples_index, pprof_data->samples_len + 1,
+                pprof_data, sample_hash_at);
+
+  uint32_t id = pprof_data->samples_len++;
+  pprof_sample_t *sample = &pprof_data->samples[id];
+  *sample = key;
+  sample->offset = pprof_data->sample_location_ids_len;
+  sample->value = value;
+  memcpy(&pprof_data->sample_location_ids[sample->offset], location_ids,
+         sizeof(uint64_t) * len);
+  pprof_data->sample_location_ids_len += len;
+
+  // The index may have been rebuilt, so look for the slot again
+  *index_slot(&pprof_data->samples_index, hash, pprof_data, sample_matches,
+              lookup) = id + 1;
+}
+
+void backtracie_pprof_add_raw_sample(VALUE pprof, const raw_location *frames,
+                                     int len, int64_t value) {
+  pprof_t *pprof_data = get_pprof(pprof);
+  uint64_t *location_ids = scratch_location_ids(pprof_data, len);
+  for (int i = 0; i < len; i++) {
+    location_ids[i] = backtracie_pprof_raw_location_id(pprof, &frames[i]);
+  }
+  backtracie_pprof_add_sample(pprof, location_ids, len, value);
+}
+
+void backtracie_pprof_add_minimal_sample(VALUE pprof,
+                                         const minimal_location_t *frames,
+                                         int len, int64_t value) {
+  pprof_t *pprof_data = get_pprof(pprof);
+  uint64_t *location_ids = scratch_location_ids(pprof_data, len);
+  for (int i = 0; i < len; i++) {
+    location_ids[i] = backtracie_pprof_minimal_location_id(pprof, &frames[i]);
+  }
+  backtracie_pprof_add_sample(pprof, location_ids, len, value);
+}
+
+VALUE backtracie_pprof_encode(VALUE pprof) {
+  pprof_t *pprof_data = get_pprof(pprof);
+
+  pb_buffer_t out = {0};
+  pb_buffer_t message = {0};
+  pb_buffer_t line = {0};
+
+  pb_value_type_field(&out, &message, PROFILE_SAMPLE_TYPE,
+                      pprof_data->sample_type, pprof_data->sample_unit);
+
+  for (uint32_t i = 0; i < pprof_data->samples_len; i++) {
+    const pprof_sample_t *sample = &pprof_data->samples[i];
+    const uint64_t *location_ids =
+        &pprof_data->sample_location_ids[sample->offset];
+
+    message.len = 0;
+    // Both repeated fields are packed
+    size_t location_ids_size = 0;
+    for (uint32_t j = 0; j < sample->len; j++) {
+      location_ids_size += pb_varint_size(location_ids[j]);
+    }
+    pb_tag(&message, SAMPLE_LOCATION_ID, PB_LEN);
+    pb_varint(&message, location_ids_size);
+    for (uint32_t j = 0; j < sample->len; j++) {
+      pb_varint(&message, location_ids[j]);
+    }
+    pb_tag(&message, SAMPLE_VALUE, PB_LEN);
+    pb_varint(&message, pb_varint_size((uint64_t)sample->value));
+    pb_varint(&message, (uint64_t)sample->value);
+
+    pb_message_field(&out, PROFILE_SAMPLE, &message);
+  }
+
+  for (uint32_t i = 0; i < pprof_data->locations_len; i++) {
+    const pprof_location_t *location = &pprof_data->locations[i];
+
+    line.len = 0;
+    pb_uint64_field(&line, LINE_FUNCTION_ID, location->function_id);
+    pb_uint64_field(&line, LINE_LINE, (uint64_t)location->line);
+
+    message.len = 0;
+    pb_uint64_field(&message, LOCATION_ID, i + 1);
+    pb_message_field(&message, LOCATION_LINE, &line);
+
+    pb_message_field(&out, PROFILE_LOCATION, &message);
+  }
+
+  for (uint32_t i = 0; i < pprof_data->functions_len; i++) {
+    const pprof_function_t *function = &pprof_data->functions[i];
+
+    message.len = 0;
+    pb_uint64_field(&message, FUNCTION_ID, i + 1);
+    pb_uint64_field(&message, FUNCTION_NAME, function->name);
+    pb_uint64_field(&message, FUNCTION_SYSTEM_NAME, function->name);
+    pb_uint64_field(&message, FUNCTION_FILENAME, function->filename);
+
+    pb_message_field(&out, PROFILE_FUNCTION, &message);
+  }
+
+  for (uint32_t i = 0; i < pprof_data->strings_len; i++) {
+    const pprof_string_t *string = &pprof_data->strings[i];
+    pb_bytes_field(&out, PROFILE_STRING_TABLE,
+                   &pprof_data->string_data[string->offset], string->len);
+  }
+
+  if (pprof_data->has_period) {
+    pb_value_type_field(&out, &message, PROFILE_PERIOD_TYPE,
+                        pprof_data->period_type, pprof_data->period_unit);
+    pb_uint64_field(&out, PROFILE_PERIOD, (uint64_t)pprof_data->period);
+  }
+
+  VALUE result = rb_str_new((const char *)out.ptr, out.len);
+
+  xfree(out.ptr);
+  xfree(message.ptr);
+  xfree(line.ptr);
+  return result;
+}
+
+static pprof_t *get_pprof(VALUE pprof) {
+  pprof_t *pprof_data;
+  TypedData_Get_Struct(pprof, pprof_t, &pprof_type, pprof_data);
+  return pprof_data;
+}
+
+// Makes sure *ptr has room for at least needed elements
+static void grow(void **ptr, size_t *capa, size_t needed,
+                 size_t element_size) {
+  if (needed <= *capa) {
+    return;
+  }
+  size_t new_capa = *capa == 0 ? PPROF_INITIAL_CAPA : *capa;
+  while (new_capa < needed) {
+    new_capa *= 2;
+  }
+  *ptr = ruby_xrealloc2(*ptr, new_capa, element_size);
+  *capa = new_capa;
+}
+
+static void index_init(pprof_index_t *index) {
+  index->capa = PPROF_INITIAL_CAPA * 2;
+  index->slots = ZALLOC_N(uint32_t, index->capa);
+}
+
+// Makes sure the index can take entries_len entries, rebuilding it (using
+// hash_at to get the hash of each existing entry) if it needs to grow
+static void index_reserve(pprof_index_t *index, uint32_t entries_len,
+                          const pprof_t *pprof,
+                          uint64_t (*hash_at)(const pprof_t *, uint32_t)) {
+  if (entries_len < index->capa / 2) {
+    return;
+  }
+  if (index->capa > UINT32_MAX / 4) {
+    rb_raise(rb_eRangeError, "backtracie pprof profile is too big");
+  }
+
+  uint32_t new_capa = index->capa * 2;
+  uint32_t *new_slots = ZALLOC_N(uint32_t, new_capa);
+  uint32_t mask = new_capa - 1;
+  for (uint32_t i = 0; i < index->capa; i++) {
+    uint32_t id_plus_one = index->slots[i];
+    if (id_plus_one == 0) {
+      continue;
+    }
+    uint32_t slot = (uint32_t)hash_at(pprof, id_plus_one - 1) & mask;
+    while (new_slots[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    new_slots[slot] = id_plus_one;
+  }
+  xfree(index->slots);
+  index->slots = new_slots;
+  index->capa = new_capa;
+}
+
+// Returns either the slot with the matching entry, or the empty slot where it
+// should be inserted
+static uint32_t *index_slot(const pprof_index_t *index, uint64_t hash,
+                            const pprof_t *pprof,
+                            bool (*matches)(const pprof_t *, uint32_t,
+                                            const void *),
+                            const void *key) {
+  uint32_t mask = index->capa - 1;
+  uint32_t slot = (uint32_t)hash & mask;
+  while (index->slots[slot] != 0 &&
+         !matches(pprof, index->slots[slot] - 1, key)) {
+    slot = (slot + 1) & mask;
+  }
+  return &index->slots[slot];
+}
+
+// Returns the index of the string in the string table
+static uint32_t intern_string(pprof_t *pprof, const char *str, size_t len) {
+  if (len > UINT32_MAX) {
+    rb_raise(rb_eRangeError, "string too long for backtracie pprof profile");
+  }
+  pprof_string_t key = {.len = (uint32_t)len, .hash = bytes_hash(str, len)};
+  const void *lookup[] = {&key, str};
+  uint32_t *slot = index_slot(&pprof->strings_index, key.hash, pprof,
+                              string_matches, lookup);
+  if (*slot != 0) {
+    return *slot - 1;
+  }
+
+  size_t strings_capa = pprof->strings_capa;
+  grow((void **)&pprof->strings, &strings_capa, pprof->strings_len + 1,
+       sizeof(pprof_string_t));
+  pprof->strings_capa = (uint32_t)strings_capa;
+  grow((void **)&pprof->string_data, &pprof->string_data_capa,
+       pprof->string_data_len + len, sizeof(char));
+  index_reserve(&pprof->strings_index, pprof->strings_len + 1, pprof,
+                string_hash_at);
+
+  uint32_t id = pprof->strings_len++;
+  pprof->strings[id] = key;
+  pprof->strings[id].offset = pprof->string_data_len;
+  memcpy(&pprof->string_data[pprof->string_data_len], str, len);
+  pprof->string_data_len += len;
+
+  *index_slot(&pprof->strings_index, key.hash, pprof, string_matches,
+              lookup) = id + 1;
+  return id;
+}
+
+static uint32_t intern_cstr(pprof_t *pprof, const char *str) {
+  return intern_string(pprof, str, strlen(str));
+}
+
+static uint32_t intern_value(pprof_t *pprof, VALUE str) {
+  uint32_t id = intern_string(pprof, RSTRING_PTR(str), RSTRING_LEN(str));
+  RB_GC_GUARD(str);
+  return id;
+}
+
+// Returns the id (index + 1) of the location for the given function and line
+static uint64_t intern_location(pprof_t *pprof, uint32_t name,
+                                uint32_t filename, int64_t line) {
+  pprof_function_t function = {.name = name, .filename = filename};
+  function.hash = backtracie_hash_mix(backtracie_hash_mix(0, name), filename);
+  uint32_t *function_slot = index_slot(&pprof->functions_index, function.hash,
+                                       pprof, function_matches, &function);
+  uint32_t function_id = *function_slot;
+  if (function_id == 0) {
+    size_t functions_capa = pprof->functions_capa;
+    grow((void **)&pprof->functions, &functions_capa, pprof->functions_len + 1,
+         sizeof(pprof_function_t));
+    pprof->functions_capa = (uint32_t)functions_capa;
+    index_reserve(&pprof->functions_index, pprof->functions_len + 1, pprof,
+                  function_hash_at);
+
+    pprof->functions[pprof->functions_len++] = function;
+    function_id = pprof->functions_len;
+    *index_slot(&pprof->functions_index, function.hash, pprof,
+                function_matches, &function) = function_id;
+  }
+
+  pprof_location_t location = {.function_id = function_id, .line = line};
+  location.hash =
+      backtracie_hash_mix(backtracie_hash_mix(0, function_id), (uint64_t)line);
+  uint32_t *location_slot = index_slot(&pprof->locations_index, location.hash,
+                                       pprof, location_matches, &location);
+  if (*location_slot != 0) {
+    return *location_slot;
+  }
+
+  size_t locations_capa = pprof->locations_capa;
+  grow((void **)&pprof->locations, &locations_capa, pprof->locations_len + 1,
+       sizeof(pprof_location_t));
+  pprof->locations_capa = (uint32_t)locations_capa;
+  index_reserve(&pprof->locations_index, pprof->locations_len + 1, pprof,
+                location_hash_at);
+
+  pprof->locations[pprof->locations_len++] = location;
+  *index_slot(&pprof->locations_index, location.hash, pprof, location_matches,
+              &location) = pprof->locations_len;
+  return pprof->locations_len;
+}
+
+static uint64_t string_hash_at(const pprof_t *pprof, uint32_t id) {
+  return pprof->strings[id].hash;
+}
+
+// key is {const pprof_string_t *, const char *contents}
+static bool string_matches(const pprof_t *pprof, uint32_t id,
+                           const void *key) {
+  const pprof_string_t *string = ((const pprof_string_t *const *)key)[0];
+  const char *contents = ((const char *const *)key)[1];
+  const pprof_string_t *entry = &pprof->strings[id];
+  return entry->hash == string->hash && entry->len == string->len &&
+         memcmp(&pprof->string_data[entry->offset], contents, entry->len) == 0;
+}
+
+static uint64_t function_hash_at(const pprof_t *pprof, uint32_t id) {
+  return pprof->functions[id].hash;
+}
+
+static bool function_matches(const pprof_t *pprof, uint32_t id,
+                             const void *key) {
+  const pprof_function_t *function = (const pprof_function_t *)key;
+  const pprof_function_t *entry = &pprof->functions[id];
+  return entry->name == function->name && entry->filename == function->filename;
+}
+
+static uint64_t location_hash_at(const pprof_t *pprof, uint32_t id) {
+  return pprof->locations[id].hash;
+}
+
+static bool location_matches(const pprof_t *pprof, uint32_t id,
+                             const void *key) {
+  const pprof_location_t *location = (const pprof_location_t *)key;
+  const pprof_location_t *entry = &pprof->locations[id];
+  return entry->function_id == location->function_id &&
+         entry->line == location->line;
+}
+
+static uint64_t sample_hash_at(const pprof_t *pprof, uint32_t id) {
+  return pprof->samples[id].hash;
+}
+
+// key is {const pprof_sample_t *, const uint64_t *location_ids}
+static bool sample_matches(const pprof_t *pprof, uint32_t id,
+                           const void *key) {
+  const pprof_sample_t *sample = ((const pprof_sample_t *const *)key)[0];
+  const uint64_t *location_ids = ((const uint64_t *const *)key)[1];
+  const pprof_sample_t *entry = &pprof->samples[id];
+  return entry->hash == sample->hash && entry->len == sample->len &&
+         memcmp(&pprof->sample_location_ids[entry->offset], location_ids,
+                sizeof(uint64_t) * entry->len) == 0;
+}
+
+static uint64_t *scratch_location_ids(pprof_t *pprof, int len) {
+  if (len > pprof->scratch_location_ids_capa) {
+    REALLOC_N(pprof->scratch_location_ids, uint64_t, len);
+    pprof->scratch_location_ids_capa = len;
+  }
+  return pprof->scratch_location_ids;
+}
+
+// FNV-1a, with the result then mixed like everything else
+static uint64_t bytes_hash(const char *str, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)str[i]) * 0x100000001b3ULL;
+  }
+  return backtracie_hash_mix(hash, len);
+}
+
+static void pb_reserve(pb_buffer_t *buf, size_t count) {
+  grow((void **)&buf->ptr, &buf->capa, buf->len + count, sizeof(uint8_t));
+}
+
+static void pb_varint(pb_buffer_t *buf, uint64_t value) {
+  pb_reserve(buf, 10);
+  while (value >= 0x80) {
+    buf->ptr[buf->len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  buf->ptr[buf->len++] = (uint8_t)value;
+}
+
+static size_t pb_varint_size(uint64_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+static void pb_tag(pb_buffer_t *buf, uint32_t field, uint32_t wire_type) {
+  pb_varint(buf, (uint64_t)field << 3 | wire_type);
+}
+
+// Zero is the default value, so like other protobuf encoders we skip it
+static void pb_uint64_field(pb_buffer_t *buf, uint32_t field, uint64_t value) {
+  if (value == 0) {
+    return;
+  }
+  pb_tag(buf, field, PB_VARINT);
+  pb_varint(buf, value);
+}
+
+static void pb_bytes_field(pb_buffer_t *buf, uint32_t field, const void *ptr,
+                           size_t len) {
+  pb_tag(buf, field, PB_LEN);
+  pb_varint(buf, len);
+  pb_reserve(buf, len);
+  if (len > 0) {
+    memcpy(&buf->ptr[buf->len], ptr, len);
+  }
+  buf->len += len;
+}
+
+static void pb_message_field(pb_buffer_t *buf, uint32_t field,
+                             const pb_buffer_t *message) {
+  pb_bytes_field(buf, field, message->ptr, message->len);
+}
+
+static void pb_value_type_field(pb_buffer_t *buf, pb_buffer_t *scratch,
+                                uint32_t field, uint32_t type, uint32_t unit) {
+  scratch->len = 0;
+  pb_uint64_field(scratch, VALUE_TYPE_TYPE, type);
+  pb_uint64_field(scratch, VALUE_TYPE_UNIT, unit);
+  pb_message_field(buf, field, scratch);
+}
+
+static void pprof_free(void *ptr) {
+  pprof_t *pprof = (pprof_t *)ptr;
+  xfree(pprof->string_data);
+  xfree(pprof->strings);
+  xfree(pprof->strings_index.slots);
+  xfree(pprof->functions);
+  xfree(pprof->functions_index.slots);
+  xfree(pprof->locations);
+  xfree(pprof->locations_index.slots);
+  xfree(pprof->samples);
+  xfree(pprof->samples_index.slots);
+  xfree(pprof->sample_location_ids);
+  xfree(pprof->scratch_location_ids);
+  xfree(pprof);
+}
+
+static size_t pprof_memsize(const void *ptr) {
+  const pprof_t *pprof = (const pprof_t *)ptr;
+  return sizeof(pprof_t) + pprof->string_data_capa +
+         sizeof(pprof_string_t) * pprof->strings_capa +
+         sizeof(pprof_function_t) * pprof->functions_capa +
+         sizeof(pprof_location_t) * pprof->locations_capa +
+         sizeof(pprof_sample_t) * pprof->samples_capa +
+         sizeof(uint64_t) * pprof->sample_location_ids_capa +
+         sizeof(uint64_t) * pprof->scratch_location_ids_capa +
+         sizeof(uint32_t) *
+             (pprof->strings_index.capa + pprof->functions_index.capa +
+              pprof->locations_index.capa + pprof->samples_index.capa);
+}
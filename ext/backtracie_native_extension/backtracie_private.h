@@ -3,6 +3,9 @@
 
 #include <ruby.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "public/backtracie.h"
 
 // Need to define an assert macro - we might have just used RUBY_ASSERT, but
 // that's not exported in Ruby < 2.7.
@@ -15,6 +18,164 @@
   } while (0)
 #define BACKTRACIE_ASSERT_FAIL(msg) BACKTRACIE_ASSERT_MSG(0, msg)
 
+// Combines value into hash; used by our hash tables. Based on the splitmix64
+// finalizer, so it's cheap but still spreads pointers and small integers well.
+static inline uint64_t backtracie_hash_mix(uint64_t hash, uint64_t value) {
+  hash ^= value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 31);
+}
+
+// Runtime counters (see backtracie_stats.c). When building with
+// BACKTRACIE_DISABLE_STATS these compile down to nothing.
+#ifndef BACKTRACIE_DISABLE_STATS
+#include <time.h>
+
+extern backtracie_stats_t backtracie_stats;
+
+#define BACKTRACIE_STATS_ADD(counter, value)                                   \
+  ((void)__atomic_fetch_add(&backtracie_stats.counter, (uint64_t)(value),      \
+                            __ATOMIC_RELAXED))
+#define BACKTRACIE_STATS_TIMER_START() backtracie_stats_now_ns()
+#define BACKTRACIE_STATS_TIMER_STOP(counter, started_at)                       \
+  BACKTRACIE_STATS_ADD(counter, backtracie_stats_now_ns() - (started_at))
+
+static inline uint64_t backtracie_stats_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+#else
+#define BACKTRACIE_STATS_ADD(counter, value) ((void)(value))
+#define BACKTRACIE_STATS_TIMER_START() ((uint64_t)0)
+#define BACKTRACIE_STATS_TIMER_STOP(counter, started_at) ((void)(started_at))
+#endif
+#define BACKTRACIE_STATS_INC(counter) BACKTRACIE_STATS_ADD(counter, 1)
+
+// Returns a frozen and deduplicated (via Ruby's own fstring table) string with
+// the given contents
+VALUE backtracie_interned_str(const char *ptr, long len);
+// Like backtracie_interned_str, but for an existing string. Frozen strings
+// (such as iseq paths and labels, which Ruby already interns) get returned
+// as-is.
+VALUE backtracie_interned_str_value(VALUE str);
+
 bool backtracie_is_thread_alive(VALUE thread);
+// Writes up to max of the alive threads (of the current ractor) to out, without
+// allocating any memory. Returns the total number of alive threads, which may
+// be more than max.
+int backtracie_living_threads(VALUE *out, int max);
+
+// Used to keep track of the classes whose names were used to render a class
+// qualifier (see backtracie_class_name_cache.c)
+#define BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES 4
+typedef struct {
+  // May be > BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES, in which case the extra
+  // classes were not recorded
+  int len;
+  VALUE classes[BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES];
+  VALUE names[BACKTRACIE_CLASS_NAME_MAX_DEPENDENCIES];
+} backtracie_class_name_dependencies_t;
+
+// Same as rb_mod_name, but also records klass and its name in dependencies
+VALUE backtracie_class_name_cache_mod_name(
+    VALUE klass, backtracie_class_name_dependencies_t *dependencies);
+// Returns the cached qualifier for klass, or NULL if there's none (or if the
+// names it depends on changed)
+const char *backtracie_class_name_cache_lookup(VALUE klass, bool refinement);
+void backtracie_class_name_cache_insert(
+    VALUE klass, bool refinement,
+    const backtracie_class_name_dependencies_t *dependencies, const char *name,
+    size_t name_len);
+
+// Looks up the line number for (iseq, pc) in the line number cache (see
+// backtracie_line_number_cache.c); returns false if it's not there.
+bool backtracie_line_number_cache_lookup(VALUE iseq, const void *pc,
+                                         int *line_number);
+void backtracie_line_number_cache_insert(VALUE iseq, const void *pc,
+                                         int line_number);
+
+// A frame as captured by backtracie_signal_safe_capture_frames(): the words
+// copied as-is from the control frame, which only get turned into a
+// raw_location later, while holding the GVL
+typedef struct {
+  VALUE iseq;
+  VALUE callable_method_entry;
+  VALUE self;
+  // The pc, with the lowest bit set for ruby frames (pcs are always aligned)
+  uintptr_t pc_and_flags;
+} backtracie_signal_safe_frame_t;
+
+// Captures up to max frames from the stack of the current thread into out,
+// without calling into Ruby, allocating or taking any locks, so this can be
+// called from a signal handler. Returns -1 if there's no Ruby thread to capture
+// (e.g. when running on a thread not created by Ruby, or on a thread that
+// doesn't hold the GVL), otherwise the number of frames written.
+int backtracie_signal_safe_capture_frames(VALUE *thread,
+                                          backtracie_signal_safe_frame_t *out,
+                                          int max);
+void backtracie_signal_safe_frame_to_raw_location(
+    const backtracie_signal_safe_frame_t *frame, raw_location *loc);
+
+// Renders the stacks in the given stack trie in the folded format (see
+// backtracie_folded_aggregator.c). If counts is not NULL, it's used for the
+// count of each node instead of the counts kept by the trie; nodes >=
+// counts_len get a count of zero.
+VALUE backtracie_stack_trie_to_folded(VALUE stack_trie, const uint64_t *counts,
+                                      uint32_t counts_len);
+
+// Returns the path string referenced by the iseq of the given frame (without
+// copying it), or Qnil if there's none
+VALUE backtracie_frame_path_value(const raw_location *loc, bool absolute);
+// Returns true if the given frame is a ruby frame for a block
+bool backtracie_frame_is_block(const raw_location *loc);
+// Like backtracie_capture_caller_frame, but also captures the first ruby frame
+// at or after the given depth (which is the frame itself, unless it's a C
+// frame) into ruby_loc, setting found_ruby_loc to whether there was one.
+// Both get captured in a single walk of the stack, however many C frames
+// there are in between.
+bool backtracie_capture_caller_frame_and_ruby_frame(int depth,
+                                                    raw_location *loc,
+                                                    raw_location *ruby_loc,
+                                                    bool *found_ruby_loc);
+// Like backtracie_capture_frames_for_thread, but if max frames got captured and
+// the last one is a C frame, the same walk also captures the first ruby frame
+// after it into ruby_loc, setting found_ruby_loc to whether there was one.
+int backtracie_capture_frames_and_ruby_frame_for_thread(VALUE thread,
+                                                        int start, int max,
+                                                        raw_location *out,
+                                                        raw_location *ruby_loc,
+                                                        bool *found_ruby_loc);
+
+// Returns the given Backtracie::Filter, or Qnil if filter is nil or Qundef;
+// raises a TypeError for anything else
+VALUE backtracie_filter_option(VALUE filter);
+// Returns true if the given frame should be kept; prev_ruby_loc is the frame
+// whose path is used for the location (see frame_to_location in backtracie.c)
+bool backtracie_filter_accepts(VALUE filter, const raw_location *loc,
+                               const raw_location *prev_ruby_loc);
+
+// Incremented whenever old objects may have been freed or moved by the GC;
+// caches that don't mark the objects they reference only use entries from the
+// current epoch (see backtracie_gc_epoch.c)
+extern uint64_t backtracie_gc_epoch;
+// Returns true if object can be referenced by such a cache, i.e. it can't be
+// freed or moved without the epoch changing
+bool backtracie_gc_epoch_can_reference(VALUE object);
+
 void backtracie_init_c_test_helpers(VALUE backtracie_module);
+void backtracie_init_gc_epoch(void);
+void backtracie_init_class_name_cache(void);
+void backtracie_init_line_number_cache(VALUE backtracie_module);
+void backtracie_init_stack_trie(VALUE backtracie_module);
+void backtracie_init_sampler(VALUE backtracie_module);
+void backtracie_init_folded_aggregator(VALUE backtracie_module);
+void backtracie_init_ring_buffer(VALUE backtracie_module);
+void backtracie_init_stats(VALUE backtracie_module);
+void backtracie_init_exception_tracker(VALUE backtracie_module);
+void backtracie_init_allocation_profiler(VALUE backtracie_module);
+void backtracie_init_filter(VALUE backtracie_module);
+void backtracie_init_call_site_set(VALUE backtracie_module);
+VALUE backtracie_frame_table_alloc(VALUE klass);
 #endif
@@ -0,0 +1,288 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// The ring buffer is where stacks captured from signal handlers go, until they
+// get drained (while holding the GVL). It's a single-producer, single-consumer
+// queue of entries: each stack takes a header entry, followed by one entry per
+// frame. A stack never wraps around the end of the buffer, so frames can be
+// written directly by backtracie_signal_safe_capture_frames(); if there's not
+// enough room left at the end, a "skip" header fills it up instead.
+//
+// head and tail only ever grow (the index for them is position & (capa - 1)).
+// The producer owns head and the consumer owns tail; each only ever reads the
+// other's with acquire semantics, so no locks are needed.
+//
+// Objects referenced by a stack are only guaranteed to be valid if no GC
+// happened while it was being captured (as it may move or free them). To know
+// that, gc_epoch gets incremented whenever the GC starts and stops doing some
+// work, so it's odd while the GC is running; stacks where it was odd or where
+// it changed get dropped. Once in the buffer, stacks are kept alive (and
+// pinned) by the ring buffer's mark function until they get drained.
+//
+// Stacks only get captured by the thread holding the GVL (see
+// backtracie_signal_safe_capture_frames()), whose signal handler runs to
+// completion before anything else can: the GC thus can't start between the
+// last gc_epoch check and the stack getting published, so any GC that ran
+// since then has marked it, and drained stacks need no further validation.
+
+#define ENTRY_STACK 0
+#define ENTRY_SKIP 1
+
+typedef union {
+  struct {
+    uint32_t kind;
+    // Including this header entry
+    uint32_t entries_len;
+    VALUE thread;
+  } header;
+  backtracie_signal_safe_frame_t frame;
+} ring_entry_t;
+
+// Frames get written straight into the entries, so they must be the same size
+typedef char ring_entry_size_check[sizeof(ring_entry_t) ==
+                                           sizeof(backtracie_signal_safe_frame_t)
+                                       ? 1
+                                       : -1];
+
+struct backtracie_ring_buffer {
+  ring_entry_t *entries;
+  uint64_t capa; // Always a power of two
+  int max_depth;
+  uint64_t head;
+  uint64_t tail;
+  // Set while a capture is in progress, so that concurrent captures (e.g. from
+  // signal handlers running on different threads) get dropped
+  bool producing;
+  uint64_t dropped;
+};
+
+static VALUE backtracie_ring_buffer_class = Qnil;
+static VALUE gc_tracepoint = Qnil;
+static uint64_t gc_epoch = 0;
+
+static bool capture(backtracie_ring_buffer_t *ring_buffer);
+static void on_gc_event(VALUE tracepoint, void *unused);
+
+static void ring_buffer_mark(void *ptr);
+static void ring_buffer_free(void *ptr);
+static size_t ring_buffer_memsize(const void *ptr);
+static const rb_data_type_t ring_buffer_type = {
+    .wrap_struct_name = "backtracie_ring_buffer",
+    .function = {.dmark = ring_buffer_mark,
+                 .dfree = ring_buffer_free,
+                 .dsize = ring_buffer_memsize,
+                 // Stacks get pinned when marked, so there's no compact
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_ring_buffer(VALUE backtracie_module) {
+  backtracie_ring_buffer_class =
+      rb_define_class_under(backtracie_module, "RingBuffer", rb_cObject);
+  rb_global_variable(&backtracie_ring_buffer_class);
+  // Only created via backtracie_ring_buffer_new()
+  rb_undef_alloc_func(backtracie_ring_buffer_class);
+  rb_global_variable(&gc_tracepoint);
+}
+
+VALUE backtracie_ring_buffer_new(int capacity, int max_depth) {
+  if (max_depth <= 0 || capacity <= max_depth) {
+    rb_raise(rb_eArgError,
+             "ring buffer capacity (%d) must be bigger than max_depth (%d)",
+             capacity, max_depth);
+  }
+
+  // Only needs to happen once, and only if the ring buffer is actually used
+  if (gc_tracepoint == Qnil) {
+    gc_tracepoint = rb_tracepoint_new(
+        0, RUBY_INTERNAL_EVENT_GC_ENTER | RUBY_INTERNAL_EVENT_GC_EXIT,
+        on_gc_event, NULL);
+    rb_tracepoint_enable(gc_tracepoint);
+  }
+
+  backtracie_ring_buffer_t *ring_buffer;
+  VALUE wrapper = TypedData_Make_Struct(backtracie_ring_buffer_class,
+                                        backtracie_ring_buffer_t,
+                                        &ring_buffer_type, ring_buffer);
+  ring_buffer->capa = 1;
+  while (ring_buffer->capa < (uint64_t)capacity) {
+    ring_buffer->capa *= 2;
+  }
+  ring_buffer->entries = ZALLOC_N(ring_entry_t, ring_buffer->capa);
+  ring_buffer->max_depth = max_depth;
+  return wrapper;
+}
+
+backtracie_ring_buffer_t *backtracie_ring_buffer_get(VALUE ring_buffer) {
+  backtracie_ring_buffer_t *ring_buffer_data;
+  TypedData_Get_Struct(ring_buffer, backtracie_ring_buffer_t,
+                       &ring_buffer_type, ring_buffer_data);
+  return ring_buffer_data;
+}
+
+bool backtracie_ring_buffer_capture(backtracie_ring_buffer_t *ring_buffer) {
+  if (__atomic_exchange_n(&ring_buffer->producing, true, __ATOMIC_ACQUIRE)) {
+    __atomic_fetch_add(&ring_buffer->dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  bool captured = capture(ring_buffer);
+  if (!captured) {
+    __atomic_fetch_add(&ring_buffer->dropped, 1, __ATOMIC_RELAXED);
+  }
+
+  __atomic_store_n(&ring_buffer->producing, false, __ATOMIC_RELEASE);
+  return captured;
+}
+
+int backtracie_ring_buffer_drain(VALUE ring_buffer, VALUE *thread,
+                                 raw_location *out, int max) {
+  backtracie_ring_buffer_t *ring_buffer_data =
+      backtracie_ring_buffer_get(ring_buffer);
+  uint64_t mask = ring_buffer_data->capa - 1;
+  uint64_t head = __atomic_load_n(&ring_buffer_data->head, __ATOMIC_ACQUIRE);
+  uint64_t tail = ring_buffer_data->tail;
+
+  while (tail != head) {
+    const ring_entry_t *header = &ring_buffer_data->entries[tail & mask];
+    uint64_t next_tail = tail + header->header.entries_len;
+    if (header->header.kind == ENTRY_SKIP) {
+      tail = next_tail;
+      continue;
+    }
+
+    int frames_len = (int)header->header.entries_len - 1;
+    if (frames_len > max) {
+      frames_len = max;
+    }
+    for (int i = 0; i < frames_len; i++) {
+      backtracie_signal_safe_frame_to_raw_location(
+          &ring_buffer_data->entries[(tail + 1 + i) & mask].frame, &out[i]);
+    }
+    *thread = header->header.thread;
+
+    // Once this is done, the producer is free to reuse the entries
+    __atomic_store_n(&ring_buffer_data->tail, next_tail, __ATOMIC_RELEASE);
+    return frames_len;
+  }
+
+  __atomic_store_n(&ring_buffer_data->tail, tail, __ATOMIC_RELEASE);
+  return -1;
+}
+
+uint64_t backtracie_ring_buffer_dropped(VALUE ring_buffer) {
+  return __atomic_load_n(&backtracie_ring_buffer_get(ring_buffer)->dropped,
+                         __ATOMIC_RELAXED);
+}
+
+// Note: Runs in a signal handler; see backtracie_signal_safe_capture_frames()
+static bool capture(backtracie_ring_buffer_t *ring_buffer) {
+  uint64_t epoch = __atomic_load_n(&gc_epoch, __ATOMIC_ACQUIRE);
+  if (epoch & 1) {
+    // The GC is running, so objects may be moving around
+    return false;
+  }
+
+  uint64_t capa = ring_buffer->capa;
+  uint64_t head = ring_buffer->head;
+  uint64_t tail = __atomic_load_n(&ring_buffer->tail, __ATOMIC_ACQUIRE);
+  uint64_t needed = 1 + (uint64_t)ring_buffer->max_depth;
+  uint64_t index = head & (capa - 1);
+  uint64_t skipped = capa - index < needed ? capa - index : 0;
+  if (capa - (head - tail) < skipped + needed) {
+    // Full
+    return false;
+  }
+
+  if (skipped > 0) {
+    ring_buffer->entries[index].header.kind = ENTRY_SKIP;
+    ring_buffer->entries[index].header.entries_len = (uint32_t)skipped;
+    head += skipped;
+    index = 0;
+  }
+
+  VALUE thread;
+  int frames_len = backtracie_signal_safe_capture_frames(
+      &thread, &ring_buffer->entries[index + 1].frame, ring_buffer->max_depth);
+  if (frames_len < 0) {
+    return false;
+  }
+
+  // Makes sure the frames were read before checking that the GC didn't run
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&gc_epoch, __ATOMIC_RELAXED) != epoch) {
+    return false;
+  }
+
+  ring_buffer->entries[index].header.kind = ENTRY_STACK;
+  ring_buffer->entries[index].header.entries_len = 1 + (uint32_t)frames_len;
+  ring_buffer->entries[index].header.thread = thread;
+
+  __atomic_store_n(&ring_buffer->head, head + 1 + frames_len, __ATOMIC_RELEASE);
+  return true;
+}
+
+static void on_gc_event(VALUE tracepoint, void *unused) {
+  __atomic_add_fetch(&gc_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+static void ring_buffer_mark(void *ptr) {
+  backtracie_ring_buffer_t *ring_buffer = (backtracie_ring_buffer_t *)ptr;
+  uint64_t mask = ring_buffer->capa - 1;
+  uint64_t head = __atomic_load_n(&ring_buffer->head, __ATOMIC_ACQUIRE);
+
+  for (uint64_t position = ring_buffer->tail; position != head;) {
+    const ring_entry_t *header = &ring_buffer->entries[position & mask];
+    if (header->header.kind == ENTRY_STACK) {
+      rb_gc_mark(header->header.thread);
+      for (uint32_t i = 1; i < header->header.entries_len; i++) {
+        const backtracie_signal_safe_frame_t *frame =
+            &ring_buffer->entries[(position + i) & mask].frame;
+        rb_gc_mark(frame->iseq);
+        rb_gc_mark(frame->callable_method_entry);
+        rb_gc_mark(frame->self);
+      }
+    }
+    position += header->header.entries_len;
+  }
+}
+
+static void ring_buffer_free(void *ptr) {
+  backtracie_ring_buffer_t *ring_buffer = (backtracie_ring_buffer_t *)ptr;
+  xfree(ring_buffer->entries);
+  xfree(ring_buffer);
+}
+
+static size_t ring_buffer_memsize(const void *ptr) {
+  const backtracie_ring_buffer_t *ring_buffer =
+      (const backtracie_ring_buffer_t *)ptr;
+  return sizeof(backtracie_ring_buffer_t) +
+         sizeof(ring_entry_t) * ring_buffer->capa;
+}
@@ -0,0 +1,504 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <errno.h>
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// The sampler is a wall-clock sampling profiler: a native thread wakes up
+// frequency times per second, and asks Ruby (via a postponed job) to take a
+// sample. The postponed job then runs on whatever thread holds the GVL, and
+// captures the stacks of every alive thread as minimal_location_t's.
+//
+// All memory for samples is allocated upfront, so that taking a sample never
+// needs to allocate (and never creates Ruby objects); once the buffers are full
+// new samples are dropped. Turning samples into Ruby objects only happens when
+// the results are requested.
+//
+// Only a single sampler can be running at any given time. A sampler that is
+// still running when Ruby exits gets stopped before Ruby starts tearing down
+// its threads (see stop_active_sampler).
+
+typedef struct {
+  VALUE thread;
+  // CLOCK_MONOTONIC, in nanoseconds
+  uint64_t timestamp_ns;
+  size_t frames_offset;
+  int frames_len;
+} sample_t;
+
+typedef struct {
+  // Configuration
+  uint64_t interval_ns;
+  int max_depth;
+
+  // Preallocated buffers; samples point into frames
+  sample_t *samples;
+  size_t samples_len;
+  size_t samples_capa;
+  minimal_location_t *frames;
+  size_t frames_len;
+  size_t frames_capa;
+  uint64_t dropped_samples;
+
+  bool running;
+#ifdef HAVE_PTHREAD_H
+  pthread_t sampler_thread;
+  // The sampler thread only exists in the process that started it, and not in
+  // any process forked from it
+  pid_t sampler_thread_pid;
+  pthread_mutex_t mutex;
+  pthread_cond_t stop_requested;
+#endif
+} sampler_t;
+
+// Threads after the first SAMPLER_MAX_THREADS don't get sampled (and count as
+// dropped samples)
+#define SAMPLER_MAX_THREADS 1024
+
+static VALUE backtracie_sampler_class = Qnil;
+static VALUE backtracie_sample_class = Qnil;
+static VALUE backtracie_sampler_frame_class = Qnil;
+static ID frequency_id;
+static ID max_depth_id;
+static ID max_samples_id;
+static ID max_frames_id;
+
+// The sampler that is currently running, if any. Only touched while holding
+// the GVL. active_sampler_value is a GC root, so a running sampler is never
+// garbage collected (even if there's no other reference left to it).
+static sampler_t *active_sampler = NULL;
+static VALUE active_sampler_value = Qnil;
+
+static VALUE sampler_alloc(VALUE klass);
+static sampler_t *get_sampler(VALUE self);
+static VALUE sampler_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE sampler_start(VALUE self);
+static VALUE sampler_stop(VALUE self);
+static VALUE sampler_is_running(VALUE self);
+static VALUE sampler_result(VALUE self);
+static VALUE sampler_dropped_samples(VALUE self);
+static VALUE sampler_clear(VALUE self);
+static VALUE sampler_encode_pprof(VALUE self);
+static void stop_active_sampler(VALUE unused);
+static void sample_all_threads(void *unused);
+static void sample_thread(sampler_t *sampler, VALUE thread,
+                          uint64_t timestamp_ns);
+static VALUE sample_to_ruby(const sampler_t *sampler, const sample_t *sample);
+static VALUE minimal_frame_name(const minimal_location_t *loc);
+static uint64_t monotonic_time_ns(void);
+#ifdef HAVE_PTHREAD_H
+static void *sampler_thread_main(void *ptr);
+#endif
+
+static void sampler_mark(void *ptr);
+static void sampler_free(void *ptr);
+static size_t sampler_memsize(const void *ptr);
+static const rb_data_type_t sampler_type = {
+    .wrap_struct_name = "backtracie_sampler",
+    .function = {.dmark = sampler_mark,
+                 .dfree = sampler_free,
+                 .dsize = sampler_memsize,
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_sampler(VALUE backtracie_module) {
+  frequency_id = rb_intern("frequency");
+  max_depth_id = rb_intern("max_depth");
+  max_samples_id = rb_intern("max_samples");
+  max_frames_id = rb_intern("max_frames");
+  rb_global_variable(&active_sampler_value);
+  rb_set_end_proc(stop_active_sampler, Qnil);
+
+  backtracie_sampler_class =
+      rb_const_get(backtracie_module, rb_intern("Sampler"));
+  rb_global_variable(&backtracie_sampler_class);
+  backtracie_sample_class =
+      rb_const_get(backtracie_sampler_class, rb_intern("Sample"));
+  rb_global_variable(&backtracie_sample_class);
+  backtracie_sampler_frame_class =
+      rb_const_get(backtracie_sampler_class, rb_intern("Frame"));
+  rb_global_variable(&backtracie_sampler_frame_class);
+
+  rb_define_alloc_func(backtracie_sampler_class, sampler_alloc);
+  rb_define_method(backtracie_sampler_class, "initialize", sampler_initialize,
+                   -1);
+  rb_define_method(backtracie_sampler_class, "start", sampler_start, 0);
+  rb_define_method(backtracie_sampler_class, "stop", sampler_stop, 0);
+  rb_define_method(backtracie_sampler_class, "running?", sampler_is_running,
+                   0);
+  rb_define_method(backtracie_sampler_class, "result", sampler_result, 0);
+  rb_define_method(backtracie_sampler_class, "dropped_samples",
+                   sampler_dropped_samples, 0);
+  rb_define_method(backtracie_sampler_class, "clear", sampler_clear, 0);
+  rb_define_private_method(backtracie_sampler_class, "encode_pprof",
+                           sampler_encode_pprof, 0);
+}
+
+static VALUE sampler_alloc(VALUE klass) {
+  sampler_t *sampler;
+  VALUE wrapper =
+      TypedData_Make_Struct(klass, sampler_t, &sampler_type, sampler);
+  // TypedData_Make_Struct zeroes the struct, so the buffers are NULL and
+  // everything is empty until initialize gets called
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&sampler->mutex, NULL);
+  pthread_cond_init(&sampler->stop_requested, NULL);
+#endif
+  return wrapper;
+}
+
+static sampler_t *get_sampler(VALUE self) {
+  sampler_t *sampler;
+  TypedData_Get_Struct(self, sampler_t, &sampler_type, sampler);
+  if (sampler->samples == NULL) {
+    rb_raise(rb_eRuntimeError, "uninitialized Backtracie::Sampler");
+  }
+  return sampler;
+}
+
+// Backtracie::Sampler.new(frequency: 100, max_depth: 512,
+//                         max_samples: 100_000, max_frames: 1_000_000)
+//
+// * frequency: number of samples per second
+// * max_depth: stacks deeper than this get their top max_depth frames sampled
+// * max_samples/max_frames: size of the preallocated buffers; once either is
+//   full, new samples get dropped
+static VALUE sampler_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE keyword_arguments;
+  rb_scan_args(argc, argv, "0:", &keyword_arguments);
+
+  ID keywords[] = {frequency_id, max_depth_id, max_samples_id, max_frames_id};
+  VALUE values[] = {Qundef, Qundef, Qundef, Qundef};
+  rb_get_kwargs(keyword_arguments, keywords, 0, 4, values);
+
+  double frequency = values[0] == Qundef ? 100 : NUM2DBL(values[0]);
+  long max_depth = values[1] == Qundef ? 512 : NUM2LONG(values[1]);
+  long max_samples = values[2] == Qundef ? 100000 : NUM2LONG(values[2]);
+  long max_frames = values[3] == Qundef ? 1000000 : NUM2LONG(values[3]);
+
+  if (!(frequency > 0 && frequency <= 1000000)) {
+    rb_raise(rb_eArgError, "frequency must be between 0 and 1000000 (got %f)",
+             frequency);
+  }
+  if (max_depth <= 0 || max_depth > INT_MAX) {
+    rb_raise(rb_eArgError, "invalid max_depth (%ld)", max_depth);
+  }
+  if (max_samples <= 0) {
+    rb_raise(rb_eArgError, "invalid max_samples (%ld)", max_samples);
+  }
+  if (max_frames <= 0) {
+    rb_raise(rb_eArgError, "invalid max_frames (%ld)", max_frames);
+  }
+
+  sampler_t *sampler;
+  TypedData_Get_Struct(self, sampler_t, &sampler_type, sampler);
+  if (sampler->samples != NULL) {
+    rb_raise(rb_eRuntimeError, "Backtracie::Sampler already initialized");
+  }
+
+  sampler->interval_ns = (uint64_t)(1000000000.0 / frequency);
+  sampler->max_depth = (int)max_depth;
+  sampler->frames = ALLOC_N(minimal_location_t, max_frames);
+  sampler->frames_capa = max_frames;
+  sampler->samples = ALLOC_N(sample_t, max_samples);
+  sampler->samples_capa = max_samples;
+
+  return self;
+}
+
+static VALUE sampler_start(VALUE self) {
+#ifdef HAVE_PTHREAD_H
+  sampler_t *sampler = get_sampler(self);
+  if (sampler->running) {
+    return Qfalse;
+  }
+  if (active_sampler != NULL) {
+    rb_raise(rb_eRuntimeError, "Another Backtracie::Sampler is already running");
+  }
+
+  sampler->running = true;
+  sampler->sampler_thread_pid = getpid();
+  active_sampler = sampler;
+  active_sampler_value = self;
+
+  int error =
+      pthread_create(&sampler->sampler_thread, NULL, sampler_thread_main,
+                     sampler);
+  if (error != 0) {
+    sampler->running = false;
+    active_sampler = NULL;
+    active_sampler_value = Qnil;
+    rb_syserr_fail(error, "Failed to start Backtracie::Sampler thread");
+  }
+
+  return Qtrue;
+#else
+  rb_raise(rb_eNotImpError, "Backtracie::Sampler is not supported on this platform");
+#endif
+}
+
+static VALUE sampler_stop(VALUE self) {
+#ifdef HAVE_PTHREAD_H
+  sampler_t *sampler = get_sampler(self);
+  if (!sampler->running) {
+    return Qfalse;
+  }
+
+  if (sampler->sampler_thread_pid != getpid()) {
+    // This is a forked process, so there's no thread to stop (and the mutex
+    // may have been held by it when forking)
+    sampler->running = false;
+  } else {
+    pthread_mutex_lock(&sampler->mutex);
+    sampler->running = false;
+    pthread_cond_signal(&sampler->stop_requested);
+    pthread_mutex_unlock(&sampler->mutex);
+
+    // The sampler thread never needs the GVL, so it's fine to wait for it here
+    pthread_join(sampler->sampler_thread, NULL);
+  }
+
+  // A sample may still be pending; it will be ignored since we're no longer
+  // the active sampler
+  active_sampler = NULL;
+  active_sampler_value = Qnil;
+
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
+// Registered with rb_set_end_proc, so this runs when Ruby exits; otherwise the
+// sampler thread would keep on asking for samples to be taken while threads are
+// being torn down
+static void stop_active_sampler(VALUE unused) {
+  if (active_sampler_value != Qnil) {
+    sampler_stop(active_sampler_value);
+  }
+}
+
+static VALUE sampler_is_running(VALUE self) {
+  return get_sampler(self)->running ? Qtrue : Qfalse;
+}
+
+// Returns an array of Backtracie::Sampler::Sample, in the order they were taken
+static VALUE sampler_result(VALUE self) {
+  sampler_t *sampler = get_sampler(self);
+
+  VALUE result = rb_ary_new_capa(sampler->samples_len);
+  for (size_t i = 0; i < sampler->samples_len; i++) {
+    rb_ary_push(result, sample_to_ruby(sampler, &sampler->samples[i]));
+  }
+
+  RB_GC_GUARD(self);
+  return result;
+}
+
+static VALUE sampler_dropped_samples(VALUE self) {
+  return ULL2NUM(get_sampler(self)->dropped_samples);
+}
+
+// Discards every sample taken so far
+static VALUE sampler_clear(VALUE self) {
+  sampler_t *sampler = get_sampler(self);
+  sampler->samples_len = 0;
+  sampler->frames_len = 0;
+  sampler->dropped_samples = 0;
+  return self;
+}
+
+// Returns an (uncompressed) pprof profile of every sample taken so far; samples
+// with the same stack get aggregated, regardless of thread
+static VALUE sampler_encode_pprof(VALUE self) {
+  sampler_t *sampler = get_sampler(self);
+  VALUE pprof = backtracie_pprof_new("samples", "count");
+  backtracie_pprof_set_period(pprof, "wall", "nanoseconds",
+                              (int64_t)sampler->interval_ns);
+
+  for (size_t i = 0; i < sampler->samples_len; i++) {
+    const sample_t *sample = &sampler->samples[i];
+    backtracie_pprof_add_minimal_sample(
+        pprof, &sampler->frames[sample->frames_offset], sample->frames_len, 1);
+  }
+
+  VALUE result = backtracie_pprof_encode(pprof);
+  RB_GC_GUARD(self);
+  RB_GC_GUARD(pprof);
+  return result;
+}
+
+// Runs as a postponed job, thus while holding the GVL
+static void sample_all_threads(void *unused) {
+  sampler_t *sampler = active_sampler;
+  if (sampler == NULL) {
+    return;
+  }
+
+  uint64_t timestamp_ns = monotonic_time_ns();
+
+  // Walk the VM's list of threads directly, rather than via Thread.list, so
+  // that taking a sample doesn't create any Ruby objects
+  VALUE threads[SAMPLER_MAX_THREADS];
+  int thread_count = backtracie_living_threads(threads, SAMPLER_MAX_THREADS);
+  if (thread_count > SAMPLER_MAX_THREADS) {
+    sampler->dropped_samples += thread_count - SAMPLER_MAX_THREADS;
+    thread_count = SAMPLER_MAX_THREADS;
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    sample_thread(sampler, threads[i], timestamp_ns);
+  }
+}
+
+static void sample_thread(sampler_t *sampler, VALUE thread,
+                          uint64_t timestamp_ns) {
+  if (!backtracie_is_thread_alive(thread)) {
+    return;
+  }
+
+  size_t frames_available = sampler->frames_capa - sampler->frames_len;
+  int max_depth = sampler->max_depth;
+  if (sampler->samples_len == sampler->samples_capa ||
+      frames_available < (size_t)max_depth) {
+    sampler->dropped_samples++;
+    return;
+  }
+
+  int frames_len = backtracie_capture_minimal_frames_for_thread(
+      thread, 0, max_depth, &sampler->frames[sampler->frames_len]);
+
+  sampler->samples[sampler->samples_len++] = (sample_t){
+      .thread = thread,
+      .timestamp_ns = timestamp_ns,
+      .frames_offset = sampler->frames_len,
+      .frames_len = frames_len,
+  };
+  sampler->frames_len += frames_len;
+}
+
+static VALUE sample_to_ruby(const sampler_t *sampler, const sample_t *sample) {
+  const minimal_location_t *frames = &sampler->frames[sample->frames_offset];
+
+  VALUE rb_frames = rb_ary_new_capa(sample->frames_len);
+  for (int i = 0; i < sample->frames_len; i++) {
+    VALUE arguments[] = {minimal_frame_name(&frames[i]),
+                         UINT2NUM(frames[i].line_number), frames[i].filename};
+    rb_ary_push(rb_frames,
+                rb_class_new_instance(3, arguments,
+                                      backtracie_sampler_frame_class));
+  }
+
+  VALUE arguments[] = {sample->thread, ULL2NUM(sample->timestamp_ns),
+                       rb_frames};
+  return rb_class_new_instance(3, arguments, backtracie_sample_class);
+}
+
+static VALUE minimal_frame_name(const minimal_location_t *loc) {
+  char buf[256];
+  size_t len = backtracie_minimal_frame_name_cstr(loc, buf, sizeof(buf));
+  if (len < sizeof(buf)) {
+    // The same few names show up in most samples, so don't keep copies around
+    return backtracie_interned_str(buf, (long)len);
+  }
+
+  VALUE name = rb_str_buf_new(len);
+  backtracie_minimal_frame_name_cstr(loc, RSTRING_PTR(name), len + 1);
+  rb_str_set_len(name, len);
+  return backtracie_interned_str_value(name);
+}
+
+static uint64_t monotonic_time_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *sampler_thread_main(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+
+  pthread_mutex_lock(&sampler->mutex);
+  while (sampler->running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    uint64_t deadline_ns = (uint64_t)deadline.tv_nsec + sampler->interval_ns;
+    deadline.tv_sec += deadline_ns / 1000000000;
+    deadline.tv_nsec = deadline_ns % 1000000000;
+
+    int result = 0;
+    while (sampler->running && result != ETIMEDOUT) {
+      result = pthread_cond_timedwait(&sampler->stop_requested,
+                                      &sampler->mutex, &deadline);
+    }
+
+    if (sampler->running) {
+      // This is safe to call from any thread, and does not need the GVL
+      rb_postponed_job_register_one(0, sample_all_threads, NULL);
+    }
+  }
+  pthread_mutex_unlock(&sampler->mutex);
+
+  return NULL;
+}
+#endif
+
+static void sampler_mark(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+  for (size_t i = 0; i < sampler->samples_len; i++) {
+    rb_gc_mark(sampler->samples[i].thread);
+  }
+  for (size_t i = 0; i < sampler->frames_len; i++) {
+    backtracie_minimal_frame_mark(&sampler->frames[i]);
+  }
+}
+
+static void sampler_free(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+  // A running sampler is a GC root, so it never gets here
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&sampler->mutex);
+  pthread_cond_destroy(&sampler->stop_requested);
+#endif
+  xfree(sampler->samples);
+  xfree(sampler->frames);
+  xfree(sampler);
+}
+
+static size_t sampler_memsize(const void *ptr) {
+  const sampler_t *sampler = (const sampler_t *)ptr;
+  return sizeof(sampler_t) + sizeof(sample_t) * sampler->samples_capa +
+         sizeof(minimal_location_t) * sampler->frames_capa;
+}
@@ -0,0 +1,499 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// The stack trie stores stacks as paths in a prefix tree of frame ids (from a
+// frame table), rooted at the bottom of the stack. Stacks that share the same
+// bottom frames (e.g. everything below a Rack middleware chain) thus share the
+// same nodes.
+//
+// Node 0 is the root (the empty stack); every other node is identified by its
+// parent node and its frame id. Nodes are stored in insertion order (so a node
+// id is just an index into nodes), and children are found via an open
+// addressing hash table (slots) keyed on (parent, frame id), which stores
+// node id + 1, or 0 for an empty slot.
+
+typedef struct {
+  uint32_t parent;
+  uint32_t frame_id;
+  uint32_t depth;
+  // Number of stacks inserted that ended exactly at this node
+  uint64_t self_count;
+  // Number of stacks inserted that went through this node
+  uint64_t total_count;
+} stack_trie_node_t;
+
+typedef struct {
+  VALUE frame_table;
+  stack_trie_node_t *nodes;
+  uint32_t nodes_len;
+  uint32_t nodes_capa;
+  uint32_t *slots;
+  // Always a power of two, and always more than twice nodes_capa
+  uint32_t slots_capa;
+} stack_trie_t;
+
+#define STACK_TRIE_INITIAL_CAPA 256
+
+static VALUE backtracie_module = Qnil;
+static VALUE backtracie_stack_trie_class = Qnil;
+
+static VALUE stack_trie_alloc(VALUE klass);
+static stack_trie_t *get_stack_trie(VALUE trie);
+static void stack_trie_init(VALUE trie, VALUE frame_table);
+static void stack_trie_reserve(stack_trie_t *trie, uint32_t count);
+static uint32_t stack_trie_child(stack_trie_t *trie, uint32_t parent,
+                                 uint32_t frame_id);
+static uint32_t stack_trie_find_slot(const stack_trie_t *trie, uint32_t parent,
+                                     uint32_t frame_id);
+static uint32_t get_node(const stack_trie_t *trie, VALUE node);
+
+static VALUE stack_trie_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE stack_trie_frame_table(VALUE self);
+static VALUE stack_trie_size(VALUE self);
+static VALUE stack_trie_insert(VALUE self, VALUE ids);
+static VALUE stack_trie_capture(VALUE self, VALUE thread);
+static VALUE stack_trie_count(VALUE self, VALUE node);
+static VALUE stack_trie_total_count(VALUE self, VALUE node);
+static VALUE stack_trie_parent(VALUE self, VALUE node);
+static VALUE stack_trie_frame_ids(VALUE self, VALUE node);
+static VALUE stack_trie_locations(VALUE self, VALUE node);
+static VALUE stack_trie_encode_pprof(VALUE self, VALUE sample_type,
+                                     VALUE sample_unit);
+
+static void stack_trie_mark(void *ptr);
+static void stack_trie_compact(void *ptr);
+static void stack_trie_free(void *ptr);
+static size_t stack_trie_memsize(const void *ptr);
+static const rb_data_type_t stack_trie_type = {
+    .wrap_struct_name = "backtracie_stack_trie",
+    .function = {.dmark = stack_trie_mark,
+                 .dfree = stack_trie_free,
+                 .dsize = stack_trie_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = stack_trie_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    // This is safe, because our free function does not do anything which could
+    // yield the GVL.
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_init_stack_trie(VALUE module) {
+  backtracie_module = module;
+  rb_global_variable(&backtracie_module);
+  backtracie_stack_trie_class =
+      rb_define_class_under(module, "StackTrie", rb_cObject);
+  rb_global_variable(&backtracie_stack_trie_class);
+  rb_define_alloc_func(backtracie_stack_trie_class, stack_trie_alloc);
+
+  rb_define_method(backtracie_stack_trie_class, "initialize",
+                   stack_trie_initialize, -1);
+  rb_define_method(backtracie_stack_trie_class, "frame_table",
+                   stack_trie_frame_table, 0);
+  rb_define_method(backtracie_stack_trie_class, "size", stack_trie_size, 0);
+  rb_define_method(backtracie_stack_trie_class, "insert", stack_trie_insert,
+                   1);
+  rb_define_method(backtracie_stack_trie_class, "capture", stack_trie_capture,
+                   1);
+  rb_define_method(backtracie_stack_trie_class, "count", stack_trie_count, 1);
+  rb_define_method(backtracie_stack_trie_class, "total_count",
+                   stack_trie_total_count, 1);
+  rb_define_method(backtracie_stack_trie_class, "parent", stack_trie_parent,
+                   1);
+  rb_define_method(backtracie_stack_trie_class, "frame_ids",
+                   stack_trie_frame_ids, 1);
+  rb_define_method(backtracie_stack_trie_class, "locations",
+                   stack_trie_locations, 1);
+  rb_define_private_method(backtracie_stack_trie_class, "encode_pprof",
+                           stack_trie_encode_pprof, 2);
+}
+
+VALUE backtracie_stack_trie_new(VALUE frame_table) {
+  VALUE trie = stack_trie_alloc(backtracie_stack_trie_class);
+  stack_trie_init(trie, frame_table);
+  return trie;
+}
+
+uint32_t backtracie_stack_trie_insert(VALUE trie, const uint32_t *frame_ids,
+                                      int len) {
+  stack_trie_t *stack_trie = get_stack_trie(trie);
+  uint32_t frame_table_size =
+      backtracie_frame_table_size(stack_trie->frame_table);
+  for (int i = 0; i < len; i++) {
+    if (frame_ids[i] >= frame_table_size) {
+      rb_raise(rb_eIndexError, "unknown frame id %u (frame table size %u)",
+               frame_ids[i], frame_table_size);
+    }
+  }
+  stack_trie_reserve(stack_trie, (uint32_t)len);
+
+  // Frames are ordered from the top of the stack, but the trie starts at the
+  // bottom
+  uint32_t node = 0;
+  stack_trie->nodes[0].total_count++;
+  for (int i = len - 1; i >= 0; i--) {
+    node = stack_trie_child(stack_trie, node, frame_ids[i]);
+    stack_trie->nodes[node].total_count++;
+  }
+  stack_trie->nodes[node].self_count++;
+
+  return node;
+}
+
+int backtracie_stack_trie_frame_ids(VALUE trie, uint32_t node, uint32_t *out,
+                                    int max) {
+  stack_trie_t *stack_trie = get_stack_trie(trie);
+  if (node >= stack_trie->nodes_len) {
+    return 0;
+  }
+
+  int written = 0;
+  for (; node != 0 && written < max;
+       node = stack_trie->nodes[node].parent, written++) {
+    out[written] = stack_trie->nodes[node].frame_id;
+  }
+  return written;
+}
+
+VALUE backtracie_stack_trie_frame_table(VALUE trie) {
+  return get_stack_trie(trie)->frame_table;
+}
+
+uint32_t backtracie_stack_trie_size(VALUE trie) {
+  return get_stack_trie(trie)->nodes_len;
+}
+
+uint64_t backtracie_stack_trie_count(VALUE trie, uint32_t node) {
+  stack_trie_t *stack_trie = get_stack_trie(trie);
+  return node < stack_trie->nodes_len ? stack_trie->nodes[node].self_count : 0;
+}
+
+int backtracie_stack_trie_depth(VALUE trie, uint32_t node) {
+  stack_trie_t *stack_trie = get_stack_trie(trie);
+  return node < stack_trie->nodes_len ? (int)stack_trie->nodes[node].depth : 0;
+}
+
+static VALUE stack_trie_alloc(VALUE klass) {
+  stack_trie_t *trie;
+  VALUE wrapper =
+      TypedData_Make_Struct(klass, stack_trie_t, &stack_trie_type, trie);
+  trie->frame_table = Qnil;
+  trie->nodes_capa = STACK_TRIE_INITIAL_CAPA;
+  trie->nodes = ZALLOC_N(stack_trie_node_t, trie->nodes_capa);
+  // The root node
+  trie->nodes_len = 1;
+  trie->slots_capa = STACK_TRIE_INITIAL_CAPA * 4;
+  trie->slots = ZALLOC_N(uint32_t, trie->slots_capa);
+  return wrapper;
+}
+
+static stack_trie_t *get_stack_trie(VALUE trie) {
+  stack_trie_t *stack_trie;
+  TypedData_Get_Struct(trie, stack_trie_t, &stack_trie_type, stack_trie);
+  if (stack_trie->frame_table == Qnil) {
+    rb_raise(rb_eRuntimeError, "uninitialized Backtracie::StackTrie");
+  }
+  return stack_trie;
+}
+
+static void stack_trie_init(VALUE trie, VALUE frame_table) {
+  // Raises if frame_table is not actually a frame table
+  backtracie_frame_table_size(frame_table);
+
+  stack_trie_t *stack_trie;
+  TypedData_Get_Struct(trie, stack_trie_t, &stack_trie_type, stack_trie);
+  // Nodes refer to frame ids of their frame table, so it can't be replaced
+  if (stack_trie->frame_table != Qnil) {
+    rb_raise(rb_eRuntimeError, "Backtracie::StackTrie already initialized");
+  }
+  RB_OBJ_WRITE(trie, &stack_trie->frame_table, frame_table);
+}
+
+// Makes sure count more nodes can be added without needing to allocate
+static void stack_trie_reserve(stack_trie_t *trie, uint32_t count) {
+  if (count > UINT32_MAX / 4 - trie->nodes_len) {
+    rb_raise(rb_eRangeError, "backtracie stack trie is full");
+  }
+  uint32_t needed = trie->nodes_len + count;
+  if (needed <= trie->nodes_capa) {
+    return;
+  }
+
+  uint32_t new_capa = trie->nodes_capa;
+  while (new_capa < needed) {
+    new_capa = new_capa > UINT32_MAX / 8 ? needed : new_capa * 2;
+  }
+  uint32_t new_slots_capa = trie->slots_capa;
+  while (new_slots_capa <= new_capa * 2) {
+    new_slots_capa *= 2;
+  }
+
+  REALLOC_N(trie->nodes, stack_trie_node_t, new_capa);
+  trie->nodes_capa = new_capa;
+  if (new_slots_capa != trie->slots_capa) {
+    uint32_t *new_slots = ZALLOC_N(uint32_t, new_slots_capa);
+    xfree(trie->slots);
+    trie->slots = new_slots;
+    trie->slots_capa = new_slots_capa;
+    for (uint32_t node = 1; node < trie->nodes_len; node++) {
+      uint32_t slot = stack_trie_find_slot(trie, trie->nodes[node].parent,
+                                           trie->nodes[node].frame_id);
+      trie->slots[slot] = node + 1;
+    }
+  }
+}
+
+// Returns the child of parent for frame_id, creating it if needed. Must only
+// be called when there's capacity for (at least) one more node.
+static uint32_t stack_trie_child(stack_trie_t *trie, uint32_t parent,
+                                 uint32_t frame_id) {
+  uint32_t slot = stack_trie_find_slot(trie, parent, frame_id);
+  if (trie->slots[slot] != 0) {
+    return trie->slots[slot] - 1;
+  }
+
+  uint32_t node = trie->nodes_len++;
+  trie->nodes[node] = (stack_trie_node_t){
+      .parent = parent,
+      .frame_id = frame_id,
+      .depth = trie->nodes[parent].depth + 1,
+      .self_count = 0,
+      .total_count = 0,
+  };
+  trie->slots[slot] = node + 1;
+  return node;
+}
+
+// Returns either the slot with the matching node, or the empty slot where it
+// should be inserted
+static uint32_t stack_trie_find_slot(const stack_trie_t *trie, uint32_t parent,
+                                     uint32_t frame_id) {
+  uint32_t mask = trie->slots_capa - 1;
+  uint32_t slot = (uint32_t)backtracie_hash_mix(parent, frame_id) & mask;
+
+  while (trie->slots[slot] != 0) {
+    const stack_trie_node_t *node = &trie->nodes[trie->slots[slot] - 1];
+    if (node->parent == parent && node->frame_id == frame_id) {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static uint32_t get_node(const stack_trie_t *trie, VALUE node) {
+  unsigned long node_id = NUM2ULONG(node);
+  if (node_id >= trie->nodes_len) {
+    rb_raise(rb_eIndexError, "unknown node %lu (stack trie size %u)", node_id,
+             trie->nodes_len);
+  }
+  return (uint32_t)node_id;
+}
+
+static VALUE stack_trie_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE frame_table;
+  rb_scan_args(argc, argv, "01", &frame_table);
+
+  stack_trie_init(self, NIL_P(frame_table) ? backtracie_frame_table_new()
+                                           : frame_table);
+  return self;
+}
+
+static VALUE stack_trie_frame_table(VALUE self) {
+  return backtracie_stack_trie_frame_table(self);
+}
+
+static VALUE stack_trie_size(VALUE self) {
+  return UINT2NUM(get_stack_trie(self)->nodes_len);
+}
+
+// Inserts the given frame ids (ordered like a backtrace, e.g. as returned by
+// Backtracie::FrameTable#backtrace_ids), and returns the node for the stack
+static VALUE stack_trie_insert(VALUE self, VALUE ids) {
+  Check_Type(ids, T_ARRAY);
+  long ids_len = RARRAY_LEN(ids);
+  if (ids_len > INT_MAX) {
+    rb_raise(rb_eArgError, "stack is too deep");
+  }
+
+  VALUE frame_ids_buffer;
+  uint32_t *frame_ids = ALLOCV_N(uint32_t, frame_ids_buffer, ids_len);
+  for (long i = 0; i < ids_len; i++) {
+    frame_ids[i] = NUM2UINT(RARRAY_AREF(ids, i));
+  }
+
+  uint32_t node = backtracie_stack_trie_insert(self, frame_ids, (int)ids_len);
+
+  ALLOCV_END(frame_ids_buffer);
+  return UINT2NUM(node);
+}
+
+// Same as insert(frame_table.backtrace_ids(thread)), but without going through
+// a Ruby array. Returns nil if the thread is dead.
+static VALUE stack_trie_capture(VALUE self, VALUE thread) {
+  VALUE frame_table = backtracie_stack_trie_frame_table(self);
+  rb_funcall(backtracie_module, rb_intern("ensure_object_is_thread"), 1,
+             thread);
+  if (!backtracie_is_thread_alive(thread)) {
+    return Qnil;
+  }
+
+  int max_frame_count = backtracie_frame_count_for_thread(thread);
+  VALUE frame_ids_buffer;
+  uint32_t *frame_ids = ALLOCV_N(uint32_t, frame_ids_buffer, max_frame_count);
+
+  int frame_ids_len = backtracie_frame_table_capture_frames_for_thread(
+      frame_table, thread, 0, max_frame_count, frame_ids);
+  uint32_t node = backtracie_stack_trie_insert(self, frame_ids, frame_ids_len);
+
+  ALLOCV_END(frame_ids_buffer);
+  return UINT2NUM(node);
+}
+
+static VALUE stack_trie_count(VALUE self, VALUE node) {
+  stack_trie_t *trie = get_stack_trie(self);
+  return ULL2NUM(trie->nodes[get_node(trie, node)].self_count);
+}
+
+static VALUE stack_trie_total_count(VALUE self, VALUE node) {
+  stack_trie_t *trie = get_stack_trie(self);
+  return ULL2NUM(trie->nodes[get_node(trie, node)].total_count);
+}
+
+static VALUE stack_trie_parent(VALUE self, VALUE node) {
+  stack_trie_t *trie = get_stack_trie(self);
+  uint32_t node_id = get_node(trie, node);
+  return node_id == 0 ? Qnil : UINT2NUM(trie->nodes[node_id].parent);
+}
+
+// Walks the given node back to the root, returning the frame ids for its stack
+// (ordered like a backtrace)
+static VALUE stack_trie_frame_ids(VALUE self, VALUE node) {
+  stack_trie_t *trie = get_stack_trie(self);
+  uint32_t node_id = get_node(trie, node);
+
+  VALUE rb_ids = rb_ary_new_capa(trie->nodes[node_id].depth);
+  for (; node_id != 0; node_id = trie->nodes[node_id].parent) {
+    rb_ary_push(rb_ids, UINT2NUM(trie->nodes[node_id].frame_id));
+  }
+  return rb_ids;
+}
+
+static VALUE stack_trie_locations(VALUE self, VALUE node) {
+  return rb_funcall(backtracie_stack_trie_frame_table(self),
+                    rb_intern("locations"), 1,
+                    stack_trie_frame_ids(self, node));
+}
+
+// Returns an (uncompressed) pprof profile with a sample for every node that
+// had stacks inserted ending at it, using the node's count as the value
+static VALUE stack_trie_encode_pprof(VALUE self, VALUE sample_type,
+                                     VALUE sample_unit) {
+  stack_trie_t *trie = get_stack_trie(self);
+  VALUE frame_table = trie->frame_table;
+  VALUE pprof = backtracie_pprof_new(StringValueCStr(sample_type),
+                                     StringValueCStr(sample_unit));
+
+  uint32_t max_depth = 0;
+  for (uint32_t i = 1; i < trie->nodes_len; i++) {
+    if (trie->nodes[i].depth > max_depth) {
+      max_depth = trie->nodes[i].depth;
+    }
+  }
+
+  // Every frame gets turned into a pprof location only once, and is then
+  // looked up by its frame id
+  uint32_t frame_table_size = backtracie_frame_table_size(frame_table);
+  VALUE location_ids_by_frame_buffer;
+  uint64_t *location_ids_by_frame =
+      ALLOCV_N(uint64_t, location_ids_by_frame_buffer, frame_table_size);
+  memset(location_ids_by_frame, 0, sizeof(uint64_t) * frame_table_size);
+  VALUE location_ids_buffer;
+  uint64_t *location_ids = ALLOCV_N(uint64_t, location_ids_buffer, max_depth);
+
+  for (uint32_t i = 1; i < trie->nodes_len; i++) {
+    if (trie->nodes[i].self_count == 0) {
+      continue;
+    }
+
+    int depth = 0;
+    for (uint32_t node_id = i; node_id != 0;
+         node_id = trie->nodes[node_id].parent) {
+      uint32_t frame_id = trie->nodes[node_id].frame_id;
+      if (frame_id >= frame_table_size) {
+        rb_raise(rb_eIndexError, "unknown frame id %u (frame table size %u)",
+                 frame_id, frame_table_size);
+      }
+      if (location_ids_by_frame[frame_id] == 0) {
+        location_ids_by_frame[frame_id] = backtracie_pprof_raw_location_id(
+            pprof, backtracie_frame_table_get(frame_table, frame_id));
+      }
+      location_ids[depth++] = location_ids_by_frame[frame_id];
+    }
+    backtracie_pprof_add_sample(pprof, location_ids, depth,
+                                (int64_t)trie->nodes[i].self_count);
+  }
+
+  VALUE result = backtracie_pprof_encode(pprof);
+
+  ALLOCV_END(location_ids_by_frame_buffer);
+  ALLOCV_END(location_ids_buffer);
+  RB_GC_GUARD(pprof);
+  return result;
+}
+
+static void stack_trie_mark(void *ptr) {
+  stack_trie_t *trie = (stack_trie_t *)ptr;
+  // The nodes only reference frames via their ids, so marking the frame table
+  // marks every frame referenced by the trie
+#ifdef PRE_GC_MARK_MOVABLE
+  rb_gc_mark(trie->frame_table);
+#else
+  rb_gc_mark_movable(trie->frame_table);
+#endif
+}
+
+static void stack_trie_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  stack_trie_t *trie = (stack_trie_t *)ptr;
+  trie->frame_table = rb_gc_location(trie->frame_table);
+#endif
+}
+
+static void stack_trie_free(void *ptr) {
+  stack_trie_t *trie = (stack_trie_t *)ptr;
+  xfree(trie->nodes);
+  xfree(trie->slots);
+  xfree(trie);
+}
+
+static size_t stack_trie_memsize(const void *ptr) {
+  const stack_trie_t *trie = (const stack_trie_t *)ptr;
+  return sizeof(stack_trie_t) + sizeof(stack_trie_node_t) * trie->nodes_capa +
+         sizeof(uint32_t) * trie->slots_capa;
+}
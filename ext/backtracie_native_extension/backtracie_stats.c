@@ -0,0 +1,123 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "backtracie_private.h"
+
+// Every counter gets updated with relaxed atomic operations: we only want the
+// totals to be correct, not to order anything else around them, so this is
+// about as cheap as a plain increment (and never takes a lock).
+
+#define STATS_FIELD(name) {#name, offsetof(backtracie_stats_t, name)}
+
+static const struct {
+  const char *name;
+  size_t offset;
+} stats_fields[] = {
+    STATS_FIELD(frames_walked),
+    STATS_FIELD(valid_frames),
+    STATS_FIELD(skipped_frames),
+    STATS_FIELD(captures_caller_locations),
+    STATS_FIELD(captures_backtrace_locations),
+    STATS_FIELD(captures_caller_location),
+    STATS_FIELD(captures_all_thread_backtraces),
+    STATS_FIELD(captures_frame_for_thread),
+    STATS_FIELD(captures_frames_for_thread),
+    STATS_FIELD(captures_all_threads),
+    STATS_FIELD(captures_caller_frame),
+    STATS_FIELD(strings_interned),
+    STATS_FIELD(strbuilder_grows),
+    STATS_FIELD(line_number_cache_hits),
+    STATS_FIELD(line_number_cache_misses),
+    STATS_FIELD(class_name_cache_hits),
+    STATS_FIELD(class_name_cache_misses),
+    STATS_FIELD(capture_ns),
+    STATS_FIELD(symbolization_ns),
+};
+
+#define STATS_FIELDS_LEN ((int)(sizeof(stats_fields) / sizeof(stats_fields[0])))
+
+#ifndef BACKTRACIE_DISABLE_STATS
+// non-static, updated via the BACKTRACIE_STATS_* macros
+backtracie_stats_t backtracie_stats = {0};
+#endif
+
+static VALUE stats(VALUE self);
+static VALUE reset_stats(VALUE self);
+
+void backtracie_init_stats(VALUE backtracie_module) {
+  rb_define_module_function(backtracie_module, "stats", stats, 0);
+  rb_define_module_function(backtracie_module, "reset_stats", reset_stats, 0);
+}
+
+bool backtracie_stats_enabled(void) {
+#ifndef BACKTRACIE_DISABLE_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+void backtracie_stats_get(backtracie_stats_t *out) {
+#ifndef BACKTRACIE_DISABLE_STATS
+  for (int i = 0; i < STATS_FIELDS_LEN; i++) {
+    uint64_t *counter =
+        (uint64_t *)((char *)&backtracie_stats + stats_fields[i].offset);
+    *(uint64_t *)((char *)out + stats_fields[i].offset) =
+        __atomic_load_n(counter, __ATOMIC_RELAXED);
+  }
+#else
+  MEMZERO(out, backtracie_stats_t, 1);
+#endif
+}
+
+void backtracie_stats_reset(void) {
+#ifndef BACKTRACIE_DISABLE_STATS
+  for (int i = 0; i < STATS_FIELDS_LEN; i++) {
+    uint64_t *counter =
+        (uint64_t *)((char *)&backtracie_stats + stats_fields[i].offset);
+    __atomic_store_n(counter, 0, __ATOMIC_RELAXED);
+  }
+#endif
+}
+
+// Backtracie.stats => {enabled: true, frames_walked: ..., ...}
+static VALUE stats(VALUE self) {
+  backtracie_stats_t current;
+  backtracie_stats_get(&current);
+
+  VALUE result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("enabled")),
+               backtracie_stats_enabled() ? Qtrue : Qfalse);
+  for (int i = 0; i < STATS_FIELDS_LEN; i++) {
+    uint64_t value =
+        *(uint64_t *)((char *)&current + stats_fields[i].offset);
+    rb_hash_aset(result, ID2SYM(rb_intern(stats_fields[i].name)),
+                 ULL2NUM(value));
+  }
+  return result;
+}
+
+static VALUE reset_stats(VALUE self) {
+  backtracie_stats_reset();
+  return Qnil;
+}
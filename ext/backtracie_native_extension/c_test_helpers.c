@@ -3,6 +3,8 @@
 
 #include <ruby.h>
 #include <ruby/thread.h>
+#include <signal.h>
+#include <sys/time.h>
 
 static VALUE backtracie_backtrace_from_thread(VALUE self);
 static VALUE backtracie_backtrace_from_thread_cthread(void *ctx);
@@ -10,6 +12,13 @@ static VALUE stdlib_backtrace_from_thread(VALUE self);
 static VALUE stdlib_backtrace_from_thread_cthread(void *ctx);
 static VALUE backtracie_backtrace_from_empty_thread(VALUE self);
 static VALUE backtracie_backtrace_from_empty_thread_cthread(void *ctx);
+static VALUE minimal_frames_surviving_gc(VALUE self);
+static VALUE ring_buffer_new(VALUE self, VALUE capacity, VALUE max_depth);
+static VALUE ring_buffer_capture(VALUE self, VALUE ring_buffer);
+static VALUE ring_buffer_capture_without_gvl(VALUE self, VALUE ring_buffer);
+static VALUE ring_buffer_drain(VALUE self, VALUE ring_buffer);
+static VALUE ring_buffer_dropped(VALUE self, VALUE ring_buffer);
+static VALUE ring_buffer_capture_on_sigprof(VALUE self, VALUE ring_buffer);
 
 void backtracie_init_c_test_helpers(VALUE backtracie_module) {
   VALUE test_helpers_mod =
@@ -22,6 +31,21 @@ void backtracie_init_c_test_helpers(VALUE backtracie_module) {
   rb_define_singleton_method(test_helpers_mod,
                              "backtracie_backtrace_from_empty_thread",
                              backtracie_backtrace_from_empty_thread, 0);
+  rb_define_singleton_method(test_helpers_mod, "minimal_frames_surviving_gc",
+                             minimal_frames_surviving_gc, 0);
+  rb_define_singleton_method(test_helpers_mod, "ring_buffer_new",
+                             ring_buffer_new, 2);
+  rb_define_singleton_method(test_helpers_mod, "ring_buffer_capture",
+                             ring_buffer_capture, 1);
+  rb_define_singleton_method(test_helpers_mod,
+                             "ring_buffer_capture_without_gvl",
+                             ring_buffer_capture_without_gvl, 1);
+  rb_define_singleton_method(test_helpers_mod, "ring_buffer_drain",
+                             ring_buffer_drain, 1);
+  rb_define_singleton_method(test_helpers_mod, "ring_buffer_dropped",
+                             ring_buffer_dropped, 1);
+  rb_define_singleton_method(test_helpers_mod, "ring_buffer_capture_on_sigprof",
+                             ring_buffer_capture_on_sigprof, 1);
 }
 
 static VALUE backtracie_backtrace_from_thread(VALUE self) {
@@ -60,3 +84,131 @@ static VALUE backtracie_backtrace_from_empty_thread_cthread(void *ctx) {
   rb_thread_sleep(-1);
   return Qnil;
 }
+
+// Captures the current thread's stack into a minimal frame wrapper, then runs
+// the GC (compacting, if available) before returning
+// [[qualified_method_name, path, lineno], ...] for every frame
+static VALUE minimal_frames_surviving_gc(VALUE self) {
+  VALUE thread = rb_thread_current();
+  int max_frame_count = backtracie_frame_count_for_thread(thread);
+  VALUE wrapper = backtracie_minimal_frame_wrapper_new(max_frame_count);
+  *backtracie_minimal_frame_wrapper_len(wrapper) =
+      backtracie_capture_minimal_frames_for_thread(
+          thread, 0, max_frame_count,
+          backtracie_minimal_frame_wrapper_frames(wrapper));
+
+  VALUE gc_module = rb_const_get(rb_cObject, rb_intern("GC"));
+  if (rb_respond_to(gc_module, rb_intern("compact"))) {
+    rb_funcall(gc_module, rb_intern("compact"), 0);
+  }
+  rb_gc_start();
+
+  minimal_location_t *frames = backtracie_minimal_frame_wrapper_frames(wrapper);
+  int len = *backtracie_minimal_frame_wrapper_len(wrapper);
+  VALUE result = rb_ary_new_capa(len);
+  for (int i = 0; i < len; i++) {
+    char name[512];
+    backtracie_minimal_frame_name_cstr(&frames[i], name, sizeof(name));
+    char path[512];
+    size_t path_len =
+        backtracie_minimal_frame_filename_cstr(&frames[i], path, sizeof(path));
+    rb_ary_push(result, rb_ary_new_from_args(
+                            3, rb_str_new_cstr(name),
+                            path_len == 0 ? Qnil : rb_str_new_cstr(path),
+                            UINT2NUM(frames[i].line_number)));
+  }
+
+  RB_GC_GUARD(wrapper);
+  return result;
+}
+
+static VALUE ring_buffer_new(VALUE self, VALUE capacity, VALUE max_depth) {
+  return backtracie_ring_buffer_new(NUM2INT(capacity), NUM2INT(max_depth));
+}
+
+static VALUE ring_buffer_capture(VALUE self, VALUE ring_buffer) {
+  return backtracie_ring_buffer_capture(backtracie_ring_buffer_get(ring_buffer))
+             ? Qtrue
+             : Qfalse;
+}
+
+static void *capture_without_gvl(void *ring_buffer) {
+  return backtracie_ring_buffer_capture(
+             (backtracie_ring_buffer_t *)ring_buffer)
+             ? ring_buffer
+             : NULL;
+}
+
+// Like ring_buffer_capture, but while not holding the GVL (as happens when a
+// signal handler runs on a thread that's waiting on I/O)
+static VALUE ring_buffer_capture_without_gvl(VALUE self, VALUE ring_buffer) {
+  return rb_thread_call_without_gvl(capture_without_gvl,
+                                    backtracie_ring_buffer_get(ring_buffer),
+                                    NULL, NULL) != NULL
+             ? Qtrue
+             : Qfalse;
+}
+
+// Returns [thread, [qualified_method_name, ...]] for the oldest stack in the
+// ring buffer, or nil if it's empty
+static VALUE ring_buffer_drain(VALUE self, VALUE ring_buffer) {
+  int max_frames = 1024;
+  // The frame wrapper keeps the frames alive while we get their names
+  VALUE wrapper = backtracie_frame_wrapper_new(max_frames);
+  raw_location *frames = backtracie_frame_wrapper_frames(wrapper);
+  VALUE thread = Qnil;
+  int len =
+      backtracie_ring_buffer_drain(ring_buffer, &thread, frames, max_frames);
+  if (len < 0) {
+    return Qnil;
+  }
+  *backtracie_frame_wrapper_len(wrapper) = len;
+
+  VALUE names = rb_ary_new_capa(len);
+  for (int i = 0; i < len; i++) {
+    rb_ary_push(names, backtracie_frame_name_rbstr(&frames[i]));
+  }
+
+  RB_GC_GUARD(wrapper);
+  return rb_ary_new_from_args(2, thread, names);
+}
+
+static VALUE ring_buffer_dropped(VALUE self, VALUE ring_buffer) {
+  return ULL2NUM(backtracie_ring_buffer_dropped(ring_buffer));
+}
+
+#if defined(SIGPROF) && defined(ITIMER_PROF)
+static backtracie_ring_buffer_t *sigprof_ring_buffer = NULL;
+
+static void handle_sigprof(int signal) {
+  backtracie_ring_buffer_capture(sigprof_ring_buffer);
+}
+
+static VALUE stop_sigprof(VALUE unused) {
+  struct itimerval timer = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+  return Qnil;
+}
+
+// Yields, while capturing the stack of the current thread into the ring buffer
+// every 1ms of CPU time (from a SIGPROF signal handler)
+static VALUE ring_buffer_capture_on_sigprof(VALUE self, VALUE ring_buffer) {
+  sigprof_ring_buffer = backtracie_ring_buffer_get(ring_buffer);
+
+  struct sigaction action;
+  action.sa_handler = handle_sigprof;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, NULL);
+
+  struct itimerval timer = {{0, 1000}, {0, 1000}};
+  setitimer(ITIMER_PROF, &timer, NULL);
+
+  return rb_ensure(rb_yield, Qnil, stop_sigprof, Qnil);
+}
+#else
+static VALUE ring_buffer_capture_on_sigprof(VALUE self, VALUE ring_buffer) {
+  rb_raise(rb_eNotImpError, "SIGPROF is not available");
+}
+#endif
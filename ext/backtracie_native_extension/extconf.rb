@@ -46,6 +46,17 @@ $CFLAGS << " " << "-DPRE_RB_ISEQ_TYPE" if RUBY_VERSION < "3.2"
 
 $CFLAGS << " " << "-DPRE_GC_MARK_MOVABLE" if RUBY_VERSION < "2.7"
 
+# rb_interned_str and rb_str_to_interned_str were only added on Ruby 3.0
+$CFLAGS << " " << "-DPRE_RB_INTERNED_STR" if RUBY_VERSION < "3.0"
+# String#-@ only started returning deduplicated strings on Ruby 2.5
+$CFLAGS << " " << "-DPRE_STR_UMINUS_DEDUP" if RUBY_VERSION < "2.5"
+
+# Ruby 3.0 moved the list of living threads from the VM to each ractor; Ruby 3.2 renamed the list macros.
+$CFLAGS << " " << "-DPRE_RACTOR" if RUBY_VERSION < "3.0"
+$CFLAGS << " " << "-DPRE_CCAN_LIST" if RUBY_VERSION < "3.2"
+# Ruby 3.2 replaced the GVL of each ractor with a thread scheduler
+$CFLAGS << " " << "-DPRE_THREAD_SCHED" if RUBY_VERSION < "3.2"
+
 # Older Rubies don't have the MJIT header, see below for details
 $defs << "-DPRE_MJIT_RUBY" if RUBY_VERSION < "2.6"
 
@@ -59,6 +70,9 @@ if RUBY_VERSION < "2.4"
   $CFLAGS << " " << "-DPRE_VM_ENV_RENAMES" # Flag that it's a really old Ruby, and a few constants were since renamed
 end
 
+# Backtracie.stats counters are cheap, but can still be removed entirely by building with BACKTRACIE_DISABLE_STATS=true
+$CFLAGS << " " << "-DBACKTRACIE_DISABLE_STATS" if ENV["BACKTRACIE_DISABLE_STATS"] == "true"
+
 $CFLAGS << " " << "-DBACKTRACIE_EXPORTS"
 append_cflags ["-fvisibility=hidden"]
 create_header
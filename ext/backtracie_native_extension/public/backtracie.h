@@ -104,6 +104,90 @@ BACKTRACIE_API int backtracie_frame_count_for_thread(VALUE thread);
 BACKTRACIE_API
 bool backtracie_capture_frame_for_thread(VALUE thread, int frame_index,
                                          raw_location *loc);
+// Captures several frames from the Ruby call stack of the given thread in a
+// single pass, which is a lot cheaper than calling
+// backtracie_capture_frame_for_thread() once per frame index.
+//
+// Unlike backtracie_capture_frame_for_thread(), only valid frames are ever
+// considered: the first start valid frames (counting from the frame closest to
+// where execution is now) are skipped, and then up to max valid frames are
+// written, in order, to out[0], out[1], ...
+//
+// Returns the number of frames written to out (which will be 0 if the thread
+// is dead). out must have space for at least max frames; passing
+// backtracie_frame_count_for_thread(thread) as max is always enough to capture
+// the full stack.
+//
+// The intended usage of this API looks something like this:
+//
+//   VALUE thread = rb_thread_current();
+//   int max_frame_count = backtracie_frame_count_for_thread(thread);
+//   raw_location *locs = xcalloc(max_frame_count, sizeof(raw_location));
+//   int frame_counter =
+//       backtracie_capture_frames_for_thread(thread, 0, max_frame_count, locs);
+BACKTRACIE_API
+int backtracie_capture_frames_for_thread(VALUE thread, int start, int max,
+                                         raw_location *out);
+// Same as backtracie_capture_frames_for_thread(), but also writes the
+// fingerprint of the captured frames (see backtracie_frames_fingerprint()) to
+// fingerprint, if it's not NULL.
+BACKTRACIE_API
+int backtracie_capture_frames_for_thread_fingerprint(VALUE thread, int start,
+                                                     int max,
+                                                     raw_location *out,
+                                                     uint64_t *fingerprint);
+// Returns a 64-bit fingerprint of the given frames, so that stacks can be
+// compared or grouped without creating any strings: two stacks with the same
+// path, label and line number (and method and module name, if any) at every
+// frame get the same fingerprint. C frames are identified by their method and
+// module names only.
+//
+// Only the contents of these names get hashed, so fingerprints are the same
+// across processes (running the same code on the same Ruby version), and are
+// not affected by the GC compacting the heap.
+BACKTRACIE_API
+uint64_t backtracie_frames_fingerprint(const raw_location *frames, int len);
+// Returns the number of alive threads (of the current ractor). If frame_count is
+// not NULL, it gets set to the sum of backtracie_frame_count_for_thread() for
+// all of them, which is always enough to capture the stacks of every thread
+// with backtracie_capture_all_threads().
+BACKTRACIE_API
+int backtracie_all_threads_count(int *frame_count);
+// Captures the stacks of every alive thread (of the current ractor) in a single
+// pass over the VM's list of threads. Because this never releases the GVL, the
+// result is a consistent snapshot of what every thread was doing.
+//
+// For each thread, the thread is written to threads_out[i] and the number of
+// frames captured for it to frames_len_out[i]. The frames themselves are
+// written to frames_out, one thread after the other (in the same order as
+// threads_out). At most max_threads threads and max_frames frames (in total)
+// are captured; stacks that don't fit get cut short.
+//
+// Returns the number of threads written to threads_out.
+//
+// The intended usage of this API looks something like this:
+//
+//   int max_frames;
+//   int max_threads = backtracie_all_threads_count(&max_frames);
+//   VALUE *threads = xcalloc(max_threads, sizeof(VALUE));
+//   int *frames_len = xcalloc(max_threads, sizeof(int));
+//   raw_location *frames = xcalloc(max_frames, sizeof(raw_location));
+//   int thread_count = backtracie_capture_all_threads(
+//       threads, frames_len, max_threads, frames, max_frames);
+BACKTRACIE_API
+int backtracie_capture_all_threads(VALUE *threads_out, int *frames_len_out,
+                                   int max_threads, raw_location *frames_out,
+                                   int max_frames);
+// Captures the depth-th valid frame from the Ruby call stack of the current
+// thread, where depth 0 is the frame closest to where execution is now (e.g.
+// the C function calling this one), 1 is its caller, and so on.
+//
+// The stack is only walked as far as needed, and no memory besides loc is
+// needed, so this is the cheapest way to answer "who called me?".
+//
+// Returns false if the stack does not have that many valid frames.
+BACKTRACIE_API
+bool backtracie_capture_caller_frame(int depth, raw_location *loc);
 // Get the "qualified method name" for the frame. This is a string that best
 // describes what method is being called, intended for human interpretation.
 // Writes a NULL-term'd string of at most buflen chars (including NULL
@@ -115,7 +199,8 @@ BACKTRACIE_API
 size_t backtracie_frame_name_cstr(const raw_location *loc, char *buf,
                                   size_t buflen);
 // Like backtracie_frame_name_cstr, but will allocate memory to ensure that
-// there is no truncation of the method name; returns a Ruby string.
+// there is no truncation of the method name; returns a frozen, interned Ruby
+// string (so identical names share a single string).
 BACKTRACIE_API
 VALUE backtracie_frame_name_rbstr(const raw_location *loc);
 // Returns the filename of the source file for this backtrace location. Has the
@@ -128,9 +213,9 @@ VALUE backtracie_frame_name_rbstr(const raw_location *loc);
 BACKTRACIE_API
 size_t backtracie_frame_filename_cstr(const raw_location *loc, bool absolute,
                                       char *buf, size_t buflen);
-// Like backtracie_frame_filename_cstr, but returns a Ruby string. Will allocate
-// memory to ensure there is no truncation. Returns Qnil if there is no
-// filename.
+// Like backtracie_frame_filename_cstr, but returns a frozen Ruby string. This is
+// usually the iseq's own (interned) path string, so nothing gets copied.
+// Returns Qnil if there is no filename.
 BACKTRACIE_API
 VALUE backtracie_frame_filename_rbstr(const raw_location *loc, bool absolute);
 
@@ -143,7 +228,8 @@ int backtracie_frame_line_number(const raw_location *loc);
 BACKTRACIE_API
 size_t backtracie_frame_label_cstr(const raw_location *loc, bool base,
                                    char *buf, size_t buflen);
-// Like backtracie_frame_label_cstr, but returns a ruby string.
+// Like backtracie_frame_label_cstr, but returns a frozen ruby string. As with
+// backtracie_frame_filename_rbstr, this usually doesn't copy anything.
 BACKTRACIE_API
 VALUE backtracie_frame_label_rbstr(const raw_location *loc, bool base);
 // Returns a VALUE that can be passed into the rb_profile_frames family of
@@ -176,6 +262,36 @@ raw_location *backtracie_frame_wrapper_frames(VALUE wrapper);
 // contained list of frames (up to capa)
 BACKTRACIE_API
 int *backtracie_frame_wrapper_len(VALUE wrapper);
+// This returns a pointer to the number of "lookahead" frames stored right after
+// the first len frames (len + lookahead_len must not exceed capa). These are
+// not part of the list, but are kept (and marked) so that a list that was cut
+// short still has access to the caller ruby frame of any C frames at its end.
+BACKTRACIE_API
+int *backtracie_frame_wrapper_lookahead_len(VALUE wrapper);
+// Returns how many frames (including lookahead frames) fit in the wrapper
+BACKTRACIE_API
+size_t backtracie_frame_wrapper_capa(VALUE wrapper);
+// Grows the wrapper so that at least capa frames fit in it, keeping the frames
+// it contains. Growth is geometric, so a long-lived wrapper which keeps on
+// getting reserved for slightly deeper stacks only gets reallocated a few
+// times. NOTE - this invalidates any pointer previously returned by
+// backtracie_frame_wrapper_frames().
+BACKTRACIE_API
+void backtracie_frame_wrapper_reserve(VALUE wrapper, size_t capa);
+// Empties the wrapper (setting both len and lookahead_len to zero), so it can
+// be reused for another capture. The frames it contained stop being marked.
+//
+// Together with backtracie_frame_wrapper_reserve(), this allows C callers to
+// keep a single wrapper around rather than creating one per capture:
+//
+//   backtracie_frame_wrapper_clear(wrapper);
+//   backtracie_frame_wrapper_reserve(wrapper, max_frame_count);
+//   *backtracie_frame_wrapper_len(wrapper) =
+//       backtracie_capture_frames_for_thread(
+//           thread, 0, max_frame_count,
+//           backtracie_frame_wrapper_frames(wrapper));
+BACKTRACIE_API
+void backtracie_frame_wrapper_clear(VALUE wrapper);
 
 // ========= "Minimal" API ========
 // This part of the API defines a "minimal" version of raw_location, called
@@ -233,7 +349,8 @@ typedef struct {
     VALUE base_label;
   } method_name;
 
-  // VALUE for the filename (abs), or Qnil
+  // VALUE for the filename (abs, or the relative one if there's no absolute
+  // path, as happens for some evals), or Qnil for cfunc frames
   // Needs to be marked
   VALUE filename;
 
@@ -253,6 +370,13 @@ BACKTRACIE_API
 bool backtracie_capture_minimal_frame_for_thread(VALUE thread, int frame_index,
                                                  minimal_location_t *loc);
 
+// This is like backtracie_capture_frames_for_thread, but captures
+// minimal_location_t's instead of raw_location's.
+BACKTRACIE_API
+int backtracie_capture_minimal_frames_for_thread(VALUE thread, int start,
+                                                 int max,
+                                                 minimal_location_t *out);
+
 // This is like backtracie_frame_name_cstr, but works on a minimal_location_t
 // instead of a raw_location
 BACKTRACIE_API
@@ -265,4 +389,285 @@ size_t backtracie_minimal_frame_name_cstr(const minimal_location_t *loc,
 BACKTRACIE_API
 size_t backtracie_minimal_frame_filename_cstr(const minimal_location_t *loc,
                                               char *buf, size_t buflen);
+
+// Marks the contained ruby objects (only the ones actually in use, as per the
+// method_name_contents flag); for use when you want to persist the
+// minimal_location_t beyond the current call stack.
+BACKTRACIE_API
+void backtracie_minimal_frame_mark(const minimal_location_t *loc);
+// Like backtracie_minimal_frame_mark, but calls rb_gc_mark_movable if
+// available.
+BACKTRACIE_API
+void backtracie_minimal_frame_mark_movable(const minimal_location_t *loc);
+// Updates *loc's VALUEs to point to possibly-moved locations
+BACKTRACIE_API
+void backtracie_minimal_frame_compact(minimal_location_t *loc);
+
+// This is the equivalent of backtracie_frame_wrapper_new, for
+// minimal_location_t's: a VALUE that owns an array of minimal frames, and takes
+// care of marking (and compacting) them. The same note about RB_GC_GUARD()
+// applies.
+//
+// The intended usage of this API looks something like this:
+//
+//   VALUE thread = rb_thread_current();
+//   int max_frame_count = backtracie_frame_count_for_thread(thread);
+//   VALUE wrapper = backtracie_minimal_frame_wrapper_new(max_frame_count);
+//   *backtracie_minimal_frame_wrapper_len(wrapper) =
+//       backtracie_capture_minimal_frames_for_thread(
+//           thread, 0, max_frame_count,
+//           backtracie_minimal_frame_wrapper_frames(wrapper));
+//
+BACKTRACIE_API
+VALUE backtracie_minimal_frame_wrapper_new(size_t capa);
+// Returns the underying array of frames for use
+BACKTRACIE_API
+minimal_location_t *backtracie_minimal_frame_wrapper_frames(VALUE wrapper);
+// This returns a pointer to the len, so you can update the size of the
+// contained list of frames (up to capa)
+BACKTRACIE_API
+int *backtracie_minimal_frame_wrapper_len(VALUE wrapper);
+
+// ========= Frame table API ========
+// When keeping around a lot of stacks (e.g. in a profiler), the same frames
+// tend to show up over and over again. The frame table stores each distinct
+// frame -- identified by its iseq, callable method entry, self_or_self_class
+// and line number -- only once, and gives it a small uint32_t id. Stacks can
+// then be kept as plain arrays of ids, which are 10x smaller than raw_location
+// arrays, and don't need to be marked at all: the frame table takes care of
+// marking (and updating, when the GC compacts the heap) every frame it holds.
+//
+// Ids are dense (0, 1, 2, ...) and stay valid for as long as the frame table
+// is alive; frames are never removed from a frame table.
+//
+// As with backtracie_frame_wrapper_new(), the frame table is a Ruby object, so
+// you need to mark it (or RB_GC_GUARD() it) for as long as you use it.
+BACKTRACIE_API
+VALUE backtracie_frame_table_new(void);
+// Returns the id for the given frame, adding it to the table if needed
+BACKTRACIE_API
+uint32_t backtracie_frame_table_intern(VALUE table, const raw_location *loc);
+// Returns the frame for the given id, or NULL if there's no such id. The
+// returned pointer is only valid until the next frame is added to the table.
+// Note that the pc of the frame is from the first time it was interned, and
+// thus may not be the exact same as later ones (but always maps to the same
+// line number).
+BACKTRACIE_API
+const raw_location *backtracie_frame_table_get(VALUE table, uint32_t id);
+// Returns the number of distinct frames in the table
+BACKTRACIE_API
+uint32_t backtracie_frame_table_size(VALUE table);
+// This is like backtracie_capture_frames_for_thread, but writes the ids of the
+// captured frames (interning them as needed) to out.
+BACKTRACIE_API
+int backtracie_frame_table_capture_frames_for_thread(VALUE table, VALUE thread,
+                                                     int start, int max,
+                                                     uint32_t *out);
+
+// ========= Stack trie API ========
+// The stack trie is a prefix tree of frame ids (from a frame table), which is
+// a good fit for aggregating a lot of stacks: stacks that share their bottom
+// frames (e.g. a long middleware chain) store those frames only once.
+//
+// Each distinct stack is identified by a uint32_t node; node 0 is the root
+// (the empty stack). Inserting a stack takes O(depth), and nodes are never
+// removed. Marking the stack trie marks its frame table, which is what keeps
+// every frame referenced by the trie alive.
+BACKTRACIE_API
+VALUE backtracie_stack_trie_new(VALUE frame_table);
+// Returns the frame table used by the given stack trie
+BACKTRACIE_API
+VALUE backtracie_stack_trie_frame_table(VALUE trie);
+// Inserts the given frame ids (ordered like a backtrace, e.g. as returned by
+// backtracie_frame_table_capture_frames_for_thread()), and returns the node
+// for the stack. Increments the count of that node by one.
+BACKTRACIE_API
+uint32_t backtracie_stack_trie_insert(VALUE trie, const uint32_t *frame_ids,
+                                      int len);
+// Walks the given node back to the root, writing up to max frame ids of its
+// stack (ordered like a backtrace) to out. Returns the number of ids written.
+BACKTRACIE_API
+int backtracie_stack_trie_frame_ids(VALUE trie, uint32_t node, uint32_t *out,
+                                    int max);
+// Returns the number of nodes in the trie (including the root); nodes are
+// numbered 0 to size - 1
+BACKTRACIE_API
+uint32_t backtracie_stack_trie_size(VALUE trie);
+// Returns the number of stacks inserted that ended exactly at the given node
+BACKTRACIE_API
+uint64_t backtracie_stack_trie_count(VALUE trie, uint32_t node);
+// Returns the number of frames in the stack for the given node
+BACKTRACIE_API
+int backtracie_stack_trie_depth(VALUE trie, uint32_t node);
+
+// ========= Signal-safe capture API ========
+// The capture functions above need to be called while holding the GVL, which
+// rules them out for e.g. a SIGPROF-based CPU profiler. Instead, the ring
+// buffer allows capturing the stack of the current thread from a signal
+// handler: stacks get copied (as raw words, without looking at any Ruby
+// objects) into a preallocated, lock-free ring buffer, and only get validated
+// and turned into raw_location's later, when they get drained while holding
+// the GVL.
+//
+// Stacks get dropped (and counted in backtracie_ring_buffer_dropped()) if
+// the ring buffer is full, if the GC was running while they were being
+// captured, or if another capture was already in progress (e.g. a signal
+// handler running on another thread). Stacks deeper than max_depth get cut
+// short.
+//
+// Stacks waiting in the ring buffer are kept alive by it, so as usual, the
+// ring buffer needs to be marked (or RB_GC_GUARD()'d) for as long as signal
+// handlers may be writing to it.
+//
+// The intended usage of this API looks something like this:
+//
+//   // While holding the GVL
+//   VALUE ring_buffer = backtracie_ring_buffer_new(64 * 1024, 512);
+//   backtracie_ring_buffer_t *ring_buffer_data =
+//       backtracie_ring_buffer_get(ring_buffer);
+//
+//   // In the signal handler
+//   backtracie_ring_buffer_capture(ring_buffer_data);
+//
+//   // Later, while holding the GVL
+//   VALUE thread;
+//   raw_location frames[512];
+//   int frames_len;
+//   while ((frames_len = backtracie_ring_buffer_drain(ring_buffer, &thread,
+//                                                     frames, 512)) >= 0) {
+//     ...
+//   }
+typedef struct backtracie_ring_buffer backtracie_ring_buffer_t;
+// Creates a ring buffer with room for capacity frames (rounded up to a power
+// of two), for stacks of up to max_depth frames.
+BACKTRACIE_API
+VALUE backtracie_ring_buffer_new(int capacity, int max_depth);
+// Returns the ring buffer struct to be used by the signal handler
+BACKTRACIE_API
+backtracie_ring_buffer_t *backtracie_ring_buffer_get(VALUE ring_buffer);
+// Captures the stack of the current thread into the ring buffer. This is
+// async-signal-safe: it never calls into Ruby, allocates or takes locks.
+// Returns false if the stack was dropped.
+BACKTRACIE_API
+bool backtracie_ring_buffer_capture(backtracie_ring_buffer_t *ring_buffer);
+// Takes the oldest stack out of the ring buffer, writing up to max of its
+// frames to out and its thread to *thread. Returns the number of frames
+// written, or -1 if the ring buffer is empty. Must be called while holding the
+// GVL. Once drained, the frames are no longer kept alive by the ring buffer, so
+// mark them (e.g. by using backtracie_frame_wrapper_new()) if they need to
+// survive a GC.
+BACKTRACIE_API
+int backtracie_ring_buffer_drain(VALUE ring_buffer, VALUE *thread,
+                                 raw_location *out, int max);
+// Returns the number of stacks dropped so far
+BACKTRACIE_API
+uint64_t backtracie_ring_buffer_dropped(VALUE ring_buffer);
+
+// ========= pprof API ========
+// Builds profiles in the pprof format (see
+// https://github.com/google/pprof/blob/main/proto/profile.proto), which can
+// then be looked at with `go tool pprof` and friends.
+//
+// Frames get turned into pprof locations, which are identified by a uint64_t
+// id (ids start at 1). Function names, filenames, functions, locations and
+// samples are deduplicated as they get added, so adding the same stack
+// multiple times just adds up the values of its sample.
+//
+// Locations only keep copies of the strings they need, so a profile never
+// references (or needs to mark) any Ruby objects. As with
+// backtracie_frame_wrapper_new(), the profile itself is a Ruby object, so you
+// need to RB_GC_GUARD() it for as long as you use it.
+//
+// The intended usage of this API looks something like this:
+//
+//   VALUE pprof = backtracie_pprof_new("samples", "count");
+//   backtracie_pprof_add_raw_sample(pprof, frames, frames_len, 1);
+//   ...
+//   VALUE encoded = backtracie_pprof_encode(pprof);
+BACKTRACIE_API
+VALUE backtracie_pprof_new(const char *sample_type, const char *sample_unit);
+// Sets the period_type and period of the profile, e.g. for a profiler that
+// samples every 10ms, ("wall", "nanoseconds", 10000000)
+BACKTRACIE_API
+void backtracie_pprof_set_period(VALUE pprof, const char *period_type,
+                                 const char *period_unit, int64_t period);
+// Returns the id of the location for the given frame, adding it to the
+// profile if needed
+BACKTRACIE_API
+uint64_t backtracie_pprof_raw_location_id(VALUE pprof, const raw_location *loc);
+// Like backtracie_pprof_raw_location_id, but for a minimal_location_t
+BACKTRACIE_API
+uint64_t backtracie_pprof_minimal_location_id(VALUE pprof,
+                                              const minimal_location_t *loc);
+// Adds value to the sample for the given stack of location ids (ordered like a
+// backtrace), creating the sample if needed
+BACKTRACIE_API
+void backtracie_pprof_add_sample(VALUE pprof, const uint64_t *location_ids,
+                                 int len, int64_t value);
+// Same as getting the location id of every frame, and then calling
+// backtracie_pprof_add_sample
+BACKTRACIE_API
+void backtracie_pprof_add_raw_sample(VALUE pprof, const raw_location *frames,
+                                     int len, int64_t value);
+BACKTRACIE_API
+void backtracie_pprof_add_minimal_sample(VALUE pprof,
+                                         const minimal_location_t *frames,
+                                         int len, int64_t value);
+// Returns a binary Ruby string with the encoded (uncompressed) profile
+BACKTRACIE_API
+VALUE backtracie_pprof_encode(VALUE pprof);
+
+// ========= Stats API ========
+// Counters for how much work backtracie has been doing, e.g. to find out what
+// using it inside a profiler costs. Every counter is cumulative since the
+// extension got loaded (or since the last backtracie_stats_reset()).
+//
+// Counting is done with relaxed atomic increments, and can be removed entirely
+// by building with BACKTRACIE_DISABLE_STATS=true, in which case every counter
+// stays at zero.
+typedef struct {
+  // Control frames looked at while capturing stacks, and how many of those
+  // were valid (would show up in a backtrace) or got skipped
+  uint64_t frames_walked;
+  uint64_t valid_frames;
+  uint64_t skipped_frames;
+
+  // Calls to each of the capture APIs. Note that the Ruby APIs are built on
+  // top of the C APIs, so they also show up in the C counters.
+  uint64_t captures_caller_locations;
+  uint64_t captures_backtrace_locations;
+  uint64_t captures_caller_location;
+  uint64_t captures_all_thread_backtraces;
+  uint64_t captures_frame_for_thread;
+  uint64_t captures_frames_for_thread;
+  uint64_t captures_all_threads;
+  uint64_t captures_caller_frame;
+
+  // Frame names turned into interned Ruby strings (a new string only gets
+  // allocated if there's no such string in Ruby's fstring table yet, so this is
+  // an upper bound on allocations)
+  uint64_t strings_interned;
+  // Times a growable string builder had to grow its buffer
+  uint64_t strbuilder_grows;
+
+  uint64_t line_number_cache_hits;
+  uint64_t line_number_cache_misses;
+  uint64_t class_name_cache_hits;
+  uint64_t class_name_cache_misses;
+
+  // Time spent walking stacks, and turning the captured frames into
+  // Backtracie::Location objects
+  uint64_t capture_ns;
+  uint64_t symbolization_ns;
+} backtracie_stats_t;
+
+// Returns false if backtracie was built with BACKTRACIE_DISABLE_STATS=true
+BACKTRACIE_API
+bool backtracie_stats_enabled(void);
+// Copies the current value of every counter to out
+BACKTRACIE_API
+void backtracie_stats_get(backtracie_stats_t *out);
+// Sets every counter back to zero
+BACKTRACIE_API
+void backtracie_stats_reset(void);
 #endif
@@ -34,6 +34,7 @@ void strbuilder_free_growable(strbuilder_t *str) {
 }
 
 static void strbuilder_grow(strbuilder_t *str) {
+  BACKTRACIE_STATS_INC(strbuilder_grows);
   ptrdiff_t offset = str->curr_ptr - str->original_buf;
   str->original_bufsize = str->original_bufsize * 2;
   str->original_buf = realloc(str->original_buf, str->original_bufsize);
@@ -20,6 +20,14 @@
 
 require "backtracie/version"
 require "backtracie/location"
+require "backtracie/backtrace"
+require "backtracie/stack_trie"
+require "backtracie/sampler"
+require "backtracie/folded_aggregator"
+require "backtracie/allocation_profiler"
+require "backtracie/pprof"
+require "backtracie/exception_locations"
+require "backtracie/filter"
 
 # Note: This should be the last require, because the native extension expects all of the Ruby-defined classes above
 # to exist by the time it gets initialized
@@ -29,20 +37,69 @@ module Backtracie
   module_function
 
   if RUBY_VERSION < "2.5"
-    def caller_locations
+    def caller_locations(start = 1, length = nil, lazy: false, debug: nil, filter: nil)
       # FIXME: We're having some trouble getting the current thread on older Rubies, see the FIXME on
-      # backtracie_rb_profile_frames. A workaround is to just pass in the reference to the current thread explicitly
-      # (and slice off a few frames, since caller_locations is supposed to start from the caller of our caller)
-      backtrace_locations(Thread.current)[3..-1]
+      # backtracie_rb_profile_frames. A workaround is to just pass in the reference to the current thread explicitly.
+      Primitive.caller_locations(Thread.current, start, length, lazy, debug, filter)
+    end
+
+    def capture(start = 1, length = nil, debug: nil)
+      Primitive.caller_locations(Thread.current, start, length, true, debug, nil)
     end
   else
-    def caller_locations
-      Primitive.caller_locations
+    # With a filter: (see Backtracie::Filter), only the locations for the frames it accepts get returned. The start and
+    # length arguments still refer to every frame on the stack.
+    def caller_locations(start = 1, length = nil, lazy: false, debug: nil, filter: nil)
+      Primitive.caller_locations(nil, start, length, lazy, debug, filter)
+    end
+
+    # Same as caller_locations(start, length, lazy: true)
+    def capture(start = 1, length = nil, debug: nil)
+      Primitive.caller_locations(nil, start, length, true, debug, nil)
     end
   end
 
   # Defined via native code only; not redirecting via Primitive to avoid an extra stack frame on the stack
-  # def backtrace_locations(thread); end
+  # def backtrace_locations(thread, start = 0, length = nil, lazy: false, debug: nil, filter: nil); end
+
+  # Also defined via native code only, for the same reason. Same as caller_locations(depth, 1).first, but only walks
+  # the stack as far as needed and does not allocate anything other than the resulting Backtracie::Location.
+  # def caller_location(depth = 1); end
+
+  # Also defined via native code only. Returns a hash of thread => array of Backtracie::Location for every alive
+  # thread, all captured in a single pass.
+  # def all_thread_backtraces(debug: nil); end
+
+  # Also defined via native code only. Yields the same Backtracie::Locations as caller_locations(start), one at a time.
+  # The stack gets walked as the locations are yielded, so breaking out of the block early skips the rest of the work.
+  # def each_caller_location(start = 1, debug: nil, filter: nil); end
+
+  # Also defined via native code only. Yields the same Backtracie::Locations as backtrace_locations(thread, start), one
+  # at a time. For threads other than the current one, the stack still gets captured upfront (as it may change while
+  # the block runs), but locations only get created as they are yielded.
+  # def each_backtrace_location(thread, start = 0, debug: nil, filter: nil); end
+
+  # Also defined via native code:
+  # * debug=: When set to true, every Backtracie::Location includes extra debug information (which is expensive to
+  #   build); can be overridden for each call by passing in the debug: option. Defaults to false.
+  # * debug?: Returns the current value of the above setting.
+  # * line_number_cache_stats: Returns a hash with the hits, misses, hit_rate and capacity of the cache used to look
+  #   up line numbers. Hits and misses are part of the stats below, so they also stay at zero when those are disabled
+  #   (and :enabled is false).
+  # * stats: Returns a hash with counters for the work done so far (frames walked, captures per API, strings interned,
+  #   cache hits and misses, nanoseconds spent capturing and symbolizing, ...). When the native extension gets built
+  #   with BACKTRACIE_DISABLE_STATS=true, every counter stays at zero (and :enabled is false).
+  # * reset_stats: Sets every one of the above counters back to zero.
+  # * track_exceptions!: Starts capturing the frames of every exception raised, making them available via
+  #   Exception#backtracie_locations (see Backtracie::ExceptionLocations).
+  # * stop_tracking_exceptions!: Stops the above. Exceptions raised while tracking was enabled keep their frames.
+  # * tracking_exceptions?: Returns true if exceptions are being tracked.
+  # * once_per_call_site(depth = 1) { ... }: Runs the block only the first time it gets called from a given call site
+  #   (by default, wherever the method calling once_per_call_site was called from; depth works as in caller_location).
+  #   Returns the result of the block, or nil if it didn't run.
+  # * once_per_call_site_limit/once_per_call_site_limit=: Maximum number of call sites remembered by the above
+  #   (4096 by default). Once reached, new call sites are treated as already seen.
+  # * reset_once_per_call_site: Forgets every call site seen so far.
 
   private_class_method def ensure_object_is_thread(object)
     unless object.is_a?(Thread)
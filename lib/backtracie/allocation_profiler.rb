@@ -0,0 +1,52 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # A sampling allocation profiler: once started, records the stack (and the class of the new object) for one in
+  # every interval object allocations, on average.
+  #
+  # Stacks get captured from an internal VM hook where no Ruby objects can be created, so they only go into a
+  # Backtracie::StackTrie; frame names only get rendered by #to_folded.
+  #
+  # Usage:
+  #
+  #   profiler = Backtracie::AllocationProfiler.new(interval: 100, track_retained: true)
+  #   profiler.start
+  #   ... # code to be profiled
+  #   profiler.stop
+  #   File.write("allocations.folded", profiler.to_folded)
+  #   File.write("retained.folded", profiler.to_folded(retained: true))
+  #
+  # Note: All other methods are defined via native code:
+  # * initialize(interval: 1000, max_depth: 512, track_retained: false)
+  # * start/stop/running?: Only one allocation profiler can be running at a time
+  # * samples: Number of allocations sampled so far
+  # * class_counts: Hash of class => number of sampled allocations of that class
+  # * retained_count: Number of sampled objects that were still alive when the profiler was stopped (or now, if it's
+  #   still running); only available with track_retained: true
+  class AllocationProfiler
+    # Returns a string with a "frame1;frame2;frame3 count" line (see Backtracie::FoldedAggregator) for every distinct
+    # stack that allocated sampled objects. With retained: true, only sampled objects that are still alive are counted
+    # (see #retained_count).
+    def to_folded(retained: false)
+      folded(retained)
+    end
+  end
+end
@@ -0,0 +1,87 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # A lazy version of the arrays of Backtracie::Location returned by Backtracie.caller_locations and friends.
+  #
+  # The stack is captured when this object is created, but each Backtracie::Location is only created when it is
+  # accessed (and then reused), so capturing a Backtrace that is never (or only partially) looked at is quite cheap.
+  class Backtrace
+    include Enumerable
+
+    # Note: Instances of this class are created by the native extension, see Backtracie.capture
+    def initialize(frame_wrapper, debug)
+      @frame_wrapper = frame_wrapper
+      @debug = debug
+      @locations = []
+    end
+
+    def size
+      @frame_wrapper.size
+    end
+    alias_method :length, :size
+
+    def empty?
+      size == 0
+    end
+
+    # Same semantics as Array#[], e.g. backtrace[0], backtrace[-1], backtrace[1, 2] and backtrace[1..2] are all valid
+    def [](*arguments)
+      if arguments.size == 1 && arguments.first.is_a?(Integer)
+        index = arguments.first
+        index += size if index < 0
+        location(index) if index >= 0 && index < size
+      else
+        (0...size).to_a[*arguments]&.map { |index| location(index) }
+      end
+    end
+
+    def first(count = nil)
+      return self[0] if count.nil?
+      raise ArgumentError, "negative array size" if count < 0
+
+      Array.new([count, size].min) { |index| location(index) }
+    end
+
+    def each
+      return enum_for(:each) { size } unless block_given?
+
+      size.times { |index| yield location(index) }
+      self
+    end
+
+    def to_a
+      Array.new(size) { |index| location(index) }
+    end
+
+    # Returns a 64-bit Integer computed from the path, label and line number of every frame, without creating any
+    # Backtracie::Locations. Backtraces for the same stack get the same fingerprint (even across processes running
+    # the same code), so this can be used to group backtraces (and only look at the locations of one of each group).
+    def fingerprint
+      @fingerprint ||= @frame_wrapper.fingerprint
+    end
+
+    private
+
+    def location(index)
+      @locations[index] ||= @frame_wrapper.location(index, @debug)
+    end
+  end
+end
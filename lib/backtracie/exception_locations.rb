@@ -0,0 +1,32 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # Gets included into Exception by Backtracie.track_exceptions!
+  module ExceptionLocations
+    # Returns a Backtracie::Backtrace for where this exception was raised, or nil if it was raised while exception
+    # tracking was not enabled. The frames are captured when the exception is raised, but only get turned into
+    # Backtracie::Locations when they are accessed.
+    def backtracie_locations(debug: nil)
+      frame_wrapper = Primitive.exception_frame_wrapper(self)
+      Backtrace.new(frame_wrapper, debug.nil? ? Backtracie.debug? : debug) if frame_wrapper
+    end
+  end
+end
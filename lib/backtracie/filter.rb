@@ -0,0 +1,41 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # Selects which frames get returned by caller_locations, backtrace_locations, each_caller_location and
+  # each_backtrace_location (via their filter: option). Frames get checked right after the stack is captured, so the
+  # ones that get rejected are never turned into Backtracie::Locations.
+  #
+  # Usage:
+  #
+  #   APP_FRAMES = Backtracie::Filter.new(include_paths: [Dir.pwd], exclude_paths: ["#{Dir.pwd}/vendor/"])
+  #   Backtracie.caller_locations(filter: APP_FRAMES)
+  #
+  # Paths are matched (as plain string prefixes) against the absolute_path of each location (or its path, if there's
+  # no absolute_path). When include_paths is empty, every path is included.
+  #
+  # Note: All methods are defined via native code:
+  # * initialize(include_paths: [], exclude_paths: [], skip_cfuncs: false, skip_blocks: false)
+  # * include_paths/exclude_paths: The path prefixes given to initialize
+  # * skip_cfuncs?: When true, frames for methods implemented in native code get rejected
+  # * skip_blocks?: When true, frames for blocks get rejected
+  class Filter
+  end
+end
@@ -0,0 +1,42 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # Counts stacks, and outputs them in the "folded" (or collapsed) format used by flamegraph tools such as
+  # https://github.com/brendangregg/FlameGraph or https://www.speedscope.app/: one line per distinct stack, with frame
+  # names separated by ";" (starting from the bottom of the stack), followed by the number of times it was seen.
+  #
+  # Adding a stack only needs to capture its frames and bump a counter; frame names only get rendered by #to_folded.
+  #
+  # Usage:
+  #
+  #   aggregator = Backtracie::FoldedAggregator.new
+  #   aggregator.add_current_thread
+  #   aggregator.add_thread(some_thread)
+  #   File.write("stacks.folded", aggregator.to_folded)
+  #
+  # Note: All methods are defined via native code:
+  # * add_current_thread: Adds the stack of the current thread (without the add_current_thread frame)
+  # * add_thread(thread): Adds the stack of the given thread (ignored if the thread is dead)
+  # * to_folded: Returns a string with a "frame1;frame2;frame3 count" line for every distinct stack
+  # * stack_trie: The Backtracie::StackTrie where stacks are kept (which can also be used e.g. for #to_pprof)
+  class FoldedAggregator
+  end
+end
@@ -0,0 +1,54 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # Helpers for profiles in the pprof format (https://github.com/google/pprof), as returned by StackTrie#to_pprof and
+  # Sampler#to_pprof. The profiles themselves get built and encoded by the native extension.
+  module Pprof
+    module_function
+
+    # Returns the encoded profile (gzip-compressed, as expected by most pprof tools, if compress is true), or writes
+    # it to io and returns io
+    def output(encoded, compress: false, io: nil)
+      if compress
+        require "stringio"
+        require "zlib"
+
+        if io
+          gzip = Zlib::GzipWriter.new(io)
+          gzip.write(encoded)
+          gzip.finish
+          return io
+        end
+
+        result = StringIO.new("".b)
+        gzip = Zlib::GzipWriter.new(result)
+        gzip.write(encoded)
+        gzip.finish
+        return result.string
+      end
+
+      return encoded unless io
+
+      io.write(encoded)
+      io
+    end
+  end
+end
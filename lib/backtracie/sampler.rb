@@ -0,0 +1,53 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # A wall-clock sampling profiler: once started, takes a sample of every alive thread frequency times per second.
+  #
+  # Samples are gathered by the native extension into preallocated buffers, without creating any Ruby objects; they
+  # only get turned into Samples when #result gets called.
+  #
+  # Usage:
+  #
+  #   sampler = Backtracie::Sampler.new(frequency: 100)
+  #   sampler.start
+  #   ... # code to be profiled
+  #   sampler.stop
+  #   sampler.result # => [#<struct Backtracie::Sampler::Sample ...>, ...]
+  #
+  # Note: All other methods are defined via native code:
+  # * initialize(frequency: 100, max_depth: 512, max_samples: 100_000, max_frames: 1_000_000)
+  # * start/stop/running?: Only one sampler can be running at a time
+  # * result: Array of Samples, in the order they were taken
+  # * dropped_samples: Samples that didn't fit in the preallocated buffers
+  # * clear: Discards every sample taken so far
+  class Sampler
+    # timestamp is from the monotonic clock, in nanoseconds; frames are ordered from the top of the stack
+    Sample = Struct.new(:thread, :timestamp, :frames)
+    # path is the absolute path of the source file (nil for frames for methods implemented in native code)
+    Frame = Struct.new(:qualified_method_name, :lineno, :path)
+
+    # Returns a pprof profile of every sample taken so far, where samples with the same stack (from any thread) get
+    # added up. See Backtracie::Pprof.output for the compress: and io: options.
+    def to_pprof(compress: false, io: nil)
+      Pprof.output(encode_pprof, compress: compress, io: io)
+    end
+  end
+end
@@ -0,0 +1,30 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # Note: Most methods are defined via native code; see the README for an overview.
+  class StackTrie
+    # Returns a pprof profile with a sample for every stack inserted so far, using the number of times it was inserted
+    # as the value. See Backtracie::Pprof.output for the compress: and io: options.
+    def to_pprof(sample_type: "samples", sample_unit: "count", compress: false, io: nil)
+      Pprof.output(encode_pprof(sample_type.to_s, sample_unit.to_s), compress: compress, io: io)
+    end
+  end
+end
@@ -0,0 +1,154 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+require "backtracie"
+require "unit/folded_helper"
+
+RSpec.describe Backtracie::AllocationProfiler do
+  include FoldedHelper
+
+  subject(:profiler) { described_class.new(interval: 1) }
+
+  after { profiler.stop }
+
+  def allocating_method(count)
+    Array.new(count) { String.new }
+  end
+
+  def folded_lines(**options)
+    parse_folded(profiler.to_folded(**options))
+  end
+
+  def allocating_method_count(**options)
+    folded_lines(**options)
+      .select { |stack, _| stack.any? { |frame| frame.start_with?("RSpec::ExampleGroups::BacktracieAllocationProfiler#allocating_method") } }
+      .sum { |_, count| count }
+  end
+
+  it "starts out empty" do
+    expect(profiler.to_folded).to eq ""
+    expect(profiler.samples).to be 0
+    expect(profiler.class_counts).to eq({})
+  end
+
+  it "records the stacks and classes of sampled allocations" do
+    profiler.start
+    allocating_method(100)
+    profiler.stop
+
+    expect(allocating_method_count).to be >= 100
+    expect(profiler.class_counts[String]).to be >= 100
+    expect(profiler.samples).to be >= 100
+  end
+
+  it "samples about one in every interval allocations" do
+    profiler = described_class.new(interval: 10)
+
+    profiler.start
+    allocating_method(10_000)
+    profiler.stop
+
+    expect(profiler.samples).to be_between(500, 2000)
+  end
+
+  it "limits the number of frames in each sample to max_depth" do
+    profiler = described_class.new(interval: 1, max_depth: 2)
+
+    profiler.start
+    allocating_method(10)
+    profiler.stop
+
+    expect(folded_lines.map { |stack, _| stack.size }).to all(be <= 2)
+  end
+
+  it "does not sample allocations after being stopped" do
+    profiler.start
+    profiler.stop
+    samples = profiler.samples
+
+    allocating_method(100)
+
+    expect(profiler.samples).to be samples
+  end
+
+  describe "#to_folded(retained: true)" do
+    subject(:profiler) { described_class.new(interval: 1, track_retained: true) }
+
+    it "only counts sampled objects that are still alive" do
+      profiler.start
+      retained = allocating_method(100)
+      10.times { allocating_method(100) }
+      GC.start
+      profiler.stop
+
+      expect(allocating_method_count).to be >= 1100
+      expect(allocating_method_count(retained: true)).to be_between(100, 500)
+      expect(profiler.retained_count).to be_between(100, profiler.samples - 500)
+      expect(retained.size).to be 100
+    end
+
+    it "keeps working when sampling triggers the GC" do
+      profiler.start
+      begin
+        GC.stress = true
+        retained = allocating_method(50)
+      ensure
+        GC.stress = false
+      end
+      profiler.stop
+
+      expect(allocating_method_count).to be >= 50
+      expect(allocating_method_count(retained: true)).to be >= 50
+      expect(retained.size).to be 50
+    end
+
+    it "is empty when retained objects are not tracked" do
+      profiler = described_class.new(interval: 1)
+
+      profiler.start
+      retained = allocating_method(10)
+      profiler.stop
+
+      expect(profiler.to_folded(retained: true)).to eq ""
+      expect(profiler.retained_count).to be 0
+      expect(retained.size).to be 10
+    end
+  end
+
+  describe "#start" do
+    it "returns false when the profiler is already running" do
+      expect(profiler.start).to be true
+      expect(profiler.start).to be false
+      expect(profiler.running?).to be true
+    end
+
+    it "raises when another profiler is already running" do
+      profiler.start
+
+      expect { described_class.new.start }.to raise_exception(RuntimeError, /already running/)
+    end
+  end
+
+  it "raises an ArgumentError for invalid arguments" do
+    expect { described_class.new(interval: 0) }.to raise_exception(ArgumentError)
+    expect { described_class.new(max_depth: 0) }.to raise_exception(ArgumentError)
+    expect { described_class.new(unknown: 1) }.to raise_exception(ArgumentError)
+  end
+end
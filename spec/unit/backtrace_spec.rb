@@ -0,0 +1,144 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+require "backtracie"
+
+RSpec.describe Backtracie::Backtrace do
+  def sample_backtrace
+    Backtracie.capture
+  end
+
+  # These two calls should never be reformatted to be on different lines! See backtracie_spec.rb for why.
+  let!(:stacks) { [sample_backtrace, Kernel.caller_locations(0)] }
+  let(:backtrace) { stacks.first }
+  let(:ruby_stack) { stacks.last }
+
+  it "has the same size as the equivalent Ruby API" do
+    expect(backtrace.size).to be ruby_stack.size
+    expect(backtrace.length).to be ruby_stack.size
+    expect(backtrace).to_not be_empty
+  end
+
+  describe "#[]" do
+    it "returns a Backtracie::Location for the given index" do
+      expect(backtrace[0]).to be_a(Backtracie::Location)
+      expect(backtrace[0].lineno).to be ruby_stack[0].lineno
+      expect(backtrace[0].path).to eq ruby_stack[0].path
+    end
+
+    it "supports negative indexes" do
+      expect(backtrace[-1].label).to eq ruby_stack[-1].label
+    end
+
+    it "returns nil for out of bounds indexes" do
+      expect(backtrace[backtrace.size]).to be nil
+      expect(backtrace[-backtrace.size - 1]).to be nil
+    end
+
+    it "supports ranges and start/length arguments" do
+      expect(backtrace[1..2].map(&:label)).to eq ruby_stack[1..2].map(&:label)
+      expect(backtrace[1, 2].map(&:label)).to eq ruby_stack[1, 2].map(&:label)
+    end
+
+    it "returns the same Backtracie::Location every time" do
+      expect(backtrace[0]).to be backtrace[0]
+    end
+  end
+
+  describe "#first" do
+    it "returns the first location" do
+      expect(backtrace.first).to be backtrace[0]
+    end
+
+    it "returns the first n locations" do
+      expect(backtrace.first(2)).to eq [backtrace[0], backtrace[1]]
+      expect(backtrace.first(backtrace.size + 1).size).to be backtrace.size
+    end
+  end
+
+  describe "#each" do
+    it "yields every location" do
+      yielded = []
+      backtrace.each { |location| yielded << location }
+
+      expect(yielded).to eq backtrace.to_a
+    end
+
+    it "returns an enumerator when no block is given" do
+      expect(backtrace.each.size).to be backtrace.size
+    end
+  end
+
+  describe "#to_a" do
+    it "returns an array of Backtracie::Location instances" do
+      expect(backtrace.to_a).to all(be_a(Backtracie::Location))
+      expect(backtrace.to_a.map(&:label)).to eq ruby_stack.map(&:label)
+    end
+  end
+
+  describe "#fingerprint" do
+    it "is the same for backtraces of the same stack" do
+      first, second = Array.new(2) { sample_backtrace }
+
+      expect(first.fingerprint).to be_a(Integer)
+      expect(first.fingerprint).to eq second.fingerprint
+    end
+
+    it "is different when any frame is at a different line" do
+      first = sample_backtrace
+      second = sample_backtrace
+
+      expect(first.fingerprint).to_not eq second.fingerprint
+    end
+
+    it "is different for stacks of different depths" do
+      expect(Backtracie.capture(1).fingerprint).to_not eq Backtracie.capture(2).fingerprint
+    end
+
+    it "does not create any locations" do
+      backtrace.fingerprint
+
+      expect(backtrace.instance_variable_get(:@locations)).to eq []
+    end
+
+    it "is the same across processes" do
+      # Allocating a different amount of memory before compiling the code makes sure it ends up at different addresses
+      fingerprint_in_new_process = lambda do |padding|
+        code = "padding = Array.new(#{padding}) { 'x' * 100 }; eval('p Backtracie.capture.fingerprint', nil, 'sample.rb')"
+        IO.popen([RbConfig.ruby, "-I", File.expand_path("../../lib", __dir__), "-rbacktracie", "-e", code], &:read)
+      end
+
+      first, second = [0, 10_000].map { |padding| Integer(fingerprint_in_new_process.call(padding)) }
+
+      expect(first).to eq second
+    end
+
+    if GC.respond_to?(:compact)
+      it "is not affected by the GC compacting the heap" do
+        first, second = Array.new(2) do |index|
+          GC.compact if index == 1
+          sample_backtrace
+        end
+
+        expect(first.fingerprint).to eq second.fingerprint
+      end
+    end
+  end
+end
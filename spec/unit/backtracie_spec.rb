@@ -19,6 +19,7 @@
 # along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
 
 require "backtracie"
+require "weakref"
 
 require "unit/interesting_backtrace_helper"
 
@@ -75,6 +76,581 @@ RSpec.describe Backtracie do
 
       it_should_behave_like "an equivalent of the Ruby API (using locations)"
     end
+
+    context "when lazy: true" do
+      let(:backtracie_stack) { described_class.caller_locations(lazy: true).to_a }
+      let(:ruby_stack) { Kernel.caller_locations }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+      it "returns a Backtracie::Backtrace" do
+        expect(described_class.caller_locations(lazy: true)).to be_a(Backtracie::Backtrace)
+      end
+    end
+
+    context "when given a start" do
+      let(:backtracie_stack) { described_class.caller_locations(3) }
+      let(:ruby_stack) { Kernel.caller_locations(3) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when given a start and length" do
+      let(:backtracie_stack) { described_class.caller_locations(1, 4) }
+      let(:ruby_stack) { Kernel.caller_locations(1, 4) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when given a start and length with lazy: true" do
+      let(:backtracie_stack) { described_class.caller_locations(2, 3, lazy: true).to_a }
+      let(:ruby_stack) { Kernel.caller_locations(2, 3) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when given a length that stops right after a C frame" do
+      def deep_stack(depth, &block)
+        (depth == 0) ? block.call : deep_stack(depth - 1, &block)
+      end
+
+      # Both locations need to be captured on the same line, as the C frame uses the line of its caller
+      let!(:stacks) { [1].map { [described_class.caller_locations(1, 1), Kernel.caller_locations(1, 1)] }.first }
+      let(:backtracie_stack) { stacks.first }
+      let(:ruby_stack) { stacks.last }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+      it "does not walk the rest of the stack" do
+        frames_walked = deep_stack(1000) do
+          [1].map do
+            before = described_class.stats[:frames_walked]
+            described_class.caller_locations(1, 1)
+            described_class.caller_locations(1, 1, lazy: true)
+            described_class.capture(1, 1)
+            described_class.stats[:frames_walked] - before
+          end.first
+        end
+
+        expect(frames_walked).to be < 50
+      end
+    end
+
+    context "when given a range" do
+      let(:backtracie_stack) { described_class.caller_locations(2..5) }
+      let(:ruby_stack) { Kernel.caller_locations(2..5) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when given a range relative to the bottom of the stack" do
+      let(:backtracie_stack) { described_class.caller_locations(-4..-2) }
+      let(:ruby_stack) { Kernel.caller_locations(-4..-2) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when start is at or past the end of the stack" do
+      it "returns the same as Ruby" do
+        size = Kernel.caller_locations(0).size
+
+        expect(described_class.caller_locations(size - 1).size).to be 1
+        expect(described_class.caller_locations(size)).to eq []
+        expect(described_class.caller_locations(size + 1)).to be nil
+        expect(described_class.caller_locations((size + 1)..(size + 2))).to be nil
+        expect(described_class.caller_locations(size + 1, lazy: true)).to be nil
+
+        expect(Kernel.caller_locations(size - 1).size).to be 1
+        expect(Kernel.caller_locations(size)).to eq []
+        expect(Kernel.caller_locations(size + 1)).to be nil
+      end
+    end
+
+    it "returns frozen strings, shared between backtraces" do
+      first, second = Array.new(2) { described_class.caller_locations(0, 2) }
+
+      [:path, :absolute_path, :label, :base_label, :qualified_method_name].each do |attribute|
+        expect(first.map(&attribute)).to all(be_frozen)
+        first.zip(second).each do |first_location, second_location|
+          expect(first_location.public_send(attribute)).to be(second_location.public_send(attribute))
+        end
+      end
+    end
+
+    context "when given a negative start or length" do
+      it "raises an ArgumentError" do
+        expect { described_class.caller_locations(-1) }.to raise_exception(ArgumentError)
+        expect { described_class.caller_locations(1, -1) }.to raise_exception(ArgumentError)
+      end
+    end
+
+    it "does not keep alive objects whose singleton methods were on the stack" do
+      klass = Class.new
+      call_singleton_methods = lambda do
+        Array.new(200) do
+          object = klass.new
+          def object.hello
+            Backtracie.caller_locations(0, 1)
+          end
+          object.hello
+        end
+        nil
+      end
+
+      call_singleton_methods.call
+      GC.start
+
+      expect(ObjectSpace.each_object(klass).count).to be < 20
+    end
+
+    it "keeps using cached class names after a minor GC" do
+      sample = -> { described_class.caller_locations(0, 1).first.qualified_method_name }
+      sample.call
+      # Only old classes get cached
+      3.times { GC.start }
+      sample.call
+
+      GC.start(full_mark: false)
+      before = described_class.stats
+      sample.call
+      misses = described_class.stats[:class_name_cache_misses] - before[:class_name_cache_misses]
+
+      expect(misses).to be 0
+    end
+
+    it "reuses the same frame wrapper across calls" do
+      described_class.caller_locations
+
+      GC.disable
+      begin
+        wrappers_before = ObjectSpace.each_object(Backtracie::FrameWrapper).count
+        results = Array.new(100) { |i| described_class.caller_locations(0, (i % 10) + 1) }
+        wrappers_after = ObjectSpace.each_object(Backtracie::FrameWrapper).count
+      ensure
+        GC.enable
+      end
+
+      expect(wrappers_after - wrappers_before).to be_between(0, 1)
+      expect(results.map(&:size)).to eq Array.new(100) { |i| (i % 10) + 1 }
+    end
+  end
+
+  describe ".caller_location" do
+    let(:backtracie_stack) { [described_class.caller_location] }
+    let(:ruby_stack) { Kernel.caller_locations(1, 1) }
+
+    it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+    context "when given a depth" do
+      let(:backtracie_stack) { [described_class.caller_location(4)] }
+      let(:ruby_stack) { Kernel.caller_locations(4, 1) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when the caller is a C frame" do
+      # Both locations need to be captured on the same line, as the C frame uses the line of its caller
+      let!(:locations) { [1].map { [described_class.caller_location, Kernel.caller_locations(1, 1).first] }.first }
+      let(:backtracie_stack) { [locations.first] }
+      let(:ruby_stack) { [locations.last] }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+      it "marks the path as synthetic" do
+        expect(backtracie_stack.first.path_is_synthetic).to be true
+      end
+    end
+
+    context "when the caller is followed by a long run of C frames" do
+      let!(:locations) do
+        [1].method(:public_send).call(:public_send, :public_send, :public_send, :public_send, :map) do
+          [described_class.caller_location, Kernel.caller_locations(1, 1).first]
+        end.first
+      end
+      let(:backtracie_stack) { [locations.first] }
+      let(:ruby_stack) { [locations.last] }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+      it "walks over them only once" do
+        frames_walked = [1].method(:public_send).call(*Array.new(20, :public_send), :map) do
+          before = described_class.stats[:frames_walked]
+          described_class.caller_location
+          described_class.stats[:frames_walked] - before
+        end.first
+
+        expect(frames_walked).to be_between(22, 30)
+      end
+    end
+
+    it "returns the direct caller with a depth of 0" do
+      expect(described_class.caller_location(0).lineno).to be __LINE__
+    end
+
+    it "returns nil when depth is past the end of the stack" do
+      depth = Kernel.caller_locations(0).size
+
+      expect(described_class.caller_location(depth - 1)).to be_a(Backtracie::Location)
+      expect(described_class.caller_location(depth)).to be nil
+    end
+
+    it "raises an ArgumentError when depth is negative" do
+      expect { described_class.caller_location(-1) }.to raise_exception(ArgumentError)
+    end
+  end
+
+  describe ".each_caller_location" do
+    def streamed_caller_locations(start = 1, **options)
+      locations = []
+      # +1, to skip this method
+      described_class.each_caller_location(start + 1, **options) { |location| locations << location }
+      locations
+    end
+
+    def nested_each(depth, &block)
+      (depth == 0) ? block.call : [1].map { nested_each(depth - 1, &block) }.first
+    end
+
+    let(:backtracie_stack) { streamed_caller_locations }
+    let(:ruby_stack) { Kernel.caller_locations }
+
+    it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+    context "when given a start" do
+      let(:backtracie_stack) { streamed_caller_locations(3) }
+      let(:ruby_stack) { Kernel.caller_locations(3) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    it "matches Kernel.caller_locations on deep stacks with a lot of C frames" do
+      backtracie_stack, ruby_stack = nested_each(100) { [streamed_caller_locations, Kernel.caller_locations] }
+
+      expect(backtracie_stack.map { |location| [location.path, location.lineno, location.label] })
+        .to eq(ruby_stack.map { |location| [location.path, location.lineno, location.label] })
+    end
+
+    it "stops walking the stack when the block breaks" do
+      nested_each(200) do
+        described_class.reset_stats
+        described_class.each_caller_location { |_| break }
+      end
+
+      expect(described_class.stats[:valid_frames]).to be < 100
+    end
+
+    it "yields nothing when start is past the end of the stack" do
+      expect(streamed_caller_locations(Kernel.caller_locations(0).size)).to eq []
+    end
+
+    it "raises an ArgumentError when start is negative" do
+      expect { described_class.each_caller_location(-1) {} }.to raise_exception(ArgumentError)
+    end
+
+    it "raises a LocalJumpError when no block is given" do
+      expect { described_class.each_caller_location }.to raise_exception(LocalJumpError)
+    end
+  end
+
+  describe ".each_backtrace_location" do
+    def streamed_backtrace_locations(thread)
+      locations = []
+      described_class.each_backtrace_location(thread) { |location| locations << location }
+      locations
+    end
+
+    it "yields the same locations as .backtrace_locations for the current thread" do
+      backtracie_stack = streamed_backtrace_locations(Thread.current)
+      ruby_stack = described_class.backtrace_locations(Thread.current)
+
+      expect(backtracie_stack.first.label).to eq "each_backtrace_location"
+      # Skip the frames for the helper method and this block, as the calls are on different lines
+      expect(backtracie_stack.drop(3).map(&:to_s)).to eq ruby_stack.drop(2).map(&:to_s)
+    end
+
+    context "when given another thread" do
+      let(:ready) { Queue.new }
+      let!(:sleeping_thread) do
+        Thread.new do
+          ready << true
+          sleep
+        end
+      end
+
+      before do
+        ready.pop
+        Thread.pass until sleeping_thread.status == "sleep"
+      end
+
+      after do
+        sleeping_thread.kill
+        sleeping_thread.join
+      end
+
+      let(:backtracie_stack) { streamed_backtrace_locations(sleeping_thread) }
+      let(:ruby_stack) { sleeping_thread.backtrace_locations }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    it "yields nothing for dead threads" do
+      expect(streamed_backtrace_locations(Thread.new {}.tap(&:join))).to eq []
+    end
+  end
+
+  describe ".all_thread_backtraces" do
+    let(:ready) { Queue.new }
+    let!(:sleeping_thread) do
+      Thread.new do
+        ready << true
+        sleep
+      end
+    end
+
+    before do
+      ready.pop
+      Thread.pass until sleeping_thread.status == "sleep"
+    end
+
+    after do
+      sleeping_thread.kill
+      sleeping_thread.join
+    end
+
+    it "returns the backtraces of every alive thread" do
+      expect(described_class.all_thread_backtraces.keys).to match_array(Thread.list)
+    end
+
+    it "returns the current thread's backtrace, starting from the call to all_thread_backtraces" do
+      locations = described_class.all_thread_backtraces.fetch(Thread.current)
+
+      expect(locations.first.label).to eq "all_thread_backtraces"
+      expect(locations[1].lineno).to be __LINE__ - 3
+    end
+
+    context "when comparing with the backtrace of another thread" do
+      let(:backtracie_stack) { described_class.all_thread_backtraces.fetch(sleeping_thread) }
+      let(:ruby_stack) { sleeping_thread.backtrace_locations }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    it "does not include dead threads" do
+      dead_thread = Thread.new {}
+      dead_thread.join
+
+      expect(described_class.all_thread_backtraces).to_not include(dead_thread)
+    end
+
+    it "supports the debug option" do
+      location = described_class.all_thread_backtraces(debug: true).fetch(sleeping_thread).first
+
+      expect(location.instance_variable_get(:@debug)).to include(:ruby_frame?)
+    end
+  end
+
+  describe ".line_number_cache_stats" do
+    it "counts cache hits and misses when looking up line numbers" do
+      before = described_class.line_number_cache_stats
+      2.times { described_class.caller_locations }
+      after = described_class.line_number_cache_stats
+
+      expect(after[:enabled]).to be true
+      expect(after[:hits]).to be > before[:hits]
+      expect(after[:hits] + after[:misses]).to be > before[:hits] + before[:misses]
+      expect(after[:hit_rate]).to be_between(0.0, 1.0)
+      expect(after[:capacity]).to be > 0
+    end
+
+    it "does not change the returned line numbers" do
+      locations = Array.new(2) { described_class.caller_locations(0, 1).first.lineno }
+
+      expect(locations).to eq [__LINE__ - 2] * 2
+    end
+
+    it "keeps hitting after a minor GC" do
+      sample = -> { described_class.caller_locations(0, 1) }
+      sample.call
+      # Only old instruction sequences get cached
+      3.times { GC.start }
+      sample.call
+
+      GC.start(full_mark: false)
+      before = described_class.line_number_cache_stats
+      sample.call
+      after = described_class.line_number_cache_stats
+
+      expect(after[:hits] - before[:hits]).to be 1
+      expect(after[:misses]).to be before[:misses]
+    end
+
+    it "does not keep alive the instruction sequences it has seen" do
+      compile_and_run = lambda do
+        Array.new(100) do |i|
+          iseq = RubyVM::InstructionSequence.compile("Backtracie.caller_locations(0, #{i + 1})")
+          iseq.eval
+          WeakRef.new(iseq)
+        end
+      end
+
+      references = compile_and_run.call
+      GC.start
+
+      expect(references.count(&:weakref_alive?)).to be < 20
+    end
+  end
+
+  describe ".once_per_call_site" do
+    before { described_class.reset_once_per_call_site }
+    after { described_class.once_per_call_site_limit = 4096 }
+
+    def deprecated_method
+      described_class.once_per_call_site { :ran }
+    end
+
+    it "runs the block only the first time it gets called from a given call site" do
+      expect(Array.new(3) { deprecated_method }).to eq [:ran, nil, nil]
+    end
+
+    it "runs the block once for every distinct call site" do
+      first = deprecated_method
+      second = deprecated_method
+
+      expect([first, second]).to eq [:ran, :ran]
+    end
+
+    it "uses the frame that called it as the call site with a depth of 0" do
+      results = Array.new(2) { [deprecated_method, described_class.once_per_call_site(0) { :ran }] }
+
+      expect(results).to eq [[:ran, :ran], [nil, nil]]
+    end
+
+    it "uses the call site of the first ruby frame after a C frame" do
+      results = Array.new(2) do
+        [1].method(:public_send).call(:public_send, :public_send, :public_send, :public_send, :map) do
+          described_class.once_per_call_site(1) { :ran }
+        end.first
+      end
+
+      expect(results).to eq [:ran, nil]
+    end
+
+    it "does not allocate any objects for call sites already seen" do
+      allocations = proc do |calls|
+        allocated_before = GC.stat(:total_allocated_objects)
+        calls.times { deprecated_method }
+        GC.stat(:total_allocated_objects) - allocated_before
+      end
+      allocations.call(1)
+
+      # Compared with a single call, as some Rubies allocate an object when calling GC.stat
+      expect(allocations.call(1000)).to be allocations.call(1)
+    end
+
+    it "treats new call sites as already seen once the limit is reached" do
+      described_class.once_per_call_site_limit = 1
+
+      first = deprecated_method
+      second = deprecated_method
+
+      expect([first, second]).to eq [:ran, nil]
+      expect(described_class.once_per_call_site_limit).to be 1
+    end
+
+    it "runs the blocks again after reset_once_per_call_site" do
+      results = Array.new(2) do
+        result = deprecated_method
+        described_class.reset_once_per_call_site
+        result
+      end
+
+      expect(results).to eq [:ran, :ran]
+    end
+
+    it "raises a LocalJumpError when no block is given" do
+      expect { described_class.once_per_call_site }.to raise_exception(LocalJumpError)
+    end
+
+    it "raises an ArgumentError when depth is negative" do
+      expect { described_class.once_per_call_site(-1) {} }.to raise_exception(ArgumentError)
+    end
+  end
+
+  describe ".stats" do
+    it "counts the work done when capturing and symbolizing stacks" do
+      described_class.reset_stats
+      described_class.caller_locations
+      described_class.backtrace_locations(Thread.current)
+      stats = described_class.stats
+
+      expect(stats[:enabled]).to be true
+      expect(stats[:captures_caller_locations]).to be 1
+      expect(stats[:captures_backtrace_locations]).to be 1
+      expect(stats[:captures_frames_for_thread]).to be >= 2
+      expect(stats[:frames_walked]).to be stats[:valid_frames] + stats[:skipped_frames]
+      expect(stats[:valid_frames]).to be >= Kernel.caller_locations.size * 2
+      expect(stats[:strings_interned]).to be > 0
+      expect(stats[:capture_ns]).to be > 0
+      expect(stats[:symbolization_ns]).to be > 0
+    end
+  end
+
+  describe ".reset_stats" do
+    it "sets every counter back to zero" do
+      described_class.caller_locations
+
+      described_class.reset_stats
+
+      expect(described_class.stats.reject { |key, _| key == :enabled }.values.uniq).to eq [0]
+    end
+  end
+
+  describe ".debug=" do
+    after { described_class.debug = false }
+
+    def debug_of(location)
+      location.instance_variable_get(:@debug)
+    end
+
+    it "is disabled by default" do
+      expect(described_class.debug?).to be false
+      expect(debug_of(described_class.caller_locations.first)).to be nil
+    end
+
+    context "when enabled" do
+      before { described_class.debug = true }
+
+      it "includes debug information in the returned locations" do
+        expect(described_class.debug?).to be true
+        expect(debug_of(described_class.caller_locations.first)).to include(:ruby_frame?, :rb_profile_frames)
+        expect(debug_of(described_class.backtrace_locations(Thread.current).first)).to include(:ruby_frame?)
+        expect(debug_of(described_class.capture.first)).to include(:ruby_frame?)
+      end
+
+      it "can be overridden with debug: false" do
+        expect(debug_of(described_class.caller_locations(debug: false).first)).to be nil
+        expect(debug_of(described_class.backtrace_locations(Thread.current, debug: false).first)).to be nil
+      end
+    end
+
+    context "when disabled" do
+      it "can be overridden with debug: true" do
+        expect(debug_of(described_class.caller_locations(debug: true).first)).to include(:ruby_frame?)
+        expect(debug_of(described_class.backtrace_locations(Thread.current, debug: true).first)).to include(:ruby_frame?)
+        expect(debug_of(described_class.capture(debug: true).first)).to include(:ruby_frame?)
+      end
+    end
+  end
+
+  describe ".capture" do
+    let(:backtracie_stack) { described_class.capture.to_a }
+    let(:ruby_stack) { Kernel.caller_locations }
+
+    it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+    it "returns a Backtracie::Backtrace" do
+      expect(described_class.capture).to be_a(Backtracie::Backtrace)
+    end
   end
 
   describe ".backtrace_locations" do
@@ -100,6 +676,36 @@ RSpec.describe Backtracie do
       it_should_behave_like "an equivalent of the Ruby API (using locations)"
     end
 
+    context "when lazy: true" do
+      let!(:backtraces_for_comparison) {
+        # These two procs should never be reformatted to be on different lines! See above for a note on why.
+        [proc { described_class.backtrace_locations(Thread.main, lazy: true).to_a }, proc { Thread.main.backtrace_locations }]
+          .map { |target_proc| Thread.new(&target_proc).value }
+      }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when given a start and length" do
+      let!(:backtraces_for_comparison) {
+        # These two procs should never be reformatted to be on different lines! See above for a note on why.
+        [proc { described_class.backtrace_locations(Thread.main, 1, 3) }, proc { Thread.main.backtrace_locations(1, 3) }]
+          .map { |target_proc| Thread.new(&target_proc).value }
+      }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
+    context "when given a range" do
+      let!(:backtraces_for_comparison) {
+        # These two procs should never be reformatted to be on different lines! See above for a note on why.
+        [proc { described_class.backtrace_locations(Thread.main, 2..-3) }, proc { Thread.main.backtrace_locations(2..-3) }]
+          .map { |target_proc| Thread.new(&target_proc).value }
+      }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+    end
+
     context "when sampling an eval" do
       let!(:backtraces_for_comparison) {
         # These two function calls should never be reformatted to be on different lines!
@@ -692,6 +1298,44 @@ RSpec.describe Backtracie do
       end
     end
 
+    context "when sampling an anonymous class that later gets named" do
+      let(:klass) {
+        Class.new do
+          def test_method
+            yield
+          end
+        end
+      }
+
+      after { Object.send(:remove_const, :BacktracieClassNamedAfterSampling) }
+
+      def qualified_method_name_for(object)
+        object.test_method { described_class.backtrace_locations(Thread.current) }[2].qualified_method_name
+      end
+
+      it "uses the new name" do
+        expect(qualified_method_name_for(klass.new)).to eq "Object$anonymous#test_method"
+
+        Object.const_set(:BacktracieClassNamedAfterSampling, klass)
+
+        expect(qualified_method_name_for(klass.new)).to eq "BacktracieClassNamedAfterSampling#test_method"
+        expect(qualified_method_name_for(klass.new)).to eq "BacktracieClassNamedAfterSampling#test_method"
+      end
+
+      it "uses the new name for the singleton class of its instances" do
+        object = klass.new
+        def object.test_method
+          yield
+        end
+
+        expect(qualified_method_name_for(object)).to eq "Object$anonymous$singleton#test_method"
+
+        Object.const_set(:BacktracieClassNamedAfterSampling, klass)
+
+        expect(qualified_method_name_for(object)).to eq "BacktracieClassNamedAfterSampling$singleton#test_method"
+      end
+    end
+
     context "when sampling an eval triggered with :send" do
       class EvalTriggeredWithSend
         def test_method
@@ -755,4 +1399,35 @@ RSpec.describe Backtracie do
       expect(backtracie_backtrace).to be_empty
     end
   end
+
+  context "when keeping minimal frames around in a minimal frame wrapper" do
+    # Both need to be captured on the same line, see above
+    let!(:minimal_frames_and_ruby_stack) {
+      [1].map { [Backtracie::TestHelpers.minimal_frames_surviving_gc, Kernel.caller_locations(0)] }.first
+    }
+    let(:minimal_frames) { minimal_frames_and_ruby_stack.first }
+    let(:ruby_stack) { minimal_frames_and_ruby_stack.last }
+
+    it "survives the GC and returns the same paths and lines as Ruby" do
+      # The test helper is implemented in C, so it has no path
+      expect(minimal_frames[0]).to eq ["Backtracie::TestHelpers.minimal_frames_surviving_gc", nil, 0]
+
+      expect(minimal_frames.size).to eq ruby_stack.size + 1
+      minimal_frames[1..-1].zip(ruby_stack).each do |(_name, path, lineno), location|
+        # Methods implemented in C have no path (whereas Ruby reports the path of their caller)
+        next if path.nil? && lineno == 0
+
+        expect(path).to eq location.absolute_path
+        expect(lineno).to eq location.lineno
+      end
+    end
+  end
+
+  context "when sampling a dead thread with lazy: true" do
+    let(:dead_thread) { Thread.new {}.tap(&:join) }
+
+    it "returns nil" do
+      expect(described_class.backtrace_locations(dead_thread, lazy: true)).to be nil
+    end
+  end
 end
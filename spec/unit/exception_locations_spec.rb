@@ -0,0 +1,92 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+require "backtracie"
+
+RSpec.describe Backtracie::ExceptionLocations do
+  before { Backtracie.track_exceptions! }
+  after { Backtracie.stop_tracking_exceptions! }
+
+  def raise_an_error
+    raise "boom"
+  end
+
+  def raise_and_rescue
+    raise_an_error
+  rescue => e
+    e
+  end
+
+  it "captures the frames of raised exceptions" do
+    exception = raise_and_rescue
+
+    locations = exception.backtracie_locations.to_a
+    ruby_locations = exception.backtrace_locations
+
+    expect(locations.map(&:path)).to eq ruby_locations.map(&:path)
+    expect(locations.map(&:lineno)).to eq ruby_locations.map(&:lineno)
+    expect(locations.first.qualified_method_name).to eq "#{self.class.name}#raise_an_error"
+  end
+
+  it "returns a lazy Backtracie::Backtrace" do
+    expect(raise_and_rescue.backtracie_locations).to be_a(Backtracie::Backtrace)
+  end
+
+  it "includes the native method when the exception is raised by native code" do
+    exception = begin
+      1 / 0
+    rescue ZeroDivisionError => e
+      e
+    end
+
+    expect(exception.backtracie_locations.first.qualified_method_name).to eq "Integer#/"
+  end
+
+  it "keeps the original frames when an exception is re-raised" do
+    exception = raise_and_rescue
+    original_lineno = exception.backtracie_locations.first.lineno
+
+    reraised = begin
+      raise exception
+    rescue => e
+      e
+    end
+
+    expect(reraised.backtracie_locations.first.lineno).to be original_lineno
+  end
+
+  it "does not expose the captured frames as an instance variable" do
+    expect(raise_and_rescue.instance_variables).to eq []
+  end
+
+  it "drops the captured frames when the exception gets marshaled" do
+    exception = Marshal.load(Marshal.dump(raise_and_rescue))
+
+    expect(exception.message).to eq "boom"
+    expect(exception.backtracie_locations).to be nil
+  end
+
+  it "does not capture anything for exceptions raised while not tracking" do
+    Backtracie.stop_tracking_exceptions!
+
+    expect(Backtracie.tracking_exceptions?).to be false
+    expect(raise_and_rescue.backtracie_locations).to be nil
+  end
+end
@@ -0,0 +1,108 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+require "backtracie"
+
+RSpec.describe Backtracie::Filter do
+  def locations_for(filter)
+    [1].map { Backtracie.caller_locations(0, filter: filter) }.first
+  end
+
+  it "accepts every frame by default" do
+    expect(locations_for(described_class.new).map(&:to_s)).to eq(locations_for(nil).map(&:to_s))
+  end
+
+  describe "include_paths:" do
+    subject(:filter) { described_class.new(include_paths: [__dir__]) }
+
+    it "only keeps frames with a path starting with one of the given prefixes" do
+      locations = locations_for(filter)
+
+      expect(locations.map(&:absolute_path)).to all(start_with(__dir__))
+      expect(locations.size).to be >= 2
+    end
+
+    it "keeps C frames called from a matching path" do
+      expect(locations_for(filter).map(&:label)).to include("map")
+    end
+  end
+
+  describe "exclude_paths:" do
+    subject(:filter) { described_class.new(exclude_paths: [__dir__, "/nonexistent"]) }
+
+    it "drops frames with a path starting with one of the given prefixes" do
+      locations = locations_for(filter)
+
+      expect(locations.map(&:absolute_path).grep(/\A#{Regexp.escape(__dir__)}/)).to eq []
+      expect(locations.size).to be locations_for(nil).count { |location| !location.absolute_path.start_with?(__dir__) }
+    end
+  end
+
+  describe "skip_cfuncs:" do
+    it "drops frames for methods implemented in native code" do
+      labels = locations_for(described_class.new(skip_cfuncs: true)).map(&:label)
+
+      expect(locations_for(nil).map(&:label)).to include("map")
+      expect(labels).to_not include("map")
+      expect(labels.first).to eq "block in locations_for"
+    end
+  end
+
+  describe "skip_blocks:" do
+    it "drops frames for blocks" do
+      labels = locations_for(described_class.new(skip_blocks: true)).map(&:label)
+
+      expect(labels.grep(/\Ablock /)).to eq []
+      expect(labels.first).to eq "map"
+    end
+  end
+
+  it "can be used with each_caller_location" do
+    filter = described_class.new(include_paths: [__dir__], skip_cfuncs: true)
+    streamed = []
+    Backtracie.each_caller_location(0, filter: filter) { |location| streamed << location }
+
+    expect(streamed.map(&:lineno)).to eq(Backtracie.caller_locations(0, filter: filter).map(&:lineno).tap { |linenos| linenos[0] = __LINE__ - 2 })
+  end
+
+  it "can be used with backtrace_locations" do
+    filter = described_class.new(include_paths: [__dir__])
+
+    expect(Backtracie.backtrace_locations(Thread.current, filter: filter).map(&:absolute_path)).to all(start_with(__dir__))
+  end
+
+  it "exposes its configuration" do
+    filter = described_class.new(include_paths: ["/a", "/b"], exclude_paths: ["/a/c"], skip_cfuncs: true)
+
+    expect(filter.include_paths).to eq ["/a", "/b"]
+    expect(filter.exclude_paths).to eq ["/a/c"]
+    expect(filter.skip_cfuncs?).to be true
+    expect(filter.skip_blocks?).to be false
+  end
+
+  it "raises an ArgumentError when used with lazy: true" do
+    expect { Backtracie.caller_locations(filter: described_class.new, lazy: true) }.to raise_exception(ArgumentError)
+  end
+
+  it "raises a TypeError for invalid arguments" do
+    expect { described_class.new(include_paths: [:symbol]) }.to raise_exception(TypeError)
+    expect { Backtracie.caller_locations(filter: :not_a_filter) }.to raise_exception(TypeError)
+  end
+end
@@ -0,0 +1,98 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+
+require "backtracie"
+require "unit/folded_helper"
+
+RSpec.describe Backtracie::FoldedAggregator do
+  include FoldedHelper
+
+  subject(:aggregator) { described_class.new }
+
+  def folded_lines
+    parse_folded(aggregator.to_folded)
+  end
+
+  def add_from_helper
+    aggregator.add_current_thread
+  end
+
+  it "starts out empty" do
+    expect(aggregator.to_folded).to eq ""
+  end
+
+  describe "#add_current_thread" do
+    it "counts each distinct stack once, starting from the bottom of the stack" do
+      3.times { add_from_helper }
+      add_from_helper
+
+      expect(folded_lines.size).to be 2
+      expect(folded_lines.map(&:last)).to contain_exactly(3, 1)
+
+      stack, _ = folded_lines.find { |_, count| count == 3 }
+      expect(stack.last).to eq "RSpec::ExampleGroups::BacktracieFoldedAggregator#add_from_helper"
+      expect(stack[-2]).to eq "#{self.class.name}$singleton\#{block}"
+      expect(stack[-3]).to eq "Integer#times"
+      expect(stack.first).to eq "Object$<main>#<main>"
+    end
+
+    it "keeps the same frames as Backtracie.caller_locations" do
+      locations = Backtracie.caller_locations(0)
+      aggregator.add_current_thread
+
+      stack, _ = folded_lines.first
+      expect(stack.reverse.drop(1)).to eq locations.drop(1).map(&:qualified_method_name)
+    end
+  end
+
+  describe "#add_thread" do
+    it "adds the stack of the given thread" do
+      queue = Queue.new
+      thread = Thread.new { queue.pop }
+      sleep 0.01 until thread.status == "sleep"
+
+      aggregator.add_thread(thread)
+      queue << :done
+      thread.join
+
+      stack, count = folded_lines.first
+      expect(stack.last).to eq "Thread::Queue#pop"
+      expect(count).to be 1
+    end
+
+    it "ignores dead threads" do
+      aggregator.add_thread(Thread.new {}.tap(&:join))
+
+      expect(aggregator.to_folded).to eq ""
+    end
+
+    it "raises when given something that is not a thread" do
+      expect { aggregator.add_thread(:not_a_thread) }.to raise_error(ArgumentError)
+    end
+  end
+
+  it "keeps the counts in its stack trie" do
+    add_from_helper
+
+    expect(aggregator.stack_trie).to be_a(Backtracie::StackTrie)
+    expect(aggregator.stack_trie.to_pprof).to_not be_empty
+  end
+end
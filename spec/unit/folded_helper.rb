@@ -0,0 +1,28 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+# Helpers for specs that check the stacks in the folded format (see Backtracie::FoldedAggregator)
+module FoldedHelper
+  # Parses a folded string into an array of [stack, count] pairs, where stack is an array of frame names (with the
+  # bottom of the stack first)
+  def parse_folded(folded)
+    folded.lines.map { |line| line.chomp.rpartition(" ") }.map { |stack, _, count| [stack.split(";"), Integer(count)] }
+  end
+end
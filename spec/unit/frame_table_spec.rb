@@ -0,0 +1,101 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+require "backtracie"
+
+RSpec.describe Backtracie::FrameTable do
+  subject(:frame_table) { described_class.new }
+
+  def sample_ids
+    frame_table.backtrace_ids(Thread.current)
+  end
+
+  describe "#backtrace_ids" do
+    it "returns the same stack as Backtracie.backtrace_locations" do
+      # These two calls should never be reformatted to be on different lines! See backtracie_spec.rb for why.
+      ids, backtracie_stack = [sample_ids, Backtracie.backtrace_locations(Thread.current)]
+
+      # The first two frames are backtrace_ids + sample_ids, and backtrace_locations
+      expect(frame_table.locations(ids).drop(2).map(&:to_s)).to eq backtracie_stack.drop(1).map(&:to_s)
+      expect(ids).to all(be_a(Integer))
+    end
+
+    it "returns the same ids when the same stack is captured again" do
+      stacks = Array.new(3) { sample_ids }
+
+      expect(stacks.uniq.size).to be 1
+      expect(frame_table.size).to be stacks.first.uniq.size
+    end
+
+    it "returns different ids for frames on different lines" do
+      first_ids = sample_ids
+      second_ids = sample_ids
+
+      # the caller of sample_ids
+      expect(first_ids[2]).to_not be second_ids[2]
+      expect(first_ids.drop(3)).to eq second_ids.drop(3)
+    end
+
+    it "returns nil for a dead thread" do
+      expect(frame_table.backtrace_ids(Thread.new {}.tap(&:join))).to be nil
+    end
+
+    it "keeps working after the table grows" do
+      stacks = Array.new(200) { |line| eval("sample_ids", binding, "frame_table_spec_eval.rb", line) }
+
+      expect(frame_table.size).to be > 200
+      stacks.each_with_index do |ids, line|
+        expect(frame_table.locations(ids)[2].lineno).to be line
+      end
+      expect(stacks.map { |ids| ids.last(5) }.uniq.size).to be 1
+    end
+  end
+
+  describe "#locations" do
+    it "raises an IndexError for unknown ids" do
+      expect { frame_table.locations([frame_table.size]) }.to raise_exception(IndexError)
+    end
+
+    it "uses the caller ruby frame for the path and lineno of C frames" do
+      ids = [1].map { sample_ids }.first
+      locations = frame_table.locations(ids)
+      map_location = locations[3]
+
+      expect(map_location.label).to eq "map"
+      expect(map_location.lineno).to be locations[4].lineno
+      expect(map_location.path_is_synthetic).to be true
+    end
+  end
+
+  if GC.respond_to?(:compact)
+    context "when the heap gets compacted" do
+      it "still returns the same locations and ids" do
+        ids = sample_ids
+        before = frame_table.locations(ids).map(&:to_s)
+
+        GC.verify_compaction_references(toward: :empty, double_heap: true) rescue GC.compact
+        GC.compact
+
+        expect(frame_table.locations(ids).map(&:to_s)).to eq before
+        expect(frame_table.backtrace_ids(Thread.current).drop(2)).to eq ids.drop(3)
+      end
+    end
+  end
+end
@@ -0,0 +1,173 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+
+require "backtracie"
+require "stringio"
+require "zlib"
+
+RSpec.describe Backtracie::Pprof do
+  # Just enough of a protobuf decoder to read back our profiles: returns a hash of field number => array of values
+  def decode_message(bytes)
+    io = StringIO.new(bytes)
+    fields = Hash.new { |hash, key| hash[key] = [] }
+    until io.eof?
+      tag = read_varint(io)
+      case tag & 7
+      when 0 then fields[tag >> 3] << read_varint(io)
+      when 2 then fields[tag >> 3] << io.read(read_varint(io))
+      else raise "Unexpected wire type in tag #{tag}"
+      end
+    end
+    fields
+  end
+
+  def read_varint(io)
+    value = 0
+    shift = 0
+    loop do
+      byte = io.readbyte
+      value |= (byte & 0x7f) << shift
+      return value if byte < 0x80
+      shift += 7
+    end
+  end
+
+  def decode_packed(bytes)
+    io = StringIO.new(bytes.to_s)
+    values = []
+    values << read_varint(io) until io.eof?
+    values
+  end
+
+  def decode_profile(encoded)
+    profile = decode_message(encoded)
+    strings = profile[6]
+    value_type = lambda do |bytes|
+      fields = decode_message(bytes)
+      [strings[fields[1].first || 0], strings[fields[2].first || 0]]
+    end
+
+    functions = profile[5].map { |bytes| decode_message(bytes) }.map do |fields|
+      [fields[1].first, [strings[fields[2].first || 0], strings[fields[4].first || 0]]]
+    end.to_h
+    locations = profile[4].map { |bytes| decode_message(bytes) }.map do |fields|
+      line = decode_message(fields[4].first)
+      [fields[1].first, functions.fetch(line[1].first) + [line[2].first || 0]]
+    end.to_h
+    samples = profile[2].map { |bytes| decode_message(bytes) }.map do |fields|
+      {
+        frames: decode_packed(fields[1].first).map { |id| locations.fetch(id) },
+        value: decode_packed(fields[2].first).first
+      }
+    end
+
+    {
+      strings: strings,
+      functions: functions.values,
+      sample_type: value_type.call(profile[1].first),
+      samples: samples,
+      period_type: (value_type.call(profile[11].first) unless profile[11].empty?),
+      period: profile[12].first
+    }
+  end
+
+  def gunzip(compressed)
+    Zlib::GzipReader.new(StringIO.new(compressed)).read.b
+  end
+
+  describe "Backtracie::StackTrie#to_pprof" do
+    let(:stack_trie) { Backtracie::StackTrie.new }
+
+    def capture_twice_deep
+      capture_once
+    end
+
+    def capture_once
+      stack_trie.capture(Thread.current)
+    end
+
+    before do
+      3.times { capture_twice_deep }
+      capture_once
+    end
+
+    subject(:profile) { decode_profile(stack_trie.to_pprof) }
+
+    it "starts the string table with the empty string" do
+      expect(profile[:strings].first).to eq ""
+    end
+
+    it "includes a sample for each stack, with the number of times it was inserted" do
+      expect(profile[:samples].map { |sample| sample[:value] }).to contain_exactly(3, 1)
+
+      deep_sample = profile[:samples].find { |sample| sample[:value] == 3 }
+      expect(deep_sample[:frames][0]).to eq ["Backtracie::StackTrie#capture", "", 0]
+      expect(deep_sample[:frames][1][0..1]).to eq ["RSpec::ExampleGroups::BacktraciePprof::BacktracieStackTrieToPprof#capture_once", __FILE__]
+      expect(deep_sample[:frames][2][0..1]).to eq ["RSpec::ExampleGroups::BacktraciePprof::BacktracieStackTrieToPprof#capture_twice_deep", __FILE__]
+    end
+
+    it "deduplicates strings and functions" do
+      expect(profile[:strings].uniq).to eq profile[:strings]
+      expect(profile[:functions].uniq).to eq profile[:functions]
+    end
+
+    it "uses samples/count as the default sample type" do
+      expect(profile[:sample_type]).to eq ["samples", "count"]
+      expect(profile[:period_type]).to be nil
+    end
+
+    it "supports setting the sample type" do
+      profile = decode_profile(stack_trie.to_pprof(sample_type: :requests, sample_unit: :count))
+
+      expect(profile[:sample_type]).to eq ["requests", "count"]
+    end
+
+    it "returns a gzipped profile when compress is true" do
+      expect(gunzip(stack_trie.to_pprof(compress: true))).to eq stack_trie.to_pprof
+    end
+
+    it "writes the profile to the given io" do
+      io = StringIO.new("".b)
+
+      expect(stack_trie.to_pprof(compress: true, io: io)).to be io
+      expect(gunzip(io.string)).to eq stack_trie.to_pprof
+    end
+  end
+
+  describe "Backtracie::Sampler#to_pprof" do
+    let(:sampler) { Backtracie::Sampler.new(frequency: 1000) }
+
+    after { sampler.stop }
+
+    it "adds up samples with the same stack, and records the sampling period" do
+      sampler.start
+      sleep 0.01 while sampler.result.size < 5
+      sampler.stop
+
+      profile = decode_profile(sampler.to_pprof)
+
+      expect(profile[:samples].map { |sample| sample[:value] }.sum).to eq sampler.result.size
+      expect(profile[:samples].size).to be < sampler.result.size
+      expect(profile[:period_type]).to eq ["wall", "nanoseconds"]
+      expect(profile[:period]).to eq 1_000_000
+    end
+  end
+end
@@ -0,0 +1,110 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+
+require "backtracie"
+
+RSpec.describe "Backtracie ring buffer (via Backtracie::TestHelpers)" do
+  let(:test_helpers) { Backtracie::TestHelpers }
+  let(:ring_buffer) { test_helpers.ring_buffer_new(64 * 1024, 512) }
+
+  def drain_all
+    stacks = []
+    while (stack = test_helpers.ring_buffer_drain(ring_buffer))
+      stacks << stack
+    end
+    stacks
+  end
+
+  it "captures the stack of the current thread" do
+    captured, locations = [1].map { [test_helpers.ring_buffer_capture(ring_buffer), Backtracie.caller_locations(0)] }.first
+
+    expect(captured).to be true
+    thread, names = test_helpers.ring_buffer_drain(ring_buffer)
+    expect(thread).to be Thread.current
+    expect(names.first).to eq "Backtracie::TestHelpers.ring_buffer_capture"
+    expect(names.drop(1)).to eq locations.map(&:qualified_method_name)
+  end
+
+  it "does not capture stacks from threads without the GVL" do
+    # Before Ruby 3.0, the thread that last held the GVL is still the current one until another thread takes it
+    if RUBY_VERSION >= "3.0"
+      expect(test_helpers.ring_buffer_capture_without_gvl(ring_buffer)).to be false
+      expect(test_helpers.ring_buffer_dropped(ring_buffer)).to be 1
+      expect(test_helpers.ring_buffer_drain(ring_buffer)).to be nil
+    end
+  end
+
+  it "returns nil once every stack was drained" do
+    2.times { test_helpers.ring_buffer_capture(ring_buffer) }
+
+    expect(drain_all.size).to be 2
+    expect(test_helpers.ring_buffer_drain(ring_buffer)).to be nil
+  end
+
+  it "keeps stacks alive until they get drained" do
+    anonymous_class = Class.new do
+      def capture(helpers, buffer)
+        helpers.ring_buffer_capture(buffer)
+      end
+    end
+    anonymous_class.new.capture(test_helpers, ring_buffer)
+    anonymous_class = nil
+
+    GC.compact if GC.respond_to?(:compact)
+    GC.start
+
+    _, names = test_helpers.ring_buffer_drain(ring_buffer)
+    expect(names[1]).to eq "Object$anonymous#capture"
+  end
+
+  context "when the ring buffer is full" do
+    let(:ring_buffer) { test_helpers.ring_buffer_new(16, 10) }
+
+    it "drops stacks" do
+      expect(test_helpers.ring_buffer_capture(ring_buffer)).to be true
+      expect(test_helpers.ring_buffer_capture(ring_buffer)).to be false
+      expect(test_helpers.ring_buffer_dropped(ring_buffer)).to be 1
+
+      expect(test_helpers.ring_buffer_drain(ring_buffer)).to_not be nil
+      expect(test_helpers.ring_buffer_capture(ring_buffer)).to be true
+    end
+
+    it "cuts stacks short at max_depth" do
+      test_helpers.ring_buffer_capture(ring_buffer)
+
+      expect(test_helpers.ring_buffer_drain(ring_buffer).last.size).to be 10
+    end
+  end
+
+  def spin_for_a_bit
+    deadline = Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) + 0.05
+    nil while Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID) < deadline
+  end
+
+  it "captures stacks from a SIGPROF signal handler" do
+    test_helpers.ring_buffer_capture_on_sigprof(ring_buffer) { spin_for_a_bit }
+
+    stacks = drain_all
+    expect(stacks).to_not be_empty
+    expect(stacks.map(&:first).uniq).to eq [Thread.current]
+    expect(stacks.count { |_, names| names.include?("#{self.class.name}#spin_for_a_bit") }).to be > 0
+  end
+end
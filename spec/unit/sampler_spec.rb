@@ -0,0 +1,169 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+require "backtracie"
+
+RSpec.describe Backtracie::Sampler do
+  subject(:sampler) { described_class.new(frequency: 1000) }
+
+  after { sampler.stop }
+
+  def busy_method(duration)
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + duration
+    nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+  end
+
+  def sleeping_method(queue)
+    queue.pop
+  end
+
+  def samples_for(thread)
+    sampler.result.select { |sample| sample.thread == thread }
+  end
+
+  it "samples the running thread" do
+    sampler.start
+    busy_method(0.1)
+    sampler.stop
+
+    samples = samples_for(Thread.current)
+
+    expect(samples).to_not be_empty
+    expect(samples).to all(be_a(Backtracie::Sampler::Sample))
+    expect(samples.first.timestamp).to be_a(Integer)
+    expect(samples.map(&:timestamp)).to eq samples.map(&:timestamp).sort
+
+    frame = samples.flat_map(&:frames).find { |it| it.qualified_method_name.end_with?("#busy_method") }
+    expect(frame).to be_a(Backtracie::Sampler::Frame)
+    busy_method_line = method(:busy_method).source_location.last
+    expect(frame.lineno).to be_between(busy_method_line + 1, busy_method_line + 2)
+    expect(frame.path).to eq __FILE__
+  end
+
+  it "samples threads that are not running" do
+    queue = Queue.new
+    sleeping_thread = Thread.new { sleeping_method(queue) }
+    Thread.pass until sleeping_thread.status == "sleep"
+
+    sampler.start
+    busy_method(0.1)
+    sampler.stop
+    queue << nil
+    sleeping_thread.join
+
+    frame_names = samples_for(sleeping_thread).flat_map(&:frames).map(&:qualified_method_name)
+    expect(frame_names.grep(/#sleeping_method\z/)).to_not be_empty
+  end
+
+  it "stops sampling once stopped" do
+    sampler.start
+    busy_method(0.05)
+    sampler.stop
+    sample_count = sampler.result.size
+    busy_method(0.05)
+
+    expect(sampler.result.size).to be sample_count
+    expect(sampler.running?).to be false
+  end
+
+  it "drops samples once the buffers are full" do
+    sampler = described_class.new(frequency: 1000, max_samples: 1)
+
+    sampler.start
+    busy_method(0.05)
+    sampler.stop
+
+    expect(sampler.result.size).to be 1
+    expect(sampler.dropped_samples).to be > 0
+  end
+
+  it "limits the number of frames in each sample to max_depth" do
+    sampler = described_class.new(frequency: 1000, max_depth: 2)
+
+    sampler.start
+    busy_method(0.05)
+    sampler.stop
+
+    expect(sampler.result.map { |sample| sample.frames.size }).to all(be <= 2)
+  end
+
+  describe "#clear" do
+    it "discards all samples" do
+      sampler.start
+      busy_method(0.05)
+      sampler.stop
+
+      sampler.clear
+
+      expect(sampler.result).to be_empty
+      expect(sampler.dropped_samples).to be 0
+    end
+  end
+
+  describe "#start" do
+    it "returns false when the sampler is already running" do
+      expect(sampler.start).to be true
+      expect(sampler.start).to be false
+      expect(sampler.running?).to be true
+    end
+
+    it "raises when another sampler is already running" do
+      sampler.start
+
+      expect { described_class.new.start }.to raise_exception(RuntimeError, /already running/)
+    end
+  end
+
+  it "gets stopped when Ruby exits while it's still running" do
+    # at_exit blocks run in reverse order, so this one runs after the one registered by backtracie
+    code = <<~RUBY
+      sampler = nil
+      at_exit { puts sampler.running? }
+      require "backtracie"
+      sampler = Backtracie::Sampler.new(frequency: 1000)
+      sampler.start
+      Array.new(10) { Thread.new { 10_000.times { "x" * 10 } } }.each(&:join)
+    RUBY
+    output = IO.popen([RbConfig.ruby, "-I", File.expand_path("../../lib", __dir__), "-e", code], &:read)
+
+    expect(output).to eq "false\n"
+    expect($?.success?).to be true
+  end
+
+  if Process.respond_to?(:fork)
+    it "can be stopped in a process forked while it was running" do
+      sampler.start
+      pid = fork do
+        sampler.stop
+        exit!(sampler.running? ? 1 : 0)
+      end
+      Process.wait(pid)
+
+      expect($?.success?).to be true
+      expect(sampler.running?).to be true
+    end
+  end
+
+  it "raises an ArgumentError for invalid arguments" do
+    expect { described_class.new(frequency: 0) }.to raise_exception(ArgumentError)
+    expect { described_class.new(max_depth: 0) }.to raise_exception(ArgumentError)
+    expect { described_class.new(unknown: 1) }.to raise_exception(ArgumentError)
+  end
+end
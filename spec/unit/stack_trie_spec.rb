@@ -0,0 +1,128 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+require "backtracie"
+
+RSpec.describe Backtracie::StackTrie do
+  subject(:stack_trie) { described_class.new }
+
+  let(:frame_table) { stack_trie.frame_table }
+
+  def sample_ids
+    frame_table.backtrace_ids(Thread.current)
+  end
+
+  it "starts with only the root node" do
+    expect(stack_trie.size).to be 1
+    expect(stack_trie.frame_ids(0)).to eq []
+    expect(stack_trie.parent(0)).to be nil
+  end
+
+  it "uses the given frame table" do
+    frame_table = Backtracie::FrameTable.new
+
+    expect(described_class.new(frame_table).frame_table).to be frame_table
+  end
+
+  it "can't be reinitialized with another frame table" do
+    stack_trie.capture(Thread.current)
+
+    expect { stack_trie.send(:initialize, Backtracie::FrameTable.new) }.to raise_exception(RuntimeError)
+    expect(stack_trie.to_pprof).to be_a String
+  end
+
+  describe "#insert" do
+    it "returns a node that walks back to the same stack" do
+      ids = sample_ids
+
+      node = stack_trie.insert(ids)
+
+      expect(stack_trie.frame_ids(node)).to eq ids
+      expect(stack_trie.size).to be(ids.size + 1)
+    end
+
+    it "returns the same node for the same stack" do
+      ids = sample_ids
+
+      expect(stack_trie.insert(ids)).to be stack_trie.insert(ids)
+    end
+
+    it "stores shared prefixes only once" do
+      first_ids = sample_ids
+      second_ids = sample_ids
+
+      first_node = stack_trie.insert(first_ids)
+      second_node = stack_trie.insert(second_ids)
+
+      # Only the caller of sample_ids is different, and thus only that and the frames above it get new nodes
+      expect(stack_trie.size).to be(first_ids.size + 1 + 3)
+      expect(stack_trie.parent(stack_trie.parent(stack_trie.parent(first_node))))
+        .to be stack_trie.parent(stack_trie.parent(stack_trie.parent(second_node)))
+    end
+
+    it "keeps per-node counts" do
+      first_node = stack_trie.insert(sample_ids)
+      stack_trie.insert(frame_table.backtrace_ids(Thread.current).drop(2))
+      2.times { stack_trie.insert(stack_trie.frame_ids(first_node)) }
+
+      expect(stack_trie.count(first_node)).to be 3
+      expect(stack_trie.total_count(first_node)).to be 3
+      expect(stack_trie.count(0)).to be 0
+      expect(stack_trie.total_count(0)).to be 4
+    end
+
+    it "raises an IndexError for unknown frame ids" do
+      expect { stack_trie.insert([frame_table.size]) }.to raise_exception(IndexError)
+    end
+  end
+
+  describe "#capture" do
+    it "inserts the backtrace of the given thread" do
+      # These two calls should never be reformatted to be on different lines! See backtracie_spec.rb for why.
+      node, backtracie_stack = [stack_trie.capture(Thread.current), Backtracie.backtrace_locations(Thread.current)]
+
+      expect(stack_trie.locations(node).drop(1).map(&:to_s)).to eq backtracie_stack.drop(1).map(&:to_s)
+      expect(stack_trie.count(node)).to be 1
+    end
+
+    it "returns nil for a dead thread" do
+      expect(stack_trie.capture(Thread.new {}.tap(&:join))).to be nil
+    end
+  end
+
+  it "raises an IndexError for unknown nodes" do
+    expect { stack_trie.count(stack_trie.size) }.to raise_exception(IndexError)
+    expect { stack_trie.frame_ids(stack_trie.size) }.to raise_exception(IndexError)
+  end
+
+  it "keeps its frames alive" do
+    sampler = Class.new do
+      def self.sample(stack_trie)
+        stack_trie.capture(Thread.current)
+      end
+    end
+    node = sampler.sample(stack_trie)
+
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+
+    expect(stack_trie.locations(node)[1].label).to eq "sample"
+  end
+end